@@ -0,0 +1,65 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+// Timing helpers shared by the benchmarks in bench/.
+
+#include "binary_io.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Seconds taken by the fastest of 'runs' calls to 'body'.
+template <typename Body>
+double bestOf(int runs, Body body)
+{
+    double best = 1e300;
+    for (int i = 0; i < runs; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body();
+        std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+        best = std::min(best, took.count());
+    }
+    return best;
+}
+
+// FNV-1a over a field, with a separator folded in so ("ab", "c") and
+// ("a", "bc") hash differently. Lets a benchmark show that two
+// implementations produced the same output without storing it.
+inline uint64_t hashField(uint64_t hash, std::string_view field)
+{
+    return (fnv1a(field, hash) ^ 0xff) * kFnvPrime;
+}
+
+constexpr uint64_t kHashSeed = kFnvOffsetBasis;
+
+// Reads "--name value" style options: returns the value after 'name', or
+// 'fallback' if it is not given.
+inline const char *optionValue(int argc, char *argv[], const char *name, const char *fallback)
+{
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (std::strcmp(argv[i], name) == 0)
+            return argv[i + 1];
+    }
+    return fallback;
+}
+
+inline long optionCount(int argc, char *argv[], const char *name, long fallback)
+{
+    const char *value = optionValue(argc, argv, name, nullptr);
+    return value ? std::strtol(value, nullptr, 10) : fallback;
+}
+
+inline void printRate(const char *label, double seconds, double items, const char *unit, double bytes)
+{
+    std::printf("  %-28s %9.3f ms  %12.0f %s/s  %9.1f MiB/s\n", label, seconds * 1e3, items / seconds, unit,
+                bytes / seconds / (1024.0 * 1024.0));
+}
+
+#endif // BENCH_COMMON_H
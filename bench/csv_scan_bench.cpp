@@ -0,0 +1,311 @@
+// Compares CSVReader and its vectorized scanner with the getline-based
+// reader it replaced, on input shaped like fake_print_data.csv.
+//
+//   csv_scan_bench [--csv <file>] [--rows <n>] [--field-lines <n>] [--runs <n>]
+//
+// Without --csv, a file of --rows rows (default 300000) is generated in the
+// temporary directory. A second case parses one record whose quoted field
+// spans --field-lines lines (default 2000), where the old reader rescanned
+// the whole record for every line. Set FAKEPRINTER_CSV_SCANNER=scalar|sse2|avx2
+// to measure a particular scanner. The generated file, or --csv, is then
+// read with ParallelCSVReader on 1, 2, 4 and 8 threads.
+
+#include "bench_common.h"
+#include "csv_reader.h"
+#include "csv_scanner.h"
+#include "mapped_file.h"
+#include "parallel_csv_reader.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// The reader CSVReader replaced: getline, a quote count over the whole
+// record per continuation line, and a per-character state machine.
+class GetlineCSVReader
+{
+public:
+    explicit GetlineCSVReader(const std::string &filename) : file(filename) {}
+
+    bool readNextRow(std::vector<std::string> &row)
+    {
+        row.clear();
+        std::string record;
+        if (!std::getline(file, record))
+            return false;
+        while (!isRecordComplete(record))
+        {
+            std::string nextLine;
+            if (!std::getline(file, nextLine))
+                break;
+            record += "\n" + nextLine;
+        }
+        parseRecord(record, row);
+        return true;
+    }
+
+private:
+    std::ifstream file;
+
+    static bool isRecordComplete(const std::string &record)
+    {
+        size_t count = 0;
+        for (char c : record)
+        {
+            if (c == '"')
+                count++;
+        }
+        return count % 2 == 0;
+    }
+
+    static void parseRecord(const std::string &record, std::vector<std::string> &fields)
+    {
+        std::string field;
+        bool inQuotes = false;
+        for (size_t i = 0; i < record.size(); ++i)
+        {
+            char c = record[i];
+            if (inQuotes)
+            {
+                if (c == '"')
+                {
+                    if (i + 1 < record.size() && record[i + 1] == '"')
+                    {
+                        field.push_back('"');
+                        i++;
+                    }
+                    else
+                    {
+                        inQuotes = false;
+                    }
+                }
+                else
+                {
+                    field.push_back(c);
+                }
+            }
+            else if (c == '"')
+            {
+                inQuotes = true;
+            }
+            else if (c == ',')
+            {
+                fields.push_back(field);
+                field.clear();
+            }
+            else
+            {
+                field.push_back(c);
+            }
+        }
+        fields.push_back(field);
+    }
+};
+
+static const char *kHeader =
+    "layerError,layerNumber,layerHeight,materialType,extrusionTemperature,printSpeed,layerAdhesionQuality,"
+    "infillDensity,infillPattern,shellThickness,overhangAngle,coolingFanSpeed,retractionSettings,"
+    "zOffsetAdjustment,printBedTemperature,layerTime,fileName,imageUrl\n";
+
+// Rows like the print data: mostly plain fields, some quoted ones with
+// commas, and now and then an escaped quote or a line break inside quotes.
+static void writeRows(const std::string &path, long rows)
+{
+    std::mt19937 random(42);
+    const char *errors[] = {"SUCCESS", "SUCCESS", "SUCCESS", "UNDER_EXTRUSION", "LAYER_SHIFT"};
+    const char *materials[] = {"PLA", "PETG", "ABS", "TPU"};
+    const char *qualities[] = {"Good", "Fair", "Poor"};
+    const char *patterns[] = {"Grid", "Honeycomb", "Lines", "Gyroid"};
+    const char *retractions[] = {"5mm", "\"6mm, 40mm/s\"", "\"4mm, \"\"fast\"\"\"", "\"3mm,\nslow\""};
+    std::FILE *out = std::fopen(path.c_str(), "w");
+    if (!out)
+    {
+        std::perror(path.c_str());
+        std::exit(1);
+    }
+    std::fputs(kHeader, out);
+    for (long i = 1; i <= rows; ++i)
+    {
+        unsigned r = random();
+        std::fprintf(out,
+                     "%s,%ld,0.%u,%s,%u,%u,%s,%u,%s,%u,%u,%u,%s,0.0%u,%u,%umin_%usec,fl_layer_%ld.png,"
+                     "https://picsum.photos/seed/%ld/1920/1080\n",
+                     errors[r % 5], i, 1 + r % 3, materials[(r >> 3) % 4], 190 + (r >> 5) % 60,
+                     20 + (r >> 8) % 80, qualities[(r >> 10) % 3], (r >> 12) % 100, patterns[(r >> 14) % 4],
+                     1 + (r >> 16) % 3, (r >> 18) % 90, (r >> 20) % 100,
+                     retractions[(r >> 22) % 16 < 13 ? 0 : 1 + (r >> 22) % 3], (r >> 24) % 10,
+                     50 + (r >> 26) % 40, (r >> 27) % 10, (r >> 28) % 60, i, i);
+    }
+    std::fclose(out);
+}
+
+// One record whose quoted field runs over 'lines' lines.
+static void writeLongField(const std::string &path, long lines)
+{
+    std::FILE *out = std::fopen(path.c_str(), "w");
+    if (!out)
+    {
+        std::perror(path.c_str());
+        std::exit(1);
+    }
+    std::fputs(kHeader, out);
+    std::fputs("SUCCESS,1,0.2,PLA,200,50,Good,20,Grid,1,45,100,\"", out);
+    for (long i = 0; i < lines; ++i)
+        std::fprintf(out, "retraction note %ld, with a comma and \"\"quotes\"\" in it\n", i);
+    std::fputs("\",0.0,60,1sec,fl_layer_1.png,https://picsum.photos/seed/1/1920/1080\n", out);
+    std::fclose(out);
+}
+
+struct Pass
+{
+    long rows = 0;
+    // Field bytes when timing; a hash of every field when checking.
+    uint64_t digest = 0;
+};
+
+template <bool Hash>
+static Pass readGetline(const std::string &path)
+{
+    Pass pass;
+    pass.digest = Hash ? kHashSeed : 0;
+    GetlineCSVReader reader(path);
+    std::vector<std::string> row;
+    while (reader.readNextRow(row))
+    {
+        pass.rows++;
+        for (const std::string &field : row)
+            pass.digest = Hash ? hashField(pass.digest, field) : pass.digest + field.size();
+    }
+    return pass;
+}
+
+template <bool Hash>
+static Pass readScanner(const MappedFile &file)
+{
+    Pass pass;
+    pass.digest = Hash ? kHashSeed : 0;
+    CSVReader reader(file.data(), file.data() + file.size());
+    std::vector<std::string_view> row;
+    while (reader.readNextRow(row))
+    {
+        pass.rows++;
+        for (std::string_view field : row)
+            pass.digest = Hash ? hashField(pass.digest, field) : pass.digest + field.size();
+    }
+    return pass;
+}
+
+template <bool Hash>
+static Pass readParallel(ParallelCSVReader &reader)
+{
+    Pass pass;
+    pass.digest = Hash ? kHashSeed : 0;
+    reader.forEachRow([&](const std::vector<std::string_view> &row, uint64_t)
+                      {
+                          pass.rows++;
+                          for (std::string_view field : row)
+                              pass.digest = Hash ? hashField(pass.digest, field) : pass.digest + field.size();
+                          return true;
+                      });
+    return pass;
+}
+
+// Times ParallelCSVReader on 'path' as the thread count doubles; returns
+// false if any of them reads different fields from CSVReader.
+static bool scale(const std::string &path, int runs)
+{
+    MappedFile file(path);
+    if (!file.isOpen())
+    {
+        std::fprintf(stderr, "Cannot map %s.\n", path.c_str());
+        return false;
+    }
+    double bytes = static_cast<double>(file.size());
+    std::printf("ParallelCSVReader (%.1f MiB, %u hardware threads):\n", bytes / (1024.0 * 1024.0),
+                std::thread::hardware_concurrency());
+    Pass expected = readScanner<true>(file);
+    bool same = true;
+    double oneThread = 0;
+    std::string speedups;
+    for (unsigned threads : {1u, 2u, 4u, 8u})
+    {
+        ParallelCSVReader reader(path, threads);
+        Pass pass;
+        double seconds = bestOf(runs, [&]() { pass = readParallel<false>(reader); });
+        if (threads == 1)
+            oneThread = seconds;
+        char label[32];
+        std::snprintf(label, sizeof(label), "%u thread%s", threads, threads == 1 ? "" : "s");
+        printRate(label, seconds, static_cast<double>(pass.rows), "rows", bytes);
+        if (threads > 1)
+        {
+            char speedup[32];
+            std::snprintf(speedup, sizeof(speedup), "%s%.2fx at %u", speedups.empty() ? "" : ", ",
+                          oneThread / seconds, threads);
+            speedups += speedup;
+        }
+        Pass fields = readParallel<true>(reader);
+        same = same && fields.rows == expected.rows && fields.digest == expected.digest;
+    }
+    std::printf("  speedup %s against 1 thread, fields %s\n\n", speedups.c_str(), same ? "identical" : "DIFFER");
+    return same;
+}
+
+// Times both readers on 'path'; returns false if their fields differ.
+static bool compare(const char *title, const std::string &path, int runs)
+{
+    MappedFile file(path);
+    if (!file.isOpen())
+    {
+        std::fprintf(stderr, "Cannot map %s.\n", path.c_str());
+        return false;
+    }
+    double bytes = static_cast<double>(file.size());
+    std::printf("%s (%.1f MiB):\n", title, bytes / (1024.0 * 1024.0));
+
+    Pass getline, scanner;
+    double getlineSeconds = bestOf(runs, [&]() { getline = readGetline<false>(path); });
+    double scannerSeconds = bestOf(runs, [&]() { scanner = readScanner<false>(file); });
+    printRate("getline + state machine", getlineSeconds, static_cast<double>(getline.rows), "rows", bytes);
+    printRate("CSVReader (mapped)", scannerSeconds, static_cast<double>(scanner.rows), "rows", bytes);
+
+    // Checked outside the timed runs: hashing every byte would dominate them.
+    Pass getlineFields = readGetline<true>(path);
+    Pass scannerFields = readScanner<true>(file);
+    bool same = getlineFields.rows == scannerFields.rows && getlineFields.digest == scannerFields.digest;
+    std::printf("  speedup %.2fx, fields %s\n\n", getlineSeconds / scannerSeconds, same ? "identical" : "DIFFER");
+    return same;
+}
+
+int main(int argc, char *argv[])
+{
+    long rows = optionCount(argc, argv, "--rows", 300000);
+    long fieldLines = optionCount(argc, argv, "--field-lines", 2000);
+    int runs = static_cast<int>(optionCount(argc, argv, "--runs", 5));
+    std::string csv = optionValue(argc, argv, "--csv", "");
+
+    std::printf("CSV scanner: %s\n\n", CSVScanner::name(CSVScanner::active()));
+    fs::path temp = fs::temp_directory_path();
+    bool generated = csv.empty();
+    if (generated)
+    {
+        csv = (temp / "csv_scan_bench_rows.csv").string();
+        writeRows(csv, rows);
+    }
+    std::string longField = (temp / "csv_scan_bench_long_field.csv").string();
+    writeLongField(longField, fieldLines);
+
+    bool same = compare(generated ? "Generated print data" : csv.c_str(), csv, runs);
+    same = compare("One field over many lines", longField, runs) && same;
+    same = scale(csv, runs) && same;
+
+    if (generated)
+        fs::remove(csv);
+    fs::remove(longField);
+    return same ? 0 : 1;
+}
@@ -0,0 +1,251 @@
+// Per-image download latency of DownloadService, which keeps its easy
+// handles and their connections for the whole job, against the downloader
+// it replaced, which set up a new handle and connection for every image.
+//
+//   download_bench [--url <url>] [--images <n>] [--size <bytes>] [--handshake-ms <n>]
+//
+// Without --url, images of --size bytes (default 262144) are served from a
+// keep-alive HTTP/1.1 server on 127.0.0.1 in this process. The server waits
+// --handshake-ms (default 0) on every new connection, standing in for the TCP
+// and TLS round trips a remote image host costs. With --url, every image is
+// fetched from that URL instead, e.g. an https server to include real TLS.
+
+#include "bench_common.h"
+#include "download_service.h"
+#include <curl/curl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "spdlog/spdlog.h"
+
+namespace fs = std::filesystem;
+
+// Serves the same body for every GET, keeping connections open between requests.
+class ImageServer
+{
+public:
+    ImageServer(size_t size, std::chrono::milliseconds handshake) : body(size, 'x'), handshake(handshake)
+    {
+        listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr *>(&address), length) != 0 ||
+            ::listen(listener, 64) != 0 || ::getsockname(listener, reinterpret_cast<sockaddr *>(&address), &length) != 0)
+        {
+            std::perror("image server");
+            std::exit(1);
+        }
+        port = ntohs(address.sin_port);
+        acceptor = std::thread([this]() { acceptLoop(); });
+    }
+
+    ~ImageServer()
+    {
+        ::shutdown(listener, SHUT_RDWR);
+        acceptor.join();
+        ::close(listener);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int fd : connections)
+            ::shutdown(fd, SHUT_RDWR);
+        for (std::thread &thread : handlers)
+            thread.join();
+    }
+
+    std::string url() const { return "http://127.0.0.1:" + std::to_string(port) + "/image.png"; }
+
+    // Connections accepted so far.
+    unsigned accepted() const { return connectionCount.load(); }
+
+private:
+    std::string body;
+    std::chrono::milliseconds handshake;
+    int listener = -1;
+    int port = 0;
+    std::thread acceptor;
+    std::atomic<unsigned> connectionCount{0};
+
+    std::mutex mutex;
+    std::vector<int> connections;
+    std::vector<std::thread> handlers;
+
+    void acceptLoop()
+    {
+        while (true)
+        {
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+            connectionCount++;
+            std::lock_guard<std::mutex> lock(mutex);
+            connections.push_back(fd);
+            handlers.emplace_back([this, fd]() { serve(fd); });
+        }
+    }
+
+    void serve(int fd)
+    {
+        std::this_thread::sleep_for(handshake);
+        std::string header = "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\nContent-Length: " +
+                             std::to_string(body.size()) + "\r\nETag: \"bench\"\r\n\r\n";
+        std::string request;
+        char buffer[4096];
+        while (true)
+        {
+            size_t end = request.find("\r\n\r\n");
+            if (end != std::string::npos)
+            {
+                request.erase(0, end + 4);
+                if (!sendAll(fd, header) || !sendAll(fd, body))
+                    break;
+                continue;
+            }
+            ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                break;
+            request.append(buffer, static_cast<size_t>(n));
+        }
+        ::close(fd);
+    }
+
+    static bool sendAll(int fd, const std::string &data)
+    {
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                return false;
+            sent += static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+static size_t writeData(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+    std::ofstream *ofs = static_cast<std::ofstream *>(stream);
+    size_t count = size * nmemb;
+    ofs->write(static_cast<char *>(ptr), count);
+    return count;
+}
+
+// The downloader DownloadService replaced: a new easy handle, and with it a
+// new connection, DNS lookup and TLS handshake, for every image.
+static bool downloadWithFreshHandle(const std::string &url, const std::string &destinationPath)
+{
+    CURL *curl = curl_easy_init();
+    if (!curl)
+        return false;
+    std::ofstream ofs(destinationPath, std::ios::binary);
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeData);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ofs);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    return res == CURLE_OK && ofs.good();
+}
+
+// Downloads 'images' images one after another, as a print job does, and
+// prints the latency of each; returns false if any download failed.
+template <typename Download>
+static bool measure(const char *label, long images, const std::string &destination, Download download,
+                    std::vector<double> &latencies)
+{
+    latencies.clear();
+    for (long i = 0; i < images; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = download(destination);
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        if (!ok)
+        {
+            std::fprintf(stderr, "%s: download %ld failed.\n", label, i + 1);
+            return false;
+        }
+        latencies.push_back(took.count());
+    }
+    std::vector<double> sorted = latencies;
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (double latency : sorted)
+        total += latency;
+    std::printf("  %-28s mean %8.3f ms  p50 %8.3f ms  p99 %8.3f ms  first %8.3f ms\n", label, total / images,
+                sorted[sorted.size() / 2], sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)],
+                latencies.front());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    long images = std::max(1L, optionCount(argc, argv, "--images", 200));
+    long size = optionCount(argc, argv, "--size", 262144);
+    std::chrono::milliseconds handshake(optionCount(argc, argv, "--handshake-ms", 0));
+    std::string url = optionValue(argc, argv, "--url", "");
+
+    // DownloadService logs every image at info level.
+    spdlog::set_level(spdlog::level::warn);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    {
+        std::unique_ptr<ImageServer> server;
+        if (url.empty())
+        {
+            server = std::make_unique<ImageServer>(static_cast<size_t>(size), handshake);
+            url = server->url();
+            std::printf("Local server, %ld byte images, %lld ms per new connection:\n", size,
+                        static_cast<long long>(handshake.count()));
+        }
+        else
+        {
+            std::printf("%s:\n", url.c_str());
+        }
+        std::string destination = (fs::temp_directory_path() / "download_bench.png").string();
+        std::vector<double> before, after;
+        unsigned connections = 0;
+
+        bool ok = measure("fresh handle per image", images, destination,
+                          [&](const std::string &path) { return downloadWithFreshHandle(url, path); }, before);
+        if (server)
+        {
+            connections = server->accepted();
+            std::printf("  %-28s new connections: %u\n", "", connections);
+        }
+        DownloadService service;
+        ok = ok && measure("DownloadService", images, destination,
+                           [&](const std::string &path) { return service.downloadFile(url, path); }, after);
+        if (server)
+            std::printf("  %-28s new connections: %u\n", "", server->accepted() - connections);
+        if (ok && server && fs::file_size(destination) != static_cast<uintmax_t>(size))
+        {
+            std::fprintf(stderr, "%s has the wrong size.\n", destination.c_str());
+            ok = false;
+        }
+        fs::remove(destination);
+        if (!ok)
+            return 1;
+
+        double beforeTotal = 0, afterTotal = 0;
+        for (double latency : before)
+            beforeTotal += latency;
+        for (double latency : after)
+            afterTotal += latency;
+        std::printf("  speedup %.2fx\n", beforeTotal / afterTotal);
+    }
+    curl_global_cleanup();
+    return 0;
+}
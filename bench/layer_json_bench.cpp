@@ -0,0 +1,168 @@
+// Serialization throughput of the layer JSON writer against the stringstream
+// Layer::toString it replaced.
+//
+//   layer_json_bench [--layers <n>] [--batch <n>] [--runs <n>]
+//
+// Serializes --layers layers (default 1000000), numbered one after another
+// and drawn from a few thousand generated ones, in four ways: the old
+// stringstream toString, the current toString, appendLayerJson into one
+// reused buffer, and appendLayersNdjson in batches of --batch layers
+// (default 1024). The old output differs in form (six significant digits,
+// nothing escaped), so only sizes are compared.
+
+#include "bench_common.h"
+#include "layer.h"
+#include "layer_json.h"
+#include <cstdio>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Distinct layers to draw from; their layer numbers are rewritten as they go.
+static constexpr size_t kPoolSize = 4096;
+
+// The toString Layer had before layer_json.h.
+static std::string streamToString(const Layer &layer)
+{
+    std::stringstream ss;
+    ss << "{ "
+       << "\"layerError\": \"" << layer.layerError << "\", "
+       << "\"layerNumber\": " << layer.layerNumber << ", "
+       << "\"layerHeight\": " << layer.layerHeight << ", "
+       << "\"materialType\": \"" << layer.materialType << "\", "
+       << "\"extrusionTemperature\": " << layer.extrusionTemperature << ", "
+       << "\"printSpeed\": " << layer.printSpeed << ", "
+       << "\"layerAdhesionQuality\": \"" << layer.layerAdhesionQuality << "\", "
+       << "\"infillDensity\": " << layer.infillDensity << ", "
+       << "\"infillPattern\": \"" << layer.infillPattern << "\", "
+       << "\"shellThickness\": " << layer.shellThickness << ", "
+       << "\"overhangAngle\": " << layer.overhangAngle << ", "
+       << "\"coolingFanSpeed\": " << layer.coolingFanSpeed << ", "
+       << "\"retractionSettings\": \"" << layer.retractionSettings << "\", "
+       << "\"zOffsetAdjustment\": " << layer.zOffsetAdjustment << ", "
+       << "\"printBedTemperature\": " << layer.printBedTemperature << ", "
+       << "\"layerTime\": \"" << layer.layerTime << "\", "
+       << "\"fileName\": \"" << layer.fileName << "\", "
+       << "\"imageUrl\": \"" << layer.imageUrl << "\" "
+       << "}";
+    return ss.str();
+}
+
+// Layers like the print data, a few with quotes that need escaping.
+static std::vector<Layer> makeLayers()
+{
+    std::mt19937 random(42);
+    const char *errors[] = {"SUCCESS", "SUCCESS", "SUCCESS", "UNDER_EXTRUSION", "LAYER_SHIFT"};
+    const char *materials[] = {"PLA", "PETG", "ABS", "TPU"};
+    const char *qualities[] = {"Good", "Fair", "Poor"};
+    const char *patterns[] = {"Grid", "Honeycomb", "Lines", "Gyroid"};
+    const char *retractions[] = {"5mm", "6mm, 40mm/s", "4mm, \"fast\""};
+    std::vector<Layer> layers(kPoolSize);
+    for (size_t i = 0; i < layers.size(); ++i)
+    {
+        Layer &layer = layers[i];
+        unsigned r = random();
+        layer.layerError = errors[r % 5];
+        layer.layerNumber = static_cast<int>(i + 1);
+        layer.layerHeight = 0.1 + (r >> 3) % 3 * 0.1;
+        layer.materialType = materials[(r >> 5) % 4];
+        layer.extrusionTemperature = 190 + static_cast<int>((r >> 7) % 60);
+        layer.printSpeed = 20 + static_cast<int>((r >> 9) % 80);
+        layer.layerAdhesionQuality = qualities[(r >> 11) % 3];
+        layer.infillDensity = static_cast<int>((r >> 13) % 100);
+        layer.infillPattern = patterns[(r >> 15) % 4];
+        layer.shellThickness = 1 + static_cast<int>((r >> 17) % 3);
+        layer.overhangAngle = static_cast<int>((r >> 19) % 90);
+        layer.coolingFanSpeed = static_cast<int>((r >> 21) % 100);
+        layer.retractionSettings = retractions[(r >> 23) % 16 < 14 ? 0 : 1 + (r >> 23) % 2];
+        layer.zOffsetAdjustment = (r >> 25) % 10 * 0.01;
+        layer.printBedTemperature = 50 + static_cast<int>((r >> 27) % 40);
+        layer.layerTimeSeconds = static_cast<int>(r % 600);
+        layer.layerTime = std::to_string(layer.layerTimeSeconds / 60) + "min_" +
+                          std::to_string(layer.layerTimeSeconds % 60) + "sec";
+        layer.fileName = "fl_layer_" + std::to_string(i + 1) + ".png";
+        layer.imageUrl = "https://picsum.photos/seed/" + std::to_string(i + 1) + "/1920/1080";
+    }
+    return layers;
+}
+
+// The pool layer to serialize as layer 'number'.
+static const Layer &layerAt(std::vector<Layer> &pool, long number)
+{
+    Layer &layer = pool[static_cast<size_t>(number) % pool.size()];
+    layer.layerNumber = static_cast<int>(number);
+    return layer;
+}
+
+int main(int argc, char *argv[])
+{
+    long count = optionCount(argc, argv, "--layers", 1000000);
+    size_t batchSize = static_cast<size_t>(std::max(1L, optionCount(argc, argv, "--batch", 1024)));
+    int runs = static_cast<int>(optionCount(argc, argv, "--runs", 3));
+    std::vector<Layer> pool = makeLayers();
+    double layers = static_cast<double>(count);
+    std::printf("%ld layers:\n", count);
+
+    size_t streamBytes = 0;
+    double seconds = bestOf(runs, [&]()
+                            {
+                                streamBytes = 0;
+                                for (long i = 1; i <= count; ++i)
+                                    streamBytes += streamToString(layerAt(pool, i)).size();
+                            });
+    printRate("stringstream toString", seconds, layers, "layers", static_cast<double>(streamBytes));
+    double streamSeconds = seconds;
+
+    size_t stringBytes = 0;
+    seconds = bestOf(runs, [&]()
+                     {
+                         stringBytes = 0;
+                         for (long i = 1; i <= count; ++i)
+                             stringBytes += layerAt(pool, i).toString().size();
+                     });
+    printRate("Layer::toString", seconds, layers, "layers", static_cast<double>(stringBytes));
+
+    size_t bufferBytes = 0;
+    std::string buffer;
+    seconds = bestOf(runs, [&]()
+                     {
+                         bufferBytes = 0;
+                         for (long i = 1; i <= count; ++i)
+                         {
+                             buffer.clear();
+                             appendLayerJson(buffer, layerAt(pool, i));
+                             bufferBytes += buffer.size();
+                         }
+                     });
+    printRate("appendLayerJson, reused", seconds, layers, "layers", static_cast<double>(bufferBytes));
+    double bufferSeconds = seconds;
+
+    // Batches are filled outside the timed part, as the reader fills them.
+    std::vector<std::vector<Layer>> batches;
+    for (long i = 1; i <= count;)
+    {
+        std::vector<Layer> batch;
+        for (; i <= count && batch.size() < batchSize; ++i)
+            batch.push_back(layerAt(pool, i));
+        batches.push_back(std::move(batch));
+    }
+    size_t ndjsonBytes = 0;
+    seconds = bestOf(runs, [&]()
+                     {
+                         ndjsonBytes = 0;
+                         for (const std::vector<Layer> &batch : batches)
+                         {
+                             buffer.clear();
+                             appendLayersNdjson(buffer, batch);
+                             ndjsonBytes += buffer.size();
+                         }
+                     });
+    printRate("appendLayersNdjson", seconds, layers, "layers", static_cast<double>(ndjsonBytes));
+
+    std::printf("  speedup %.2fx (reused buffer against stringstream)\n", streamSeconds / bufferSeconds);
+    bool same = stringBytes == bufferBytes && ndjsonBytes == bufferBytes + static_cast<size_t>(count);
+    if (!same)
+        std::fprintf(stderr, "Output sizes differ.\n");
+    return same ? 0 : 1;
+}
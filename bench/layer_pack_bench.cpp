@@ -0,0 +1,145 @@
+// Writes a layer pack, reopens it with LayerPackReader and checks lookups
+// by layer number, then times them.
+//
+//   layer_pack_bench [--layers <n>] [--image-bytes <n>] [--runs <n>]
+//
+// --layers layers (default 100000) are appended with an image of
+// --image-bytes bytes (default 4096) for every tenth layer. The pack is read
+// back twice: through its index, and with the index cut off, as a writer
+// that never finished leaves it. Both must find the first and the last
+// layer, every layer in between, and none of layer 0 and --layers + 1.
+
+#include "bench_common.h"
+#include "binary_io.h"
+#include "layer_pack.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "spdlog/spdlog.h"
+
+namespace fs = std::filesystem;
+
+static std::string layerJson(long layerNumber)
+{
+    return "{\"layerNumber\":" + std::to_string(layerNumber) + ",\"layerError\":\"SUCCESS\",\"fileName\":\"fl_layer_" +
+           std::to_string(layerNumber) + ".png\"}";
+}
+
+static std::string imageBytes(long layerNumber, size_t size)
+{
+    return std::string(size, static_cast<char>('a' + layerNumber % 26));
+}
+
+// Checks what 'reader' finds against what was written; prints each failure.
+static bool verify(const char *title, const LayerPackReader &reader, long layers, size_t imageSize)
+{
+    bool ok = true;
+    auto fail = [&](const char *what, long layerNumber)
+    {
+        std::fprintf(stderr, "%s: %s for layer %ld.\n", title, what, layerNumber);
+        ok = false;
+    };
+    std::string_view found;
+    for (long layerNumber : {1L, layers})
+    {
+        if (!reader.findLayer(static_cast<int>(layerNumber), found) || found != layerJson(layerNumber))
+            fail("wrong record", layerNumber);
+    }
+    for (long layerNumber : {0L, layers + 1})
+    {
+        if (reader.findLayer(static_cast<int>(layerNumber), found) ||
+            reader.findImage(static_cast<int>(layerNumber), found))
+            fail("a record found", layerNumber);
+    }
+    for (long layerNumber = 1; layerNumber <= layers; ++layerNumber)
+    {
+        if (!reader.findLayer(static_cast<int>(layerNumber), found) || found != layerJson(layerNumber))
+            fail("wrong record", layerNumber);
+        bool hasImage = reader.findImage(static_cast<int>(layerNumber), found);
+        if (hasImage != (layerNumber % 10 == 0) || (hasImage && found != imageBytes(layerNumber, imageSize)))
+            fail("wrong image", layerNumber);
+        if (!ok)
+            break;
+    }
+    std::vector<int> numbers = reader.layerNumbers();
+    if (reader.layerCount() != static_cast<size_t>(layers) || numbers.size() != static_cast<size_t>(layers) ||
+        numbers.front() != 1 || numbers.back() != layers || reader.imageCount() != static_cast<size_t>(layers / 10))
+        fail("wrong counts", layers);
+    return ok;
+}
+
+// Times opening the pack at 'path' and looking up every layer.
+static bool measure(const char *title, const std::string &path, long layers, size_t imageSize, int runs)
+{
+    LayerPackReader reader;
+    double openSeconds = bestOf(runs, [&]() { reader.open(path); });
+    printRate(title, openSeconds, static_cast<double>(layers), "layers", static_cast<double>(fs::file_size(path)));
+    size_t bytes = 0;
+    std::string_view found;
+    double seconds = bestOf(runs, [&]()
+                            {
+                                bytes = 0;
+                                for (long layerNumber = 1; layerNumber <= layers; ++layerNumber)
+                                    if (reader.findLayer(static_cast<int>(layerNumber), found))
+                                        bytes += found.size();
+                            });
+    printRate("  findLayer", seconds, static_cast<double>(layers), "lookups", static_cast<double>(bytes));
+    return verify(title, reader, layers, imageSize);
+}
+
+int main(int argc, char *argv[])
+{
+    long layers = std::max(1L, optionCount(argc, argv, "--layers", 100000));
+    size_t imageSize = static_cast<size_t>(optionCount(argc, argv, "--image-bytes", 4096));
+    int runs = static_cast<int>(optionCount(argc, argv, "--runs", 5));
+    // The reader warns on every open of a pack without an index.
+    spdlog::set_level(spdlog::level::err);
+    fs::path temp = fs::temp_directory_path();
+    std::string path = (temp / "layer_pack_bench.pack").string();
+    std::string unfinished = (temp / "layer_pack_bench_unfinished.pack").string();
+    std::printf("%ld layers, %ld images of %zu bytes:\n", layers, layers / 10, imageSize);
+
+    LayerPackOptions options;
+    options.sync = PackSync::NEVER;
+    bool ok = true;
+    double seconds = bestOf(runs, [&]()
+                            {
+                                LayerPackWriter writer(options);
+                                ok = writer.open(path);
+                                for (long layerNumber = 1; ok && layerNumber <= layers; ++layerNumber)
+                                {
+                                    ok = writer.append(PackRecordKind::LAYER, static_cast<int>(layerNumber),
+                                                       layerJson(layerNumber));
+                                    if (ok && layerNumber % 10 == 0)
+                                        ok = writer.append(PackRecordKind::IMAGE, static_cast<int>(layerNumber),
+                                                           imageBytes(layerNumber, imageSize));
+                                }
+                                ok = ok && writer.close();
+                            });
+    if (!ok)
+    {
+        std::fprintf(stderr, "Cannot write %s.\n", path.c_str());
+        return 1;
+    }
+    printRate("LayerPackWriter", seconds, static_cast<double>(layers), "layers",
+              static_cast<double>(fs::file_size(path)));
+
+    // The trailer starts with the offset of the index, which follows the last record.
+    char trailer[8] = {};
+    std::ifstream in(path, std::ios::binary);
+    in.seekg(-24, std::ios::end);
+    in.read(trailer, sizeof(trailer));
+    ok = measure("reader, with index", path, layers, imageSize, runs);
+
+    fs::copy_file(path, unfinished, fs::copy_options::overwrite_existing);
+    fs::resize_file(unfinished, getU64(trailer));
+    ok = measure("reader, no index", unfinished, layers, imageSize, runs) && ok;
+
+    std::printf("  lookups %s\n", ok ? "correct" : "WRONG");
+    fs::remove(path);
+    fs::remove(unfinished);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+#ifndef ASYNC_FILE_WRITER_H
+#define ASYNC_FILE_WRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct AsyncFileWriterConfig
+{
+    // Files being written at once; further submissions wait in a queue.
+    unsigned maxInFlight = 64;
+    // Threads writing files when io_uring is not available, or the kernel's
+    // io_uring workers creating them when it is.
+    unsigned threads = 2;
+    // Flush each file's data to disk (fdatasync) before it counts as written.
+    bool sync = false;
+};
+
+struct AsyncFileWriterStats
+{
+    size_t files = 0;   // Written successfully.
+    size_t failed = 0;
+    uint64_t bytes = 0;
+    // Kernel submissions (io_uring_enter calls) that carried the writes; with
+    // the thread backend, one per file.
+    size_t batches = 0;
+};
+
+// Writes whole files in the background: each submission creates (or
+// truncates) a file, writes a buffer into it, optionally syncs it and closes
+// it. Submissions come from any thread; each completion runs exactly once, on
+// a writer thread.
+//
+// Where the kernel supports it, one thread drives an io_uring: the opens of
+// every queued file go to the kernel in one batch, then each opened file's
+// write, sync and close go in as one linked chain, again batched with the
+// others. An idle ring waits a moment after the first file of a burst so the
+// rest of it joins the batch. Otherwise (or with FAKEPRINTER_FILE_WRITER=threads) a few threads
+// write files with plain system calls. A file whose write fails is removed.
+class AsyncFileWriter
+{
+public:
+    // 'error' is 0 on success, otherwise the errno of the step that failed.
+    using Completion = std::function<void(int error)>;
+
+    explicit AsyncFileWriter(const AsyncFileWriterConfig &config = AsyncFileWriterConfig());
+    // Finishes every submitted write.
+    ~AsyncFileWriter();
+
+    AsyncFileWriter(const AsyncFileWriter &) = delete;
+    AsyncFileWriter &operator=(const AsyncFileWriter &) = delete;
+
+    // Queues writing 'data' to 'path'. 'data' is kept alive until the write
+    // has finished.
+    void submit(std::string path, std::shared_ptr<const std::string> data, Completion onComplete);
+
+    // Blocks until every submitted write has completed. Must not be called
+    // from a completion.
+    void waitAll();
+
+    // "io_uring" or "threads".
+    const char *backend() const;
+
+    AsyncFileWriterStats stats() const;
+
+private:
+    struct Job
+    {
+        std::string path;
+        std::shared_ptr<const std::string> data;
+        Completion onComplete;
+        int fd = -1;
+        // The file was opened, so a failed write leaves one behind to remove.
+        bool created = false;
+        size_t written = 0;
+        int error = 0;
+        // Operations submitted to the ring and not completed yet.
+        unsigned inFlight = 0;
+    };
+    struct Ring;
+
+    AsyncFileWriterConfig config;
+    std::unique_ptr<Ring> ring; // Null with the thread backend.
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<std::unique_ptr<Job>> queued;
+    size_t unfinished = 0;
+    // Threads in waitAll().
+    unsigned flushing = 0;
+    bool stopping = false;
+    AsyncFileWriterStats counters;
+    std::vector<std::thread> workers;
+
+    // Worker loops of the two backends.
+    void ringLoop();
+    void threadLoop();
+    // Writes a job with plain system calls.
+    void writeNow(Job &job);
+    // Runs the job's completion and retires it.
+    void finish(std::unique_ptr<Job> job);
+};
+
+#endif // ASYNC_FILE_WRITER_H
@@ -0,0 +1,116 @@
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// Little-endian encoding shared by the pack, index, dataset and checkpoint
+// files, and the FNV-1a hash they are checksummed with.
+
+constexpr uint64_t kFnvOffsetBasis = 14695981039346656037ull;
+constexpr uint64_t kFnvPrime = 1099511628211ull;
+
+// 64-bit FNV-1a over 'data', continuing from 'hash'.
+inline uint64_t fnv1a(std::string_view data, uint64_t hash = kFnvOffsetBasis)
+{
+    for (char c : data)
+        hash = (hash ^ static_cast<unsigned char>(c)) * kFnvPrime;
+    return hash;
+}
+
+inline void putU32(std::string &out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+inline void putU64(std::string &out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        out.push_back(static_cast<char>(value >> (8 * i)));
+}
+
+inline void putF64(std::string &out, double value)
+{
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    putU64(out, bits);
+}
+
+// A u32 length followed by the bytes.
+inline void putString(std::string &out, std::string_view value)
+{
+    putU32(out, static_cast<uint32_t>(value.size()));
+    out.append(value);
+}
+
+inline uint32_t getU32(const char *in)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return value;
+}
+
+inline uint64_t getU64(const char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    return value;
+}
+
+// Reads values written by the put functions from a buffer. Every read
+// returns false, and leaves the value alone, once the buffer runs out.
+class ByteReader
+{
+public:
+    explicit ByteReader(std::string_view data) : rest(data) {}
+
+    bool u32(uint32_t &value)
+    {
+        if (rest.size() < 4)
+            return false;
+        value = getU32(rest.data());
+        rest.remove_prefix(4);
+        return true;
+    }
+
+    bool u64(uint64_t &value)
+    {
+        if (rest.size() < 8)
+            return false;
+        value = getU64(rest.data());
+        rest.remove_prefix(8);
+        return true;
+    }
+
+    bool f64(double &value)
+    {
+        uint64_t bits;
+        if (!u64(bits))
+            return false;
+        std::memcpy(&value, &bits, sizeof(value));
+        return true;
+    }
+
+    bool string(std::string &value)
+    {
+        uint32_t length;
+        if (!u32(length) || rest.size() < length)
+            return false;
+        value.assign(rest.data(), length);
+        rest.remove_prefix(length);
+        return true;
+    }
+
+    size_t remaining() const { return rest.size(); }
+
+private:
+    std::string_view rest;
+};
+
+#endif // BINARY_IO_H
@@ -0,0 +1,172 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// Lock-free bounded multi-producer/multi-consumer queue (Dmitry Vyukov's
+// array-based design). Each cell carries a sequence number telling producers
+// and consumers whose turn it is, so neither side ever takes a lock. The
+// capacity is rounded up to a power of two. Values are only moved out of the
+// caller when tryPush succeeds.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t requestedCapacity)
+    {
+        size_t capacity = 2;
+        while (capacity < requestedCapacity)
+            capacity <<= 1;
+        cells.reset(new Cell[capacity]);
+        mask = capacity - 1;
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    bool tryPush(T &&value)
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // Full.
+            }
+            else
+            {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool tryPop(T &value)
+    {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(cell.value);
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // Empty.
+            }
+            else
+            {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Number of queued values; only a snapshot while other threads are active.
+    size_t size() const
+    {
+        size_t head = dequeuePos.load(std::memory_order_relaxed);
+        size_t tail = enqueuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    // Producers and consumers touch different cache lines.
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+};
+
+// Lets threads sleep until a BoundedQueue (or anything else they poll) may
+// have changed, once spinning on it no longer pays. Sleepers register before
+// they check their condition, and wakers check for sleepers after making
+// their change, so no wake-up is lost; while nobody sleeps, notify() costs a
+// fence and a load and the queue stays lock-free.
+class WaitSignal
+{
+public:
+    // Blocks until 'ready' returns true; it is checked again on every notify().
+    template <typename Ready>
+    void wait(Ready ready)
+    {
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, ready);
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // As wait(), but returns after 'timeout' at the latest. Returns ready().
+    template <typename Ready, typename Rep, typename Period>
+    bool waitFor(Ready ready, std::chrono::duration<Rep, Period> timeout)
+    {
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool result;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            result = changed.wait_for(lock, timeout, ready);
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    // Wakes the sleepers, if any, to check their condition again.
+    void notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) == 0)
+            return;
+        // A sleeper that just found its condition false is waiting once we get the lock.
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+        }
+        changed.notify_all();
+    }
+
+private:
+    std::atomic<unsigned> sleepers{0};
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+#endif // BOUNDED_QUEUE_H
@@ -0,0 +1,70 @@
+#ifndef BYTE_SOURCE_H
+#define BYTE_SOURCE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// How openByteSource() reads its input.
+struct ByteSourceOptions
+{
+    // At the end of the input, wait for more to be appended (an upstream
+    // slicer still writing the CSV) instead of stopping...
+    bool follow = false;
+    // ...until it has not grown for this many seconds; 0 waits until 'stop'.
+    unsigned followIdleSeconds = 0;
+    // Ends waits for more input, and downloads, once set.
+    const std::atomic<bool> *stop = nullptr;
+    // Also saves the bytes read here; the file appears only once the whole
+    // input has been read.
+    std::string copyTo;
+};
+
+// A stream of input bytes read in pieces into the caller's buffer, so input
+// of any length goes through a fixed amount of memory.
+class ByteSource
+{
+public:
+    virtual ~ByteSource() = default;
+
+    // Reads up to 'size' bytes into 'buffer'. Returns how many were read, 0
+    // at the end of the input, or -1 on failure (see error()).
+    long read(char *buffer, size_t size);
+
+    // Puts bytes back in front of the input; the next reads return them first.
+    void unread(std::string_view bytes) { pending.insert(0, bytes.data(), bytes.size()); }
+
+    const std::string &error() const { return failure; }
+
+protected:
+    std::string failure;
+
+    virtual long readSome(char *buffer, size_t size) = 0;
+
+private:
+    std::string pending;
+};
+
+enum class Compression
+{
+    NONE,
+    GZIP,
+    ZSTD
+};
+
+// Recognises compressed data by its first bytes.
+Compression detectCompression(const char *data, size_t size);
+
+// True for "-" (stdin) and URLs, which only openByteSource() can read.
+bool isStreamLocation(const std::string &location);
+
+// Opens 'location': "-" for stdin, an http://, https:// or ftp:// URL, which
+// is downloaded in-process as it is read, or the path of a file or FIFO.
+// gzip and zstd input is decompressed on the fly. Returns null and sets
+// 'error' on failure.
+std::unique_ptr<ByteSource> openByteSource(const std::string &location, const ByteSourceOptions &options,
+                                           std::string &error);
+
+#endif // BYTE_SOURCE_H
@@ -0,0 +1,119 @@
+#ifndef COMPILED_DATASET_H
+#define COMPILED_DATASET_H
+
+#include "layer.h"
+#include "mapped_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// The print data CSV decoded ahead of time into a binary file, so a job can
+// map it and start on its first layer without parsing anything. All integers
+// are little endian.
+//
+//   header   "FPDSET1\0"  u32 version  u32 reserved
+//            u64 csvSize  u64 csvModified  u64 csvHash
+//            u64 rowCount  u64 recordCount  u64 stringCount
+//            u64 recordsOffset  u64 rowsOffset  u64 stringsOffset  u64 bytesOffset
+//            u64 FNV-1a of the header before it
+//   records  fixed-width layers, see CompiledDataset::kRecordSize
+//   rows     (u64 endOffset  u32 rowNumber  u32 reference) * rowCount
+//   strings  (u64 offset  u32 length  u32 reserved) * stringCount
+//   bytes    the string contents
+//
+// A row refers to its record, or, for a row that could not be decoded, with
+// the top bit set, to the string describing why. Text columns repeat a few
+// values, so they are stored once and shared; file names and URLs are not.
+// 'endOffset' is where the row ends in the CSV, which is what checkpoints
+// record.
+
+// Size, modification time and content hash of a CSV file.
+struct DatasetSource
+{
+    uint64_t size = 0;
+    int64_t modified = 0;
+    uint64_t hash = 0;
+
+    // Records the size and modification time of 'csvFileName', and its hash
+    // if 'withHash' is set.
+    bool describe(const std::string &csvFileName, bool withHash);
+};
+
+// Builds a compiled dataset from rows in CSV order.
+class CompiledDatasetWriter
+{
+public:
+    // Starts writing next to 'path'; the file appears there on finish().
+    bool open(const std::string &path);
+
+    // Adds data row 'rowNumber', which ends at CSV byte 'endOffset'. 'layer'
+    // is null for a row that could not be decoded, and 'error' says why.
+    void add(int rowNumber, uint64_t endOffset, const Layer *layer, const std::string &error);
+
+    // Writes the index and the strings and moves the file into place.
+    bool finish(const DatasetSource &source);
+
+    size_t rowCount() const { return rowTotal; }
+
+private:
+    std::string path;
+    std::string tempPath;
+    std::ofstream out;
+    size_t rowTotal = 0;
+    uint64_t recordCount = 0;
+    // Scratch buffer for encoding one record.
+    std::string record;
+    std::string rows;
+    std::string strings;
+    std::string bytes;
+    // Text column values already stored, by value.
+    std::unordered_map<std::string, uint32_t> interned;
+
+    uint32_t addString(std::string_view value);
+    uint32_t internString(const std::string &value);
+};
+
+// Read access to a compiled dataset through a memory mapping.
+class CompiledDataset
+{
+public:
+    // layerHeight, zOffsetAdjustment (f64), nine i32 and six text references
+    // (u32, LayerTable column order), fileName, imageUrl (u32), padding.
+    static constexpr size_t kRecordSize = 88;
+
+    // Maps 'path' if it was compiled from 'csvFileName' as the CSV is now.
+    // A CSV whose size and modification time match is taken as unchanged;
+    // one whose modification time alone differs is hashed to make sure.
+    // Returns false if the file is missing, damaged or out of date.
+    bool open(const std::string &path, const std::string &csvFileName);
+
+    size_t rowCount() const { return rows; }
+    int rowNumber(size_t row) const;
+    uint64_t endOffset(size_t row) const;
+
+    // Rebuilds row 'row' into 'layer'; for a row that could not be decoded,
+    // returns false and sets 'error'.
+    bool read(size_t row, Layer &layer, std::string &error) const;
+
+    // The first row starting at or after CSV byte 'offset'.
+    size_t findOffset(uint64_t offset) const;
+
+private:
+    std::unique_ptr<MappedFile> file;
+    size_t rows = 0;
+    size_t records = 0;
+    size_t stringCount = 0;
+    const char *recordData = nullptr;
+    const char *rowData = nullptr;
+    const char *stringData = nullptr;
+    const char *byteData = nullptr;
+    size_t byteCount = 0;
+
+    std::string_view string(uint32_t id) const;
+};
+
+#endif // COMPILED_DATASET_H
@@ -1,72 +1,285 @@
 #ifndef CSV_READER_H
 #define CSV_READER_H
 
-#include <fstream>
-#include <sstream>
+#include "byte_source.h"
+#include "csv_scanner.h"
+#include "mapped_file.h"
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 // CSV reader that handles quoted fields and embedded newlines.
+// Plain regular files are memory-mapped and parsed in place. Everything else
+// (stdin, FIFOs, URLs, compressed files, a file being followed as it grows)
+// is read from a ByteSource through a fixed-size buffer.
 class CSVReader
 {
 public:
-    CSVReader(const std::string &filename)
-        : file(filename)
+    // 'location' is anything openByteSource() accepts.
+    CSVReader(const std::string &location, const ByteSourceOptions &options = ByteSourceOptions())
     {
+        if (!options.follow && options.copyTo.empty() && !isStreamLocation(location))
+        {
+            mapped = std::make_unique<MappedFile>(location);
+            if (mapped->isOpen() && detectCompression(mapped->data(), mapped->size()) == Compression::NONE)
+            {
+                first = cursor = mapped->data();
+                end = cursor + mapped->size();
+                return;
+            }
+            mapped.reset();
+        }
+        source = openByteSource(location, options, sourceError);
+        buffer.resize(kStreamBuffer);
+    }
+
+    // Parses records from [first, last), which must outlive the reader.
+    CSVReader(const char *first, const char *last)
+        : first(first), cursor(first), end(last), inMemory(true)
+    {
+    }
+
+    // True if the input is served from memory rather than a stream.
+    bool isMapped() const { return inMemory || mapped; }
+
+    // Why the input could not be opened or read to the end; empty if it was.
+    const std::string &error() const { return source ? source->error() : sourceError; }
+
+    // Byte offset of the next record from the start of the input.
+    uint64_t offset() const
+    {
+        return isMapped() ? static_cast<uint64_t>(cursor - first) : streamOffset;
+    }
+
+    // Continues at 'position', which must be the start of a record (an
+    // earlier offset()). Returns false if the input cannot go there.
+    bool seek(uint64_t position)
+    {
+        if (isMapped())
+        {
+            if (position > static_cast<uint64_t>(end - first))
+                return false;
+            cursor = first + position;
+            return true;
+        }
+        // A stream only goes forward: read up to the position.
+        if (position < streamOffset)
+            return false;
+        for (;;)
+        {
+            uint64_t skip = position - streamOffset;
+            size_t available = bufferEnd - bufferBegin;
+            if (skip <= available)
+            {
+                bufferBegin += static_cast<size_t>(skip);
+                streamOffset = position;
+                return true;
+            }
+            bufferBegin = bufferEnd;
+            streamOffset += available;
+            if (!fill())
+                return false;
+        }
     }
 
     // Reads the next CSV record into the provided vector.
     // Returns true if a record was read successfully.
     bool readNextRow(std::vector<std::string> &row)
+    {
+        if (!readNextRow(views))
+        {
+            row.clear();
+            return false;
+        }
+        // Assign in place so the row's strings keep their capacity across calls.
+        row.resize(views.size());
+        for (size_t i = 0; i < views.size(); ++i)
+        {
+            row[i].assign(views[i]);
+        }
+        return true;
+    }
+
+    // Reads the next CSV record as views into the reader's buffers.
+    // Fields only own a copy when they contained escaped quotes. The views
+    // stay valid until the next call to readNextRow.
+    bool readNextRow(std::vector<std::string_view> &row)
     {
         row.clear();
-        std::string record;
-        if (!std::getline(file, record))
+        unescapedUsed = 0;
+        std::string_view record;
+        if (isMapped() ? !nextMappedRecord(record) : !nextStreamRecord(record))
         {
             return false;
         }
-        // If the record has an unbalanced quote, keep reading.
-        while (!isRecordComplete(record))
+        splitRecord(record, row);
+        return true;
+    }
+
+private:
+    // Input read by a stream goes through a buffer of this size; only a
+    // record longer than that makes it grow.
+    static constexpr size_t kStreamBuffer = 64 * 1024;
+
+    std::unique_ptr<MappedFile> mapped;
+    const char *first = nullptr;
+    const char *cursor = nullptr;
+    const char *end = nullptr;
+    bool inMemory = false;
+
+    std::unique_ptr<ByteSource> source;
+    std::string sourceError;
+    // Unparsed input is buffer[bufferBegin, bufferEnd), starting at byte
+    // streamOffset of the input.
+    std::vector<char> buffer;
+    size_t bufferBegin = 0;
+    size_t bufferEnd = 0;
+    bool sourceEnded = false;
+    uint64_t streamOffset = 0;
+
+    // Owned copies of fields that needed unescaping. A deque keeps earlier
+    // entries in place so views into them survive later insertions.
+    std::deque<std::string> unescaped;
+    size_t unescapedUsed = 0;
+    std::vector<std::string_view> views;
+    std::vector<CSVFieldSpan> spans;
+
+    // Finds the next record in the mapping: it ends at the first newline
+    // outside quotes, or at the end of the file.
+    bool nextMappedRecord(std::string_view &out)
+    {
+        if (cursor == end)
+        {
+            return false;
+        }
+        const char *start = cursor;
+        bool inQuotes = false;
+        const char *p = CSVScanner::findRecordEnd(start, end, inQuotes);
+        const char *recordEnd = p;
+        if (p == end)
+        {
+            cursor = end;
+            // An unterminated quote swallows the final line break, which the
+            // line-based reader never sees.
+            if (inQuotes && recordEnd != start && recordEnd[-1] == '\n')
+                recordEnd--;
+        }
+        else
+        {
+            cursor = p + 1;
+        }
+        out = std::string_view(start, static_cast<size_t>(recordEnd - start));
+        return true;
+    }
+
+    // Moves the unparsed input to the front of the buffer and reads more
+    // after it. Returns false at the end of the input.
+    bool fill()
+    {
+        if (!source || sourceEnded)
+            return false;
+        if (bufferBegin > 0)
+        {
+            std::memmove(buffer.data(), buffer.data() + bufferBegin, bufferEnd - bufferBegin);
+            bufferEnd -= bufferBegin;
+            bufferBegin = 0;
+        }
+        if (bufferEnd == buffer.size())
+            buffer.resize(buffer.size() * 2);
+        long got = source->read(buffer.data() + bufferEnd, buffer.size() - bufferEnd);
+        if (got <= 0)
+        {
+            sourceEnded = true;
+            return false;
+        }
+        bufferEnd += static_cast<size_t>(got);
+        return true;
+    }
+
+    // Finds the next record in the stream buffer, reading more input until
+    // it holds a newline outside quotes or the input ends. Only the newly
+    // read bytes are scanned, so long multi-line fields stay linear.
+    bool nextStreamRecord(std::string_view &out)
+    {
+        bool inQuotes = false;
+        size_t scanned = 0;
+        for (;;)
         {
-            std::string nextLine;
-            if (!std::getline(file, nextLine))
+            const char *start = buffer.data() + bufferBegin;
+            const char *limit = buffer.data() + bufferEnd;
+            const char *p = CSVScanner::findRecordEnd(start + scanned, limit, inQuotes);
+            if (p != limit)
             {
-                break;
+                size_t length = static_cast<size_t>(p - start);
+                out = std::string_view(start, length);
+                bufferBegin += length + 1;
+                streamOffset += length + 1;
+                return true;
             }
-            record += "\n" + nextLine;
+            scanned = bufferEnd - bufferBegin;
+            if (!fill())
+                break;
         }
-        parseRecord(record, row);
+        if (bufferBegin == bufferEnd)
+            return false;
+        const char *start = buffer.data() + bufferBegin;
+        size_t length = bufferEnd - bufferBegin;
+        // As in the mapping, an unterminated quote swallows the final line break.
+        if (inQuotes && start[length - 1] == '\n')
+            length--;
+        out = std::string_view(start, length);
+        streamOffset += bufferEnd - bufferBegin;
+        bufferBegin = bufferEnd;
         return true;
     }
 
-private:
-    std::ifstream file;
+    // Splits a record on commas outside quotes. Unquoted fields and fields
+    // wrapped in a single pair of quotes are returned as views into the record.
+    void splitRecord(std::string_view record, std::vector<std::string_view> &fields)
+    {
+        CSVScanner::splitFields(record.data(), record.data() + record.size(), spans);
+        for (const CSVFieldSpan &span : spans)
+        {
+            fields.push_back(makeField(record.substr(span.begin, span.end - span.begin), span.quotes));
+        }
+    }
 
-    // Check if the record has balanced quotes.
-    bool isRecordComplete(const std::string &record)
+    std::string_view makeField(std::string_view raw, size_t quotes)
     {
-        size_t count = 0;
-        for (char c : record)
+        if (quotes == 0)
+        {
+            return raw;
+        }
+        if (quotes == 2 && raw.size() >= 2 && raw.front() == '"' && raw.back() == '"')
         {
-            if (c == '"')
-                count++;
+            return raw.substr(1, raw.size() - 2);
         }
-        return count % 2 == 0;
+        if (unescapedUsed == unescaped.size())
+        {
+            unescaped.emplace_back();
+        }
+        std::string &field = unescaped[unescapedUsed++];
+        unescapeField(raw, field);
+        return field;
     }
 
-    // Parses a CSV record into fields using a simple state machine.
-    void parseRecord(const std::string &record, std::vector<std::string> &fields)
+    // Resolves quotes within a single field using a simple state machine.
+    void unescapeField(std::string_view raw, std::string &field)
     {
-        std::string field;
+        field.clear();
         bool inQuotes = false;
-        for (size_t i = 0; i < record.size(); ++i)
+        for (size_t i = 0; i < raw.size(); ++i)
         {
-            char c = record[i];
+            char c = raw[i];
             if (inQuotes)
             {
                 if (c == '"')
                 {
-                    if (i + 1 < record.size() && record[i + 1] == '"')
+                    if (i + 1 < raw.size() && raw[i + 1] == '"')
                     {
                         // Escaped quote
                         field.push_back('"');
@@ -88,18 +301,12 @@ private:
                 {
                     inQuotes = true;
                 }
-                else if (c == ',')
-                {
-                    fields.push_back(field);
-                    field.clear();
-                }
                 else
                 {
                     field.push_back(c);
                 }
             }
         }
-        fields.push_back(field);
     }
 };
 
@@ -0,0 +1,47 @@
+#ifndef CSV_SCANNER_H
+#define CSV_SCANNER_H
+
+#include <cstddef>
+#include <vector>
+
+// A field located by CSVScanner::splitFields: byte range within the record
+// and the number of quote characters it contains.
+struct CSVFieldSpan
+{
+    size_t begin;
+    size_t end;
+    size_t quotes;
+};
+
+// Vectorized structural scanner for CSV input.
+// Quotes, commas and newlines are classified 64 bytes at a time into bitmasks;
+// quote state is tracked with a prefix-XOR over the quote mask, so a comma or
+// newline is structural exactly when an even number of quotes precedes it.
+// That is the same rule CSVReader's quote state machine follows.
+class CSVScanner
+{
+public:
+    enum Kind
+    {
+        SCALAR,
+        SSE2,
+        AVX2
+    };
+
+    // The implementation chosen at startup for this CPU. Setting
+    // FAKEPRINTER_CSV_SCANNER=scalar|sse2|avx2 overrides the choice.
+    static Kind active();
+    static const char *name(Kind kind);
+
+    // Returns the first newline outside quotes in [begin, end), or end if there
+    // is none. 'inQuotes' carries the quote state into and out of the scan.
+    static const char *findRecordEnd(const char *begin, const char *end, bool &inQuotes);
+
+    // Splits a record on commas outside quotes.
+    static void splitFields(const char *begin, const char *end, std::vector<CSVFieldSpan> &fields);
+
+    // Counts quote characters in [begin, end).
+    static size_t countQuotes(const char *begin, const char *end);
+};
+
+#endif // CSV_SCANNER_H
@@ -0,0 +1,127 @@
+#ifndef DOWNLOAD_ENGINE_H
+#define DOWNLOAD_ENGINE_H
+
+#include "download_service.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct DownloadRequest
+{
+    std::string url;
+    std::string destinationPath;
+    // Validators of a cached copy. When either is set the request is
+    // conditional and an unchanged image comes back as 304 with no body.
+    std::string etag;
+    std::string lastModified;
+    // Keep "<destinationPath>.part" when the download fails or is cancelled,
+    // so a later download to the same path continues it. Off for temporary
+    // destinations that are never requested again.
+    bool keepPartial = true;
+    // When set, the body is spooled into this buffer instead of a file and
+    // 'destinationPath' is ignored. It must stay alive until the completion
+    // has run, and is only filled on the engine's thread.
+    std::string *memory = nullptr;
+    // Layer the image belongs to, recorded on the transfer spans; -1 if none.
+    int layerNumber = -1;
+};
+
+struct DownloadResult
+{
+    bool success = false;
+    bool cancelled = false;
+    // Served from the image cache without a transfer.
+    bool fromCache = false;
+    long httpStatus = 0;
+    size_t bytes = 0;
+    std::string error; // Empty on success.
+    // Validators sent with the final response, if any.
+    std::string etag;
+    std::string lastModified;
+};
+
+struct DownloadEngineConfig
+{
+    // Transfers running at once; further submissions wait in a queue.
+    unsigned maxInFlight = 16;
+    // Connections opened to any single host.
+    unsigned maxPerHost = 6;
+    // Objects larger than segmentBytes are fetched as up to maxSegments byte
+    // ranges in parallel, when the server supports ranges; 1 disables it.
+    unsigned maxSegments = 1;
+    uint64_t segmentBytes = 1 << 20;
+};
+
+// Asynchronous downloader driving many transfers on one curl multi handle.
+// Requests are submitted from any thread; each completion callback runs on the
+// engine's thread exactly once, whether the transfer succeeded, failed or was
+// cancelled (or inline in submit() if curl could not be initialized).
+// Transfers take their settings, retry policy and DNS/TLS caches from a
+// DownloadService, multiplex over HTTP/2 where possible, and recycle their
+// easy handles.
+//
+// As with DownloadService, bodies are written to "<destination>.part" (or the
+// request's memory buffer) and renamed when complete, a .part file left by an
+// earlier download is continued with an If-Range request, and concurrent
+// downloads to one destination never share a .part file. Transfers that fail transiently are
+// retried with backoff from the byte where they stopped; with maxSegments
+// above 1, the first request asks for one segment, and if the object turns
+// out to be larger the remaining ranges are fetched at once.
+class DownloadEngine
+{
+public:
+    using Completion = std::function<void(const DownloadResult &)>;
+
+    // 'service' must outlive the engine; without one the engine keeps its own.
+    explicit DownloadEngine(const DownloadEngineConfig &config = DownloadEngineConfig(),
+                            DownloadService *service = nullptr);
+    // Cancels whatever is still queued or running.
+    ~DownloadEngine();
+
+    DownloadEngine(const DownloadEngine &) = delete;
+    DownloadEngine &operator=(const DownloadEngine &) = delete;
+
+    // Queues a download of request.url into request.destinationPath.
+    void submit(DownloadRequest request, Completion onComplete);
+
+    // Blocks until every submitted download has completed.
+    void waitAll();
+
+    // Cancels queued and running downloads; their completions report 'cancelled'.
+    void cancelAll();
+
+    // Downloads submitted but not yet completed.
+    size_t outstanding() const;
+
+private:
+    struct Job
+    {
+        DownloadRequest request;
+        Completion onComplete;
+    };
+
+    DownloadEngineConfig config;
+    std::unique_ptr<DownloadService> ownedService;
+    DownloadService *service;
+    void *multi; // CURLM*, kept opaque so callers need not include curl.
+
+    mutable std::mutex mutex;
+    std::condition_variable idle;
+    std::deque<Job> queued;
+    size_t unfinished = 0;
+    bool cancelRequested = false;
+    bool stopping = false;
+    std::thread worker;
+
+    // Runs on 'worker': starts queued jobs, drives curl and reports completions.
+    void loop();
+    void complete(Job &job, const DownloadResult &result);
+};
+
+#endif // DOWNLOAD_ENGINE_H
@@ -1,14 +1,74 @@
 #ifndef DOWNLOAD_SERVICE_H
 #define DOWNLOAD_SERVICE_H
 
+#include <chrono>
+#include <memory>
 #include <string>
 
+struct DownloadShare;
+
+// How transfers deal with slow and failing servers.
+struct DownloadPolicy
+{
+    // Attempts per transfer. Connection failures, stalls and 408, 429 and 5xx
+    // responses are retried after a delay that doubles with every attempt up
+    // to maxRetryDelay, of which a random part is waited (full jitter).
+    unsigned maxAttempts = 4;
+    std::chrono::milliseconds retryDelay{250};
+    std::chrono::milliseconds maxRetryDelay{8000};
+
+    // A transfer is abandoned (and retried) when it stays below lowSpeedBytes
+    // per second for lowSpeedSeconds, however long it has run in total.
+    long lowSpeedBytes = 1024;
+    long lowSpeedSeconds = 30;
+    long connectTimeoutSeconds = 30;
+
+    // The delay before retry number 'retry' (1 for the first).
+    std::chrono::milliseconds backoff(unsigned retry) const;
+};
+
+// Long-lived downloader meant to be held for a whole print job.
+// Easy handles are pooled and reused, so each keeps its connections alive
+// between layers, and every handle is attached to one curl share handle that
+// caches DNS lookups and TLS sessions. HTTP/2 is negotiated when the server
+// offers it.
+//
+// Bodies go to "<destination>.part", written in place with pwrite, which is
+// renamed to the destination only once complete. A download that finds a
+// .part file continues it with a range request guarded by If-Range, and so
+// does a retry after a transfer breaks off; the validator is kept next to
+// the .part, which is discarded when there is none. While one download
+// writes a .part, others to the same destination write a private file
+// instead. downloadToMemory() skips the file altogether.
 class DownloadService
 {
 public:
+    explicit DownloadService(const DownloadPolicy &policy = DownloadPolicy());
+    ~DownloadService();
+
+    DownloadService(const DownloadService &) = delete;
+    DownloadService &operator=(const DownloadService &) = delete;
+
     // Downloads the file at 'url' and saves it to 'destinationPath'.
-    // Returns true on success, false on failure.
+    // Returns true on success, false on failure. Safe to call from several threads.
     bool downloadFile(const std::string &url, const std::string &destinationPath);
+
+    // Downloads the file at 'url' into 'body', for callers that hash or store
+    // the bytes themselves. Same retries as downloadFile().
+    bool downloadToMemory(const std::string &url, std::string &body);
+
+    // Applies the settings shared by every transfer (share handle, HTTP/2,
+    // redirects, timeouts) to a libcurl easy handle (CURL*).
+    void configureHandle(void *curl);
+
+    const DownloadPolicy &policy() const { return retryPolicy; }
+
+private:
+    DownloadPolicy retryPolicy;
+    std::unique_ptr<DownloadShare> shared;
+
+    void *acquireHandle();
+    void releaseHandle(void *curl);
 };
 
 #endif // DOWNLOAD_SERVICE_H
@@ -2,46 +2,378 @@
 #define FAKE_PRINTER_H
 
 #include "layer.h"
+#include "async_file_writer.h"
+#include "byte_source.h"
+#include "compiled_dataset.h"
 #include "csv_reader.h"
 #include "download_service.h"
+#include "download_engine.h"
+#include "image_cache.h"
+#include "input_reactor.h"
+#include "layer_index.h"
+#include "layer_pack.h"
+#include "layer_stager.h"
+#include "layer_table.h"
+#include "print_checkpoint.h"
+#include "print_pipeline.h"
+#include "print_statistics.h"
+#include "replay_clock.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
+namespace spdlog
+{
+    class logger;
+}
+
+// The CSV every job prints from, unless PrintOptions::input names another,
+// and where it is downloaded from when there is no local copy.
+inline constexpr const char *kPrintDataFile = "fake_print_data.csv";
+inline constexpr const char *kPrintDataUrl = "https://bit.ly/3AE4mbA";
+// The CSV compiled by --compile-dataset, used instead of it while it is current.
+inline constexpr const char *kCompiledDataFile = "fake_print_data.dataset";
+
+// Optional tuning for a print job. The defaults match the plain CLI.
+struct PrintOptions
+{
+    // Threads used to parse the CSV: 0 picks automatically (parallel only for
+    // large memory-mappable files), 1 forces single-threaded parsing.
+    unsigned parseThreads = 0;
+
+    // Image downloads kept in flight in automatic mode, in total and per host.
+    unsigned maxDownloads = 16;
+    unsigned maxDownloadsPerHost = 6;
+    // Retries and stall detection, and how many byte ranges a large image
+    // is fetched in at once (1 fetches it in one piece).
+    DownloadPolicy downloadPolicy;
+    unsigned downloadSegments = 1;
+
+    // Automatic-mode pipeline: workers per stage and the capacity of the
+    // queue in front of each stage.
+    unsigned validateWorkers = 1;
+    unsigned writeWorkers = 2;
+    unsigned queueCapacity = 256;
+
+    // Image cache shared by jobs; empty means "<destFolder>/.image-cache".
+    // A size of 0 disables the cache.
+    std::string imageCacheDir;
+    uint64_t imageCacheBytes = 1ull << 30;
+
+    // Where layer records go: one JSON file per layer, or a single pack file
+    // (<destFolder>/<printName>/layers.pack), optionally holding the images too.
+    enum Output
+    {
+        FILES,
+        PACK,
+        PACK_WITH_IMAGES
+    };
+    Output output = FILES;
+    PackSync packSync = PackSync::ON_CLOSE;
+    // Flush each layer file (and cached image) to disk before it counts as written.
+    bool syncFiles = false;
+
+    // Keeps every printed layer in a LayerTable for analysis after the run;
+    // the summary is then computed from the table. Otherwise only the
+    // running statistics are kept.
+    bool keepLayers = false;
+
+    // Where the CSV is read from instead of kPrintDataFile: a file, a FIFO,
+    // "-" for stdin or a URL, optionally gzip or zstd compressed (see
+    // openByteSource). Following keeps reading as the file grows, until it
+    // has not grown for followIdleSeconds (0: until Ctrl+C).
+    std::string input;
+    bool followInput = false;
+    unsigned followIdleSeconds = 0;
+
+    // Supervised mode: a file or FIFO to read commands from instead of stdin.
+    std::string inputScript;
+    // Supervised mode: layers parsed, validated, written and downloaded into
+    // staging while the operator decides on the current one, so confirming
+    // only has to move files into place. 0 prepares each layer after its
+    // confirmation.
+    unsigned lookahead = 4;
+
+    // Replay mode: how much faster than the layer times layers are published.
+    double replaySpeed = 1.0;
+
+    // Prints only layers fromLayer..toLayer (0: no limit), and of those only
+    // every everyLayer-th from fromLayer on. A plain CSV file is indexed once
+    // (see LayerIndex) so the job seeks straight to the range.
+    unsigned fromLayer = 0;
+    unsigned toLayer = 0;
+    unsigned everyLayer = 1;
+    bool layerRange() const { return fromLayer > 0 || toLayer > 0 || everyLayer > 1; }
+
+    // Automatic and replay mode: layers between checkpoints (0 disables
+    // them), and whether to continue from the job's last checkpoint.
+    unsigned checkpointEvery = 0;
+    bool resume = false;
+};
+
+// The CSV decoded once, for jobs that share it (see PrintFarm).
+struct LayerDataset
+{
+    // One entry per data row, in file order.
+    struct Row
+    {
+        int rowNumber = 0;
+        // Row in 'layers', or -1 if the row could not be decoded.
+        int layer = -1;
+        // Message in 'errors' for a row that could not be decoded.
+        int error = -1;
+    };
+
+    std::vector<Row> rows;
+    LayerTable layers;
+    std::vector<std::string> errors;
+
+    // Set instead of the members above when the rows are read straight from
+    // the compiled dataset.
+    std::unique_ptr<CompiledDataset> compiled;
+
+    size_t size() const { return compiled ? compiled->rowCount() : rows.size(); }
+
+    // Rebuilds the data row at 'index' (in file order) into 'layer'; for a
+    // row that could not be decoded, returns false and sets 'error'.
+    bool read(size_t index, int &rowNumber, Layer &layer, std::string &error) const;
+};
+
+// What farm jobs share instead of setting up their own.
+struct SharedJobResources
+{
+    const LayerDataset *dataset = nullptr;
+    DownloadEngine *engine = nullptr;
+    // May be null when the cache is disabled.
+    ImageCache *cache = nullptr;
+    AsyncFileWriter *writer = nullptr;
+    // The job's logger; the default logger if null.
+    std::shared_ptr<spdlog::logger> logger;
+};
+
 class FakePrinter
 {
 public:
     enum Mode
     {
         SUPERVISED,
-        AUTOMATIC
+        AUTOMATIC,
+        // Like automatic, but each layer is published when its layerTime
+        // (scaled by options.replaySpeed) has elapsed.
+        REPLAY
     };
 
     FakePrinter(const std::string &printName,
                 const std::string &destFolder,
-                Mode mode);
+                Mode mode,
+                const PrintOptions &options = PrintOptions());
 
     // Runs the complete print job.
     void run();
 
+    // The printed layers; empty unless options.keepLayers is set.
+    const LayerTable &layers() const { return printedLayers; }
+
+    int layersPrinted() const { return totalLayersPrinted; }
+    int errorCount() const { return totalErrors; }
+    // Complete once the summary has been printed.
+    const PrintStatistics &summaryStatistics() const { return statistics; }
+
+    // Downloads the CSV data file if it is not there yet; false on failure.
+    static bool fetchDataFile(const std::string &csvFileName);
+
+    // How to read the CSV named by 'options': following it, and stopping on Ctrl+C.
+    static ByteSourceOptions sourceOptions(const PrintOptions &options);
+
+    // Decodes every row of the CSV into a compiled dataset at 'datasetFileName'.
+    static bool compileDataset(const std::string &csvFileName, const std::string &datasetFileName, unsigned parseThreads);
+
+    // Prints the layer records of the pack at 'packPath' to stdout, one JSON
+    // document per line in layer order. With a range (0 for an open end),
+    // prints only those layers and fails if any of them is missing.
+    static bool dumpPack(const std::string &packPath, unsigned fromLayer, unsigned toLayer);
+
+    // Reads the layer index of the CSV, building it with one pass over the
+    // CSV if it is missing or out of date; false if that pass was interrupted.
+    static bool loadLayerIndex(const std::string &csvFileName, unsigned parseThreads, LayerIndex &index);
+
+    // Decodes every row of the CSV into 'dataset', or maps the compiled
+    // dataset when it matches the CSV.
+    static void loadDataset(const std::string &csvFileName, unsigned parseThreads,
+                            const ByteSourceOptions &sourceOptions, LayerDataset &dataset);
+
+    // Automatic mode driven in slices by a PrintFarm instead of by run().
+    // startSlices() opens the job's output. Each runSlice() accounts for the
+    // previous slice, then validates and writes up to 'maxLayers' more layers
+    // and starts their downloads; 'resume' is called, from any thread, once
+    // they have all finished, and should lead to the next runSlice(). It
+    // returns false when the job has nothing left, and then finishSlices()
+    // closes the job and prints its summary. Only one slice runs at a time.
+    bool startSlices(const SharedJobResources &resources);
+    bool runSlice(size_t maxLayers, const std::function<void()> &resume);
+    void finishSlices();
+
 private:
     std::string printName;
     std::string destFolder;
     Mode mode;
+    PrintOptions options;
+    std::shared_ptr<spdlog::logger> log;
 
-    // Statistics.
-    std::vector<Layer> layers;
+    // Statistics, accumulated as layers are printed.
+    PrintStatistics statistics;
+    LayerTable printedLayers;
     int totalLayersPrinted = 0;
     int totalErrors = 0;
 
+    // One downloader for the whole job so connections and caches survive
+    // between layers.
+    DownloadService downloader;
+
+    // Images go through the cache when it is enabled, and layer files and
+    // cached images are written by the file writer. The engine is declared
+    // last so it is torn down first, while the writer and cache its callbacks
+    // use still exist; the writer goes next, before the cache its callbacks use.
+    std::unique_ptr<ImageCache> imageCache;
+    std::unique_ptr<AsyncFileWriter> fileWriter;
+    std::unique_ptr<DownloadEngine> downloadEngine;
+
+    // Open only when writing a pack file.
+    std::unique_ptr<LayerPackWriter> pack;
+
+    // Replay mode, and supervised mode with a lookahead: layer files are
+    // written here and published when due or confirmed.
+    std::unique_ptr<LayerStager> stager;
+
+    // How the job reads its CSV.
+    ByteSourceOptions csvSource;
+    // With a layer range, no row starting at or after this offset is in it.
+    uint64_t rangeEndOffset = UINT64_MAX;
+
+    // Supervised mode only: the commands answering each prompt.
+    std::unique_ptr<InputReactor> input;
+
+    // Layers discarded by a shutdown in automatic mode.
+    int totalCancelled = 0;
+
+    // Farm mode state: the shared resources, the next dataset row and the
+    // slice whose downloads are in flight.
+    SharedJobResources shared;
+    size_t nextDatasetRow = 0;
+    std::vector<LayerTask> slice;
+    // Set by the write completion of the slice's task at the same index.
+    std::vector<char> sliceWriteFailed;
+    std::atomic<size_t> slicePending{0};
+
+    // Checkpointing: the last checkpoint, rows accounted for so far, the rows
+    // a resumed job had already done past its checkpoint (sorted) and layers
+    // since the last save.
+    PrintCheckpoint checkpoint;
+    RowWatermark watermark;
+    std::vector<int> resumedRows;
+    unsigned sinceCheckpoint = 0;
+
+    // Reads every CSV record from byte 'startOffset' on in file order, serially
+    // or on parse threads (0 picks automatically, see PrintOptions::parseThreads).
+    // 'endOffset' is the byte offset just past the record.
+    static void readRows(const std::string &csvFileName, unsigned parseThreads, const ByteSourceOptions &sourceOptions,
+                         uint64_t startOffset, const std::function<bool(const std::vector<std::string_view> &row, uint64_t endOffset)> &onRow);
+
+    // Decodes the data rows from CSV byte 'startOffset' on (row 'firstRow'
+    // when 'startOffset' is not 0) and hands each to 'onLayer': 'layer' is null for a row
+    // that could not be decoded, and 'error' says why. Rows come from the
+    // compiled dataset when it matches the CSV, otherwise from the CSV itself.
+    static void readLayers(const std::string &csvFileName, unsigned parseThreads, const ByteSourceOptions &sourceOptions,
+                           int firstRow, uint64_t startOffset,
+                           const std::function<bool(int rowNumber, uint64_t endOffset, Layer *layer, const std::string &error)> &onLayer);
+
+    // readLayers() without the compiled dataset.
+    static void readCsvLayers(const std::string &csvFileName, unsigned parseThreads,
+                              const ByteSourceOptions &sourceOptions, int firstRow, uint64_t startOffset,
+                              const std::function<bool(int rowNumber, uint64_t endOffset, Layer *layer, const std::string &error)> &onLayer);
+
+    // Positions the job at the start of its layer range; false to end the job.
+    bool seekLayerRange(const std::string &csvFileName);
+
+    // Whether a row holding 'layer' (null if it could not be decoded) is in
+    // the layer range; every row is when no range is given.
+    bool inLayerRange(const Layer *layer) const;
+
+    // Validates and prints one decoded row, or reports why it could not be
+    // decoded (supervised mode); returns false to end the job.
+    bool handleRow(Layer *decoded, const std::string &decodeError);
+
+    // Waits for the answer to a supervised-mode prompt; false if a shutdown
+    // was requested instead.
+    bool awaitCommand(std::string &command);
+
     // Validates a layer; returns true if valid (errorMsg contains details on failure).
     bool validateLayer(const Layer &layer, std::string &errorMsg);
 
     // Processes a layer: writes out layer data and downloads its image.
     bool processLayer(const Layer &layer);
 
-    // Prepares the output directories.
+    // Writes the layer's JSON file (or pack record) and calls 'onWritten',
+    // inline for a pack record and on the file writer's thread for a file.
+    void writeLayerData(const Layer &layer, std::function<void(bool written)> onWritten);
+
+    // Moves a downloaded image into the pack file when images are packed.
+    // 'image' holds its bytes if it was downloaded into memory rather than
+    // into images/.
+    bool packImage(const Layer &layer, const std::string *image = nullptr);
+
+    // True when images go from the download straight into the pack file:
+    // images are packed, and there is no image cache to link them from.
+    bool spoolsImages(const ImageCache *cache) const;
+
+    // Creates the file writer and the download engine and opens the image cache.
+    void startDownloads();
+
+    // Downloads (or takes from the cache) the layer's image, blocking until done.
+    bool downloadImage(const Layer &layer);
+
+    // Runs automatic, replay and prefetching supervised mode as a
+    // parse -> validate -> write -> download pipeline.
+    void runPipeline(const std::string &csvFileName);
+
+    // Replay mode: waits until a printed layer is due and publishes it, then accounts for the task.
+    void replayTask(LayerTask &task, ReplayClock &clock);
+
+    // Supervised mode: asks the operator about a prepared layer, publishes it
+    // once confirmed and accounts for the task; false to end the job.
+    bool superviseTask(LayerTask &task);
+
+    // Moves a staged layer's JSON file and image into place (or its record into the pack).
+    bool publishLayer(const Layer &layer);
+
+    // Counts a printed layer and adds it to the statistics.
+    void recordPrinted(const Layer &layer);
+
+    // Accounts for a layer leaving the pipeline; runs on the job thread.
+    void recordTask(LayerTask &task);
+
+    // Creates the job's directory and the layers/ and images/ directories
+    // the job writes into, once, before any layer.
     bool prepareOutputDirectory();
 
+    // Opens the pack file if options.output asks for one.
+    bool openPack();
+
+    // <destFolder>/<printName>/checkpoint
+    std::string checkpointPath() const;
+
+    // Starts checkpointing against 'csvFileName'. With options.resume, first
+    // restores the totals, statistics and position saved by the last
+    // checkpoint; false if there is one but it cannot be used.
+    bool restoreCheckpoint(const std::string &csvFileName);
+
+    // Saves the job's progress (see PrintCheckpoint).
+    void saveCheckpoint();
+
     // Prints a summary of the print job.
     void printSummary();
 };
@@ -0,0 +1,151 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include "async_file_writer.h"
+#include "download_engine.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ImageCacheConfig
+{
+    std::string directory;
+    // Blobs beyond this many bytes are evicted, least recently used first.
+    uint64_t maxBytes = 1ull << 30;
+};
+
+struct ImageCacheStats
+{
+    size_t hits = 0;        // Served without touching the network.
+    size_t revalidated = 0; // Confirmed unchanged by a 304 response.
+    size_t fetched = 0;     // Downloaded and stored.
+    size_t deduplicated = 0; // Downloaded, but the content was already stored.
+    size_t evicted = 0;
+    uint64_t bytesDownloaded = 0;
+};
+
+// On-disk image cache shared by every job that points at the same directory.
+//
+//   <directory>/blobs/<hash>-<size>   image contents, stored once (read-only)
+//   <directory>/index.tsv             url, blob, last use and validators (ETag/Last-Modified)
+//   <directory>/index.lock            flock()ed around every change to the index
+//   <directory>/tmp/<pid>.*           files being written by a running process
+//
+// Blobs are named by a 64-bit FNV-1a hash of their content plus their size,
+// so the same image behind different URLs is stored once. Images are placed
+// into a job by reflink where the filesystem supports it, otherwise by hard
+// link, otherwise by copy. A URL is revalidated with a conditional request the
+// first time a process asks for it and then served from disk; concurrent
+// requests for one URL share a single transfer. Downloads land in memory and
+// are hashed there, so an image that is already stored never hits the disk
+// again; new ones are stored by the file writer, off the engine's thread, when
+// there is one. Thread-safe.
+//
+// Every stored or used image appends a line to the index as it happens, so a
+// killed process loses nothing it has stored. The index is compacted (read,
+// merged with this process's view, rewritten and renamed into place) when the
+// cache opens and closes and whenever it has to evict. Compaction reconciles
+// the index with blobs/, so blobs the index lost are counted and evicted too,
+// and it is the only place blobs are deleted, under the same lock, after the
+// entries of every process have been read. A blob deleted anyway, by hand say,
+// is downloaded again.
+class ImageCache
+{
+public:
+    // 'engine' carries the transfers and must outlive the cache. 'writer', if
+    // given, must finish its writes before the cache is destroyed.
+    ImageCache(const ImageCacheConfig &config, DownloadEngine &engine, AsyncFileWriter *writer = nullptr);
+    // Compacts the index.
+    ~ImageCache();
+
+    ImageCache(const ImageCache &) = delete;
+    ImageCache &operator=(const ImageCache &) = delete;
+
+    // Creates the cache directories, removes the files that dead processes
+    // left in tmp/ and loads the index. Returns false if the cache cannot be used.
+    bool open();
+
+    // Places the image at 'url' at 'destinationPath', from the cache when
+    // possible. 'onComplete' runs exactly once, either inline, on the
+    // engine's thread or on the file writer's. A transfer shared by several
+    // requests is traced under the 'layerNumber' of the first.
+    void fetch(const std::string &url, const std::string &destinationPath, DownloadEngine::Completion onComplete,
+               int layerNumber = -1);
+
+    // Compacts the index: merges the one on disk with this process's entries,
+    // drops entries whose blob is gone, counts blobs no entry names, evicts
+    // down to the size cap and writes the result atomically (temporary file
+    // plus rename).
+    bool save();
+
+    ImageCacheStats stats() const;
+
+private:
+    struct Entry
+    {
+        std::string blob;
+        std::string etag;
+        std::string lastModified;
+        // Milliseconds since the epoch, so processes sharing the cache agree.
+        uint64_t lastUsed = 0;
+        // Revalidated (or downloaded) by this process.
+        bool validated = false;
+    };
+
+    struct Blob
+    {
+        uint64_t size = 0;
+        uint64_t lastUsed = 0;
+    };
+
+    struct Waiter
+    {
+        std::string destinationPath;
+        DownloadEngine::Completion onComplete;
+    };
+
+    ImageCacheConfig config;
+    DownloadEngine &engine;
+    AsyncFileWriter *writer;
+    std::string blobDirectory;
+    std::string tempDirectory;
+    std::string indexPath;
+    std::string lockPath;
+
+    // Serializes index file access within the process; index.lock does it
+    // between processes. Taken before 'mutex', never while holding it.
+    std::mutex indexMutex;
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries; // By URL.
+    std::unordered_map<std::string, Blob> blobs;    // By blob name.
+    std::unordered_map<std::string, std::vector<Waiter>> inFlight;
+    uint64_t totalBytes = 0;
+    uint64_t clock = 0; // Last use handed out, for strict LRU order within the process.
+    uint64_t tempCounter = 0;
+    ImageCacheStats counters;
+
+    // Hashes a finished download and stores it as a new blob if need be, then
+    // hands it to storeFetch().
+    void finishFetch(const std::string &url, const std::shared_ptr<std::string> &body, const DownloadResult &result);
+    // Records the download and places it for every waiter. 'tempPath' holds
+    // the new blob 'blobName'; both are empty when it was already stored, and
+    // 'blobName' is empty when the body is not cacheable.
+    void storeFetch(const std::string &url, const std::string &body, const DownloadResult &result,
+                    const std::string &blobName, const std::string &tempPath);
+    // Appends the entry for 'url', whose blob has 'size' bytes, to the index.
+    // Expects the index lock to be held.
+    void appendIndex(const std::string &url, const Entry &entry, uint64_t size);
+    // Places the stored blob of 'entry' for a request. If the blob has gone,
+    // the entry is dropped and the image downloaded again.
+    void placeHit(const std::string &url, const Entry &entry, uint64_t size, const std::string &destinationPath,
+                  DownloadEngine::Completion onComplete, int layerNumber);
+    // A new last-use time. Expects 'mutex' to be held.
+    uint64_t touch();
+};
+
+#endif // IMAGE_CACHE_H
@@ -0,0 +1,56 @@
+#ifndef INPUT_REACTOR_H
+#define INPUT_REACTOR_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Reads supervised-mode commands, one per line, for as long as a job runs.
+// A single thread polls the input together with a wake-up pipe and queues
+// each complete line; interrupt() writes to that pipe, so a shutdown ends a
+// wait immediately instead of on the next poll. The input is stdin, or a file
+// or FIFO holding a scripted command stream.
+class InputReactor
+{
+public:
+    // Reads from 'fd', which stays open; open() reads from a file or FIFO.
+    explicit InputReactor(int fd = 0);
+    ~InputReactor();
+
+    InputReactor(const InputReactor &) = delete;
+    InputReactor &operator=(const InputReactor &) = delete;
+
+    // Creates the wake-up pipe and starts the thread; false on failure.
+    bool start();
+    // Opens 'path' (a FIFO blocks until it has a writer) and starts reading it.
+    bool open(const std::string &path);
+
+    // Blocks until the next line is available and stores it in 'line',
+    // without the line break. Once the input has ended every call yields an
+    // empty line, as reading a closed stdin did. Returns false once
+    // interrupt() has been called.
+    bool nextLine(std::string &line);
+
+    // Ends every wait of the running reactor. Only writes to a pipe, so it
+    // may be called from a signal handler.
+    static void interrupt();
+
+private:
+    int fd;
+    bool ownsFd = false;
+    int wakePipe[2] = {-1, -1};
+
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::string> lines;
+    bool ended = false;
+    bool interrupted = false;
+    bool stopping = false;
+    std::thread reader;
+
+    void readLoop();
+};
+
+#endif // INPUT_REACTOR_H
@@ -1,7 +1,6 @@
 #ifndef LAYER_H
 #define LAYER_H
 
-#include <sstream>
 #include <string>
 
 struct Layer
@@ -23,35 +22,12 @@ struct Layer
     double zOffsetAdjustment;         // e.g., 0.05
     int printBedTemperature;          // e.g., 60
     std::string layerTime;            // e.g., "5min_12sec"
+    int layerTimeSeconds;             // layerTime parsed at decode time, e.g., 312
     std::string fileName;             // e.g., "fl_layer_200000.png"
     std::string imageUrl;             // e.g., "https://..."
 
-    // Converts the layer data to a JSON-like string.
-    std::string toString() const
-    {
-        std::stringstream ss;
-        ss << "{ "
-           << "\"layerError\": \"" << layerError << "\", "
-           << "\"layerNumber\": " << layerNumber << ", "
-           << "\"layerHeight\": " << layerHeight << ", "
-           << "\"materialType\": \"" << materialType << "\", "
-           << "\"extrusionTemperature\": " << extrusionTemperature << ", "
-           << "\"printSpeed\": " << printSpeed << ", "
-           << "\"layerAdhesionQuality\": \"" << layerAdhesionQuality << "\", "
-           << "\"infillDensity\": " << infillDensity << ", "
-           << "\"infillPattern\": \"" << infillPattern << "\", "
-           << "\"shellThickness\": " << shellThickness << ", "
-           << "\"overhangAngle\": " << overhangAngle << ", "
-           << "\"coolingFanSpeed\": " << coolingFanSpeed << ", "
-           << "\"retractionSettings\": \"" << retractionSettings << "\", "
-           << "\"zOffsetAdjustment\": " << zOffsetAdjustment << ", "
-           << "\"printBedTemperature\": " << printBedTemperature << ", "
-           << "\"layerTime\": \"" << layerTime << "\", "
-           << "\"fileName\": \"" << fileName << "\", "
-           << "\"imageUrl\": \"" << imageUrl << "\" "
-           << "}";
-        return ss.str();
-    }
+    // Converts the layer data to a JSON string (see layer_json.h).
+    std::string toString() const;
 };
 
 #endif // LAYER_H
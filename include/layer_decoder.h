@@ -0,0 +1,105 @@
+#ifndef LAYER_DECODER_H
+#define LAYER_DECODER_H
+
+#include "layer.h"
+#include <array>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// How a CSV column is converted into its Layer member.
+enum class ColumnKind
+{
+    TEXT,
+    INTEGER,
+    REAL,
+    DURATION // Kept as text and also parsed into seconds (see parseDuration).
+};
+
+// One entry of the CSV schema: the column's position in the table is its CSV
+// index, and exactly one member pointer (matching 'kind') is set; a DURATION
+// column sets both 'text' and 'integer' (the seconds).
+struct LayerColumn
+{
+    const char *name;
+    ColumnKind kind;
+    std::string Layer::*text;
+    int Layer::*integer;
+    double Layer::*real;
+};
+
+constexpr LayerColumn textColumn(const char *name, std::string Layer::*member)
+{
+    return {name, ColumnKind::TEXT, member, nullptr, nullptr};
+}
+
+constexpr LayerColumn integerColumn(const char *name, int Layer::*member)
+{
+    return {name, ColumnKind::INTEGER, nullptr, member, nullptr};
+}
+
+constexpr LayerColumn realColumn(const char *name, double Layer::*member)
+{
+    return {name, ColumnKind::REAL, nullptr, nullptr, member};
+}
+
+constexpr LayerColumn durationColumn(const char *name, std::string Layer::*member, int Layer::*seconds)
+{
+    return {name, ColumnKind::DURATION, member, seconds, nullptr};
+}
+
+// CSV layout of fake_print_data.csv.
+inline constexpr std::array<LayerColumn, 18> kLayerColumns = {{
+    textColumn("layerError", &Layer::layerError),
+    integerColumn("layerNumber", &Layer::layerNumber),
+    realColumn("layerHeight", &Layer::layerHeight),
+    textColumn("materialType", &Layer::materialType),
+    integerColumn("extrusionTemperature", &Layer::extrusionTemperature),
+    integerColumn("printSpeed", &Layer::printSpeed),
+    textColumn("layerAdhesionQuality", &Layer::layerAdhesionQuality),
+    integerColumn("infillDensity", &Layer::infillDensity),
+    textColumn("infillPattern", &Layer::infillPattern),
+    integerColumn("shellThickness", &Layer::shellThickness),
+    integerColumn("overhangAngle", &Layer::overhangAngle),
+    integerColumn("coolingFanSpeed", &Layer::coolingFanSpeed),
+    textColumn("retractionSettings", &Layer::retractionSettings),
+    realColumn("zOffsetAdjustment", &Layer::zOffsetAdjustment),
+    integerColumn("printBedTemperature", &Layer::printBedTemperature),
+    durationColumn("layerTime", &Layer::layerTime, &Layer::layerTimeSeconds),
+    textColumn("fileName", &Layer::fileName),
+    textColumn("imageUrl", &Layer::imageUrl),
+}};
+
+// Why a row could not be decoded.
+struct LayerDecodeError
+{
+    enum Reason
+    {
+        MISSING_COLUMN, // The row ended before 'column'.
+        MALFORMED,      // The value is not a number.
+        OUT_OF_RANGE,   // The value does not fit the member type.
+        BAD_DURATION    // The value is not a duration parseDuration accepts.
+    };
+
+    Reason reason = MALFORMED;
+    size_t column = 0;
+    std::string_view value; // Points into the decoded row.
+
+    const char *columnName() const;
+    const char *describe() const;
+};
+
+// Parses a duration made of '_'-separated parts, hours, minutes and seconds in
+// that order, each at most once: "5min_12sec", "45sec", "1h_30min",
+// "1h_2min_3sec". Returns false (never throws) on anything else, including a
+// total that does not fit an int.
+bool parseDuration(std::string_view text, int &seconds);
+
+// Decodes a row straight into 'layer' following kLayerColumns. Numbers are
+// parsed with std::from_chars (surrounding blanks and a leading '+' are
+// accepted, anything else left over is an error). Returns false and fills
+// 'error' on the first column that fails; no exceptions are thrown.
+bool decodeLayer(const std::vector<std::string_view> &row, Layer &layer, LayerDecodeError &error);
+
+#endif // LAYER_DECODER_H
@@ -0,0 +1,73 @@
+#ifndef LAYER_INDEX_H
+#define LAYER_INDEX_H
+
+#include "compiled_dataset.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Every Kth data row of a CSV with the byte offset it starts at, kept in a
+// file next to the CSV, so a job printing a range of layer numbers can seek
+// close to it instead of parsing everything before it. The offsets are
+// record boundaries found by the CSV parser, never inside a quoted field, so
+// a reader started at one is in its initial state.
+//
+// Layer numbers need not increase along the file. Each entry records the
+// highest layer number before it and the lowest from it on, which is enough
+// to know that nothing in a range lies before one entry or after another.
+//
+//   magic "FPLIDX1\0"  u32 version  u32 stride
+//   u64 csvSize  u64 csvModified  u64 csvHash  u64 count
+//   (u64 offset  u32 rowNumber  u32 maxLayerBefore  u32 minLayerFrom  u32 reserved) * count
+//   u64 FNV-1a of everything before it
+struct LayerIndexEntry
+{
+    // Where row 'rowNumber' starts; 0 for the first data row, so a reader
+    // starting there still reads the header.
+    uint64_t offset = 0;
+    int rowNumber = 2;
+    // Highest layer number in the rows before this one (0 if none), and the
+    // lowest in this row and the rest of the file (INT_MAX if none). Rows
+    // that cannot be decoded count for neither.
+    int maxLayerBefore = 0;
+    int minLayerFrom = 0;
+};
+
+class LayerIndex
+{
+public:
+    // Data rows between entries.
+    static constexpr unsigned kStride = 1024;
+
+    // Where the index of 'csvFileName' is kept.
+    static std::string pathFor(const std::string &csvFileName);
+
+    // Reads the index at 'path' if it was built from 'csvFileName' as the CSV
+    // is now (see CompiledDataset::open); false if it is missing, damaged or
+    // out of date.
+    bool load(const std::string &path, const std::string &csvFileName);
+
+    // Building: feed every data row in file order. 'startOffset' is where the
+    // row starts; 'layerNumber' is 0 for a row that could not be decoded.
+    void add(int rowNumber, uint64_t startOffset, int layerNumber);
+
+    // Writes the index next to 'path' and renames it into place.
+    bool save(const std::string &path, const DatasetSource &source);
+
+    // The last entry with no layer from 'fromLayer' on before it.
+    const LayerIndexEntry &seek(int fromLayer) const;
+
+    // The offset from which no row holds a layer up to 'toLayer', or
+    // UINT64_MAX if the range may reach the end of the file.
+    uint64_t endOffset(int toLayer) const;
+
+    size_t size() const { return entries.size(); }
+
+private:
+    std::vector<LayerIndexEntry> entries;
+    size_t rowsAdded = 0;
+    int highestLayer = 0;
+};
+
+#endif // LAYER_INDEX_H
@@ -0,0 +1,27 @@
+#ifndef LAYER_JSON_H
+#define LAYER_JSON_H
+
+#include "layer.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// JSON output for layers. Everything appends to a caller-owned buffer, so a
+// buffer that is cleared and reused between layers stops allocating once it
+// has grown. Numbers go through std::to_chars: locale-independent, doubles in
+// their shortest round-trip form, and non-finite doubles as null.
+
+// Appends 'value' as a quoted JSON string, escaping quotes, backslashes and
+// control characters. Other bytes (UTF-8) are copied as they are.
+void appendJsonString(std::string &out, std::string_view value);
+void appendJsonNumber(std::string &out, int value);
+void appendJsonNumber(std::string &out, double value);
+
+// Appends the layer as one JSON object, members in CSV column order:
+// { "layerError": "SUCCESS", "layerNumber": 1, ... }
+void appendLayerJson(std::string &out, const Layer &layer);
+
+// Appends the layers as NDJSON: one object per line, each ending in '\n'.
+void appendLayersNdjson(std::string &out, const std::vector<Layer> &layers);
+
+#endif // LAYER_JSON_H
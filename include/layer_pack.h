@@ -0,0 +1,130 @@
+#ifndef LAYER_PACK_H
+#define LAYER_PACK_H
+
+#include "mapped_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct iovec;
+
+// Single-file output for a print job: every layer record (and optionally its
+// image) appended to one file, followed by an index. All integers are little
+// endian.
+//
+//   header   "FPPACK1\0"  u32 version  u32 reserved
+//   records  u32 kind  i32 layerNumber  u64 length  <length bytes>  ...
+//   index    (i32 layerNumber  u32 kind  u64 offset  u64 length) * count
+//   trailer  u64 indexOffset  u64 count  "FPPKEND\0"
+//
+// Record offsets point at the payload. A pack whose writer never finished
+// (no trailer) can still be read by walking the records.
+enum class PackRecordKind : uint32_t
+{
+    LAYER = 1, // The layer's JSON document.
+    IMAGE = 2  // The layer's image file.
+};
+
+enum class PackSync
+{
+    NEVER,       // Leave flushing to the kernel.
+    ON_CLOSE,    // One fsync once the index is written.
+    EVERY_BATCH  // fsync after every batch as well.
+};
+
+struct LayerPackOptions
+{
+    // Records are gathered in memory and written with one write() per batch.
+    // Large payloads, such as images, are not copied into the batch; a
+    // single writev() sends the batch and the payload together.
+    size_t batchBytes = 1 << 20;
+    PackSync sync = PackSync::ON_CLOSE;
+};
+
+// Appends records to a pack file. Safe to call from several threads.
+class LayerPackWriter
+{
+public:
+    explicit LayerPackWriter(const LayerPackOptions &options = LayerPackOptions());
+    // Closes the pack if it is still open.
+    ~LayerPackWriter();
+
+    LayerPackWriter(const LayerPackWriter &) = delete;
+    LayerPackWriter &operator=(const LayerPackWriter &) = delete;
+
+    // Creates (or truncates) the pack at 'path'.
+    bool open(const std::string &path);
+
+    bool append(PackRecordKind kind, int layerNumber, std::string_view payload);
+
+    // Appends the contents of the file at 'path'.
+    bool appendFile(PackRecordKind kind, int layerNumber, const std::string &path);
+
+    // Writes the remaining batch, the index and the trailer, then syncs per policy.
+    bool close();
+
+    bool isOpen() const { return fd >= 0; }
+
+private:
+    struct IndexEntry
+    {
+        int layerNumber;
+        PackRecordKind kind;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    LayerPackOptions options;
+    std::string path;
+    int fd = -1;
+
+    std::mutex mutex;
+    std::string batch;
+    uint64_t written = 0; // Bytes in the file, not counting 'batch'.
+    std::vector<IndexEntry> index;
+
+    // Expect 'mutex' to be held. flushBatch() writes the batch followed by 'tail'.
+    bool flushBatch(std::string_view tail = std::string_view());
+    bool writeAll(struct iovec *iov, int count);
+};
+
+// Read-only view of a pack with constant-time lookup by layer number. When a
+// layer number appears more than once, the last record wins (as when
+// per-layer files overwrite each other).
+class LayerPackReader
+{
+public:
+    bool open(const std::string &path);
+
+    // Views stay valid as long as the reader.
+    bool findLayer(int layerNumber, std::string_view &json) const;
+    bool findImage(int layerNumber, std::string_view &bytes) const;
+
+    size_t layerCount() const { return layers.size(); }
+    size_t imageCount() const { return images.size(); }
+
+    // Numbers of the layers with a record, in ascending order.
+    std::vector<int> layerNumbers() const;
+
+private:
+    struct Span
+    {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    std::unique_ptr<MappedFile> file;
+    std::unordered_map<int, Span> layers;
+    std::unordered_map<int, Span> images;
+
+    bool readIndex();
+    bool scanRecords();
+    void addEntry(int layerNumber, uint32_t kind, uint64_t offset, uint64_t length);
+};
+
+#endif // LAYER_PACK_H
@@ -0,0 +1,42 @@
+#ifndef LAYER_STAGER_H
+#define LAYER_STAGER_H
+
+#include <string>
+#include <vector>
+
+// Lets replay and supervised mode produce a layer's files ahead of time and
+// make them appear when the layer is due or confirmed. Files are written under <jobDir>/.staging/<subdir>/
+// and renamed into <jobDir>/<subdir>/ on publish; both trees are on the same
+// filesystem, so publishing is a single rename. Staged names carry the layer
+// number, so layers sharing a file name (an image used by many layers) each
+// have their own staged copy and publish over one another in order.
+class LayerStager
+{
+public:
+    explicit LayerStager(const std::string &jobDir);
+
+    // Removes the staging tree, including anything never published.
+    ~LayerStager();
+
+    LayerStager(const LayerStager &) = delete;
+    LayerStager &operator=(const LayerStager &) = delete;
+
+    // Creates the staging and final directories for each of 'subdirs'.
+    bool open(const std::vector<std::string> &subdirs);
+
+    // Where to produce layer 'layerNumber's file that will become
+    // <jobDir>/<subdir>/<fileName>.
+    std::string stagedPath(const std::string &subdir, int layerNumber, const std::string &fileName) const;
+
+    // Moves a staged file into place, replacing the one an earlier layer published.
+    bool publish(const std::string &subdir, int layerNumber, const std::string &fileName) const;
+
+    // Deletes a staged file without publishing it.
+    void discard(const std::string &subdir, int layerNumber, const std::string &fileName) const;
+
+private:
+    std::string jobDir;
+    std::string stagingDir;
+};
+
+#endif // LAYER_STAGER_H
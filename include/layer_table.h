@@ -0,0 +1,151 @@
+#ifndef LAYER_TABLE_H
+#define LAYER_TABLE_H
+
+#include "layer.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Append-only storage for strings. Blocks are never moved or freed before the
+// arena is, so the returned views stay valid for the arena's lifetime.
+class StringArena
+{
+public:
+    std::string_view store(std::string_view value);
+
+    // Bytes held in blocks, used or not.
+    size_t capacity() const { return reserved; }
+
+private:
+    static constexpr size_t kBlockSize = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cursor = nullptr;
+    size_t left = 0;
+    size_t reserved = 0;
+};
+
+// Maps each distinct string to a dense code (0, 1, 2, ... in order of first
+// appearance) and back. The strings live in a caller-provided arena.
+class StringDictionary
+{
+public:
+    uint32_t intern(std::string_view value, StringArena &arena);
+
+    // Returns false if 'value' was never interned.
+    bool find(std::string_view value, uint32_t &code) const;
+
+    std::string_view value(uint32_t code) const { return values[code]; }
+    size_t size() const { return values.size(); }
+
+private:
+    std::vector<std::string_view> values;
+    std::unordered_map<std::string_view, uint32_t> codes;
+};
+
+// A set of selected rows, one byte per row (1 = selected). Filters narrow it
+// in place, so conditions combine by applying one filter after another.
+using RowMask = std::vector<uint8_t>;
+
+// Count, sum, sum of squares and range of the selected values of an integer
+// column. Sums are exact.
+struct ColumnAggregate
+{
+    uint64_t count = 0;
+    int64_t sum = 0;
+    int64_t sumOfSquares = 0;
+    int32_t min = 0;
+    int32_t max = 0;
+
+    double mean() const { return count > 0 ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+};
+
+// The printed layers of a job stored column by column. Numbers sit in
+// contiguous arrays and the low-cardinality text columns are dictionary-encoded,
+// so a query touches only the columns it needs and its loops vectorize.
+// Example, the mean print speed of failed PETG layers:
+//
+//   RowMask rows = table.selectAll();
+//   table.whereEquals(LayerTable::MATERIAL_TYPE, "PETG", rows);
+//   table.whereNotEquals(LayerTable::LAYER_ERROR, "SUCCESS", rows);
+//   double speed = table.aggregate(LayerTable::PRINT_SPEED, &rows).mean();
+class LayerTable
+{
+public:
+    enum IntColumn
+    {
+        LAYER_NUMBER,
+        EXTRUSION_TEMPERATURE,
+        PRINT_SPEED,
+        INFILL_DENSITY,
+        SHELL_THICKNESS,
+        OVERHANG_ANGLE,
+        COOLING_FAN_SPEED,
+        PRINT_BED_TEMPERATURE,
+        LAYER_TIME_SECONDS,
+        INT_COLUMN_COUNT
+    };
+
+    enum TextColumn
+    {
+        LAYER_ERROR,
+        MATERIAL_TYPE,
+        LAYER_ADHESION_QUALITY,
+        INFILL_PATTERN,
+        RETRACTION_SETTINGS,
+        LAYER_TIME,
+        TEXT_COLUMN_COUNT
+    };
+
+    LayerTable() = default;
+    // Dictionaries and views point into the arena; the table stays put.
+    LayerTable(const LayerTable &) = delete;
+    LayerTable &operator=(const LayerTable &) = delete;
+
+    void append(const Layer &layer);
+
+    size_t size() const { return rowCount; }
+    // Approximate bytes used by the columns, dictionaries and arena.
+    size_t memoryUsage() const;
+
+    // Rebuilds row 'row' as a Layer.
+    Layer row(size_t row) const;
+
+    const std::vector<int32_t> &column(IntColumn column) const { return ints[column]; }
+    const std::vector<double> &layerHeights() const { return layerHeight; }
+    const std::vector<double> &zOffsetAdjustments() const { return zOffsetAdjustment; }
+    // Codes into dictionary(column), one per row.
+    const std::vector<uint32_t> &codes(TextColumn column) const { return texts[column]; }
+    const StringDictionary &dictionary(TextColumn column) const { return dictionaries[column]; }
+
+    RowMask selectAll() const { return RowMask(rowCount, 1); }
+
+    // Keeps only the selected rows whose 'column' is (or is not) 'value'.
+    void whereEquals(TextColumn column, std::string_view value, RowMask &rows) const;
+    void whereNotEquals(TextColumn column, std::string_view value, RowMask &rows) const;
+    // Keeps only the selected rows with lower <= column value <= upper.
+    void whereBetween(IntColumn column, int32_t lower, int32_t upper, RowMask &rows) const;
+
+    // Aggregates the selected rows (all rows if 'rows' is null).
+    ColumnAggregate aggregate(IntColumn column, const RowMask *rows = nullptr) const;
+
+    // Number of selected rows per dictionary code of 'column'.
+    std::vector<uint64_t> countBy(TextColumn column, const RowMask *rows = nullptr) const;
+
+private:
+    StringArena arena;
+    size_t rowCount = 0;
+    std::vector<int32_t> ints[INT_COLUMN_COUNT];
+    std::vector<double> layerHeight;
+    std::vector<double> zOffsetAdjustment;
+    std::vector<uint32_t> texts[TEXT_COLUMN_COUNT];
+    StringDictionary dictionaries[TEXT_COLUMN_COUNT];
+    // fileName and imageUrl differ on every row, so they are stored, not interned.
+    std::vector<std::string_view> fileName;
+    std::vector<std::string_view> imageUrl;
+};
+
+#endif // LAYER_TABLE_H
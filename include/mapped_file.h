@@ -0,0 +1,68 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// RAII wrapper for a read-only memory mapping of a regular file.
+// Pipes, FIFOs and other non-regular files are left unmapped so callers can
+// fall back to stream I/O.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+
+    explicit MappedFile(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            length = static_cast<size_t>(st.st_size);
+            if (length == 0)
+            {
+                // mmap rejects empty ranges; an empty file is still a valid mapping.
+                open = true;
+            }
+            else
+            {
+                void *addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED)
+                {
+                    ::madvise(addr, length, MADV_SEQUENTIAL);
+                    base = static_cast<const char *>(addr);
+                    open = true;
+                }
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (base)
+        {
+            ::munmap(const_cast<char *>(base), length);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool isOpen() const { return open; }
+    const char *data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const char *base = nullptr;
+    size_t length = 0;
+    bool open = false;
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,50 @@
+#ifndef PARALLEL_CSV_READER_H
+#define PARALLEL_CSV_READER_H
+
+#include "byte_source.h"
+#include "mapped_file.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Parses a memory-mapped CSV file on several threads.
+// The file is cut into byte ranges; each cut is moved forward to the next
+// record start, using the quote parity of everything before it, so a quoted
+// field that spans a cut stays in one piece. A fixed set of worker threads,
+// started once per pass over the file, take the ranges in turn; rows are
+// handed back in file order on the calling thread.
+class ParallelCSVReader
+{
+public:
+    static constexpr size_t kDefaultChunkSize = 2 * 1024 * 1024;
+
+    ParallelCSVReader(const std::string &filename, unsigned threads, size_t chunkSize = kDefaultChunkSize);
+
+    // True if the file could be mapped and is not compressed; otherwise
+    // callers should use CSVReader.
+    bool isMapped() const
+    {
+        return mapped.isOpen() && detectCompression(mapped.data(), mapped.size()) == Compression::NONE;
+    }
+    size_t size() const { return mapped.size(); }
+
+    // Calls onRow for every record from byte 'startOffset' (a record start) on,
+    // in file order, with the offset just past the record. Stops early if
+    // onRow returns false.
+    void forEachRow(const std::function<bool(const std::vector<std::string_view> &row, uint64_t endOffset)> &onRow,
+                    uint64_t startOffset = 0);
+
+private:
+    MappedFile mapped;
+    unsigned threads;
+    size_t chunkSize;
+
+    // Returns record-aligned chunk boundaries, starting with 'start' and
+    // ending with size(), from the quote count of every chunkSize piece after 'start'.
+    std::vector<size_t> findChunkBoundaries(size_t start, const std::vector<size_t> &quotes);
+};
+
+#endif // PARALLEL_CSV_READER_H
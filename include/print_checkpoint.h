@@ -0,0 +1,68 @@
+#ifndef PRINT_CHECKPOINT_H
+#define PRINT_CHECKPOINT_H
+
+#include "compiled_dataset.h"
+#include "print_statistics.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Follows rows as they are accounted for, in any order, and keeps the first
+// row that is not: everything before it is done and never has to be read
+// again. Rows done past it (the pipeline finishes layers out of order) are
+// remembered until the gap closes.
+class RowWatermark
+{
+public:
+    // Every row before 'nextRow', which starts at byte 'offset', is done.
+    void reset(int nextRow, uint64_t offset);
+
+    // Row 'rowNumber', whose record ends at byte 'endOffset', is done.
+    void markDone(int rowNumber, uint64_t endOffset);
+
+    int nextRow() const { return next; }
+    uint64_t offset() const { return nextOffset; }
+
+    // Rows past nextRow() that are done, in order.
+    std::vector<int> rowsAhead() const;
+
+private:
+    // Row 1 is the CSV header.
+    int next = 2;
+    uint64_t nextOffset = 0;
+    std::map<int, uint64_t> ahead;
+};
+
+// Progress of a print job, saved every few hundred layers so a killed job can
+// resume where it stopped instead of starting over. Rows before 'offset' and
+// the rows in 'rowsDone' have been written, downloaded and counted in the
+// totals and statistics; everything else is done again.
+struct PrintCheckpoint
+{
+    // Size and modification time of the CSV the offsets point into; its
+    // hash is not recorded.
+    DatasetSource csv;
+
+    // Byte offset of row 'nextRow' in the CSV; 0 means the start of the file.
+    uint64_t offset = 0;
+    int nextRow = 2;
+    // Rows after 'nextRow' that are done too, in order.
+    std::vector<int> rowsDone;
+
+    int layersPrinted = 0;
+    int errors = 0;
+    PrintStatistics statistics;
+
+    // True if 'csvFileName' still looks like the file the checkpoint was made from.
+    bool sameCsv(const std::string &csvFileName) const;
+
+    // Writes the checkpoint next to 'path', syncs it and renames it over
+    // 'path', so a crash leaves either the old checkpoint or the new one.
+    bool save(const std::string &path) const;
+
+    // Reads a checkpoint written by save(); false if it is missing or damaged.
+    bool load(const std::string &path);
+};
+
+#endif // PRINT_CHECKPOINT_H
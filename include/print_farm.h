@@ -0,0 +1,52 @@
+#ifndef PRINT_FARM_H
+#define PRINT_FARM_H
+
+#include "fake_printer.h"
+#include <string>
+#include <vector>
+
+// One entry of a farm manifest.
+struct FarmJob
+{
+    std::string printName;
+    std::string destFolder;
+    FakePrinter::Mode mode = FakePrinter::AUTOMATIC;
+};
+
+struct FarmConfig
+{
+    // Pool threads; 0 means one per hardware thread.
+    unsigned threads = 0;
+    // Jobs running at once; the others wait for a free place.
+    unsigned maxActiveJobs = 8;
+    // Layers a job handles per turn on the pool.
+    unsigned sliceLayers = 32;
+};
+
+// Runs many print jobs in one process. The CSV is decoded once, and all jobs
+// share it, one download engine (so --downloads caps the whole farm) and one
+// image cache. Jobs run in slices on a shared work-stealing pool: a job has
+// at most one slice queued or running, and a slice waiting for its downloads
+// holds no thread. Every active job therefore gets a turn before any job
+// gets its next one.
+class PrintFarm
+{
+public:
+    // 'options' applies to every job (automatic mode only).
+    PrintFarm(const FarmConfig &config, const PrintOptions &options);
+
+    // Reads a manifest with one job per line, written like the command line:
+    //   --name <print_name> --dest <destination_folder> --mode automatic
+    // Blank lines and lines starting with '#' are skipped.
+    static bool loadManifest(const std::string &path, std::vector<FarmJob> &jobs);
+
+    // Runs every job to completion and logs an aggregate report. Returns
+    // false if the farm could not start.
+    bool run(const std::vector<FarmJob> &jobs);
+
+private:
+    FarmConfig config;
+    PrintOptions options;
+};
+
+#endif // PRINT_FARM_H
@@ -0,0 +1,171 @@
+#ifndef PRINT_PIPELINE_H
+#define PRINT_PIPELINE_H
+
+#include "bounded_queue.h"
+#include "download_engine.h"
+#include "layer.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct PendingWrite;
+
+// A layer travelling through the automatic-mode pipeline.
+struct LayerTask
+{
+    enum Status
+    {
+        PENDING,         // Still moving through the stages.
+        DECODE_FAILED,   // The row could not be decoded; 'error' has details.
+        WRITE_FAILED,    // The layer's JSON file could not be written.
+        DOWNLOAD_FAILED, // The image download failed; 'error' has details.
+        CANCELLED,       // Discarded because the job is shutting down.
+        SKIPPED,         // Already done before the job was resumed, or outside the layer range.
+        PRINTED
+    };
+
+    Layer layer;
+    int rowNumber = 0;
+    // Byte offset just past the row in the CSV, for checkpoints.
+    uint64_t endOffset = 0;
+    Status status = PENDING;
+    std::string error;
+    // Set by the validate stage. Automatic mode still prints invalid layers.
+    std::string validationError;
+    // The image, when the download stage spooled it into memory instead of
+    // a file (images bound for a pack file).
+    std::optional<std::string> image;
+    // Pipeline bookkeeping: the layer's record write, while it may still be running.
+    std::shared_ptr<PendingWrite> pendingWrite;
+};
+
+struct PipelineConfig
+{
+    unsigned validateWorkers = 1;
+    unsigned writeWorkers = 2;
+    // Image downloads the download stage keeps in flight.
+    unsigned downloadsInFlight = 16;
+    // Capacity of the queue in front of each stage.
+    size_t queueCapacity = 256;
+};
+
+// Snapshot of the queue in front of one stage.
+struct PipelineQueueStats
+{
+    const char *stage;
+    size_t depth;
+    size_t peak;
+    size_t capacity;
+};
+
+// Work done by each stage. Everything except 'sink' runs on pipeline threads,
+// so validate/write/download must be safe to call concurrently.
+struct PipelineStages
+{
+    // Produces tasks in file order. 'emit' blocks while the validate queue is
+    // full, or while the sink has as many tasks coming as its queue holds,
+    // and returns false once the pipeline has been cancelled.
+    std::function<void(const std::function<bool(LayerTask &&task)> &emit)> parse;
+    std::function<bool(const Layer &layer, std::string &errorMsg)> validate;
+    // Starts writing the layer's record; 'onWritten' must run exactly once,
+    // possibly later and on another thread. The task goes on to its download
+    // meanwhile and reaches the sink once both have finished.
+    std::function<void(const Layer &layer, std::function<void(bool written)> onWritten)> write;
+    // Starts the task's image download; 'onComplete' must run exactly once.
+    // The task stays put until then, so the download may fill 'task.image'.
+    std::function<void(LayerTask &task, DownloadEngine::Completion onComplete)> download;
+    // Receives every task exactly once, on the thread that called run().
+    std::function<void(LayerTask &task)> sink;
+};
+
+// Automatic mode as a chain of stages:
+//
+//   parse -> validate (N) -> write (M) -> download (in flight) -> sink
+//
+// Stages are connected by bounded lock-free queues, so a slow stage makes the
+// ones before it wait instead of buffering the whole file. Writes run in the
+// background alongside the download. Tasks that fail or are cancelled skip
+// straight to the sink, which does all the accounting. No more tasks are let
+// in than the sink's queue holds, so the download engine and file writer
+// threads, which hand finished tasks to the sink, never wait for a slow sink
+// (replay mode sleeps there until each layer is due).
+class PrintPipeline
+{
+public:
+    // 'stopRequested' is polled by the sink; once set, every stage is
+    // cancelled and whatever is still queued reaches the sink as CANCELLED.
+    PrintPipeline(const PipelineConfig &config,
+                  DownloadEngine &engine,
+                  const std::atomic<bool> &stopRequested);
+
+    PrintPipeline(const PrintPipeline &) = delete;
+    PrintPipeline &operator=(const PrintPipeline &) = delete;
+
+    // Runs every stage to completion and returns once the last task has been sunk.
+    void run(const PipelineStages &stages);
+
+    // Current and peak depth of each stage's input queue. Safe to call from any thread.
+    std::vector<PipelineQueueStats> queueStats() const;
+
+    // Cancels every stage, as a stop request does; the sink may call it to
+    // end the job early.
+    void cancel();
+
+    bool cancelled() const { return cancelRequested.load(std::memory_order_acquire); }
+
+private:
+    struct Channel
+    {
+        Channel(const char *stage, size_t capacity) : stage(stage), queue(capacity) {}
+
+        const char *stage;
+        BoundedQueue<LayerTask> queue;
+        // Workers still pushing; the channel is closed once this reaches zero.
+        std::atomic<unsigned> producers{0};
+        std::atomic<size_t> peak{0};
+        // Consumers waiting for a task or the close, and producers waiting for room.
+        WaitSignal readable;
+        WaitSignal writable;
+    };
+
+    PipelineConfig config;
+    DownloadEngine &engine;
+    const std::atomic<bool> &stopRequested;
+
+    Channel toValidate;
+    Channel toWrite;
+    Channel toDownload;
+    Channel toSink;
+
+    std::atomic<bool> cancelRequested{false};
+    std::atomic<unsigned> activeWorkers{0};
+    std::atomic<size_t> downloadsPending{0};
+    std::atomic<size_t> writesPending{0};
+    // The download stage waits here for a download slot or the cancellation.
+    WaitSignal downloadSlots;
+    // Tasks emitted and not yet taken by the sink; parsing waits on
+    // 'sinkRoom' while they would fill the sink's queue.
+    std::atomic<size_t> tasksAdmitted{0};
+    WaitSignal sinkRoom;
+
+    static void push(Channel &channel, LayerTask &&task);
+    static bool pop(Channel &channel, LayerTask &task);
+    // Sends a task to the sink, once its write (if any) has finished too.
+    void sink(LayerTask &&task);
+    // One of a pending write's two halves is done; the second sinks the task.
+    void arrive(PendingWrite &write);
+
+    // Pops from 'in' until it closes, applies 'work' to pending tasks and
+    // forwards them to 'out'; anything else goes to the sink.
+    void runStage(Channel &in, Channel &out, const std::function<void(LayerTask &task)> &work);
+    void runDownloads(const PipelineStages &stages);
+    void finishWorker(Channel *out);
+    void logQueueDepths(bool peaks) const;
+};
+
+#endif // PRINT_PIPELINE_H
@@ -0,0 +1,131 @@
+#ifndef PRINT_STATISTICS_H
+#define PRINT_STATISTICS_H
+
+#include "layer.h"
+#include "layer_table.h"
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+class ByteReader;
+
+// Count, min, max, mean and variance of a stream of values in one pass
+// (Welford's algorithm), so nothing has to be kept per value.
+class RunningStat
+{
+public:
+    void add(double value);
+
+    // Combines two partial results as if all values had gone into one
+    // (Chan et al.'s parallel update).
+    void merge(const RunningStat &other);
+
+    // The result of adding 'count' values with the given sum, sum of squares
+    // and range, e.g. from a column aggregate.
+    static RunningStat fromMoments(uint64_t count, double sum, double sumOfSquares, double min, double max);
+
+    // Appends the exact state to 'out' / restores it; decode() returns false
+    // on malformed input (see binary_io.h).
+    void encode(std::string &out) const;
+    bool decode(ByteReader &in);
+
+    uint64_t count() const { return n; }
+    double sum() const { return total; }
+    double min() const { return lowest; }
+    double max() const { return highest; }
+    double mean() const { return average; }
+    // Population variance; 0 with fewer than two values.
+    double variance() const;
+    double stddev() const;
+
+private:
+    uint64_t n = 0;
+    double total = 0.0;
+    double average = 0.0;
+    double m2 = 0.0;
+    double lowest = 0.0;
+    double highest = 0.0;
+};
+
+// Counts integer values in fixed-width buckets covering [lower, upper), with
+// separate counts for values below and above the range.
+class FixedHistogram
+{
+public:
+    FixedHistogram(int lower, int upper, int width);
+
+    // Counts 'value' 'times' times.
+    void add(int value, uint64_t times = 1);
+
+    // Both histograms must have the same range and width.
+    void merge(const FixedHistogram &other);
+
+    // The counts only; decode() expects a histogram of the same shape.
+    void encode(std::string &out) const;
+    bool decode(ByteReader &in);
+
+    size_t bucketCount() const { return buckets.size(); }
+    int bucketLower(size_t bucket) const { return lower + static_cast<int>(bucket) * width; }
+    int bucketWidth() const { return width; }
+    uint64_t count(size_t bucket) const { return buckets[bucket]; }
+    uint64_t underflow() const { return below; }
+    uint64_t overflow() const { return above; }
+
+private:
+    int lower;
+    int width;
+    std::vector<uint64_t> buckets;
+    uint64_t below = 0;
+    uint64_t above = 0;
+};
+
+// Statistics of the printed layers, updated as each layer completes. Memory
+// does not grow with the number of layers: only the per-material and
+// per-error-category counters grow, with the number of distinct values.
+// Partial results from several workers can be merged.
+class PrintStatistics
+{
+public:
+    PrintStatistics();
+
+    void addLayer(const Layer &layer);
+
+    // Counts every row of 'table' as addLayer would, working column by column.
+    void addTable(const LayerTable &table);
+
+    void merge(const PrintStatistics &other);
+
+    // Saves and restores everything counted so far, e.g. in a checkpoint.
+    void encode(std::string &out) const;
+    bool decode(ByteReader &in);
+
+    uint64_t layers() const { return layerCount; }
+    const RunningStat &printSpeed() const { return speed; }
+    const RunningStat &extrusionTemperature() const { return temperature; }
+    // In seconds.
+    const RunningStat &layerTime() const { return time; }
+
+    // Exact per-value speeds (1 mm/s buckets), 5 °C and 1 minute buckets.
+    const FixedHistogram &printSpeedHistogram() const { return speedHistogram; }
+    const FixedHistogram &extrusionTemperatureHistogram() const { return temperatureHistogram; }
+    const FixedHistogram &layerTimeHistogram() const { return timeHistogram; }
+
+    const std::map<std::string, uint64_t> &materialCounts() const { return materials; }
+    // Layers printed with a layerError other than SUCCESS, by category.
+    const std::map<std::string, uint64_t> &errorCounts() const { return errors; }
+
+private:
+    uint64_t layerCount = 0;
+    RunningStat speed;
+    RunningStat temperature;
+    RunningStat time;
+    FixedHistogram speedHistogram;
+    FixedHistogram temperatureHistogram;
+    FixedHistogram timeHistogram;
+    std::map<std::string, uint64_t> materials;
+    std::map<std::string, uint64_t> errors;
+};
+
+#endif // PRINT_STATISTICS_H
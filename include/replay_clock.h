@@ -0,0 +1,49 @@
+#ifndef REPLAY_CLOCK_H
+#define REPLAY_CLOCK_H
+
+#include "print_statistics.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Deadline scheduler for replay mode. A layer is due once the layer times of
+// every layer up to and including it, divided by the speed factor, have
+// passed since start(). Each deadline is computed from that running total
+// rather than from the previous deadline, so rounding and late wake-ups do
+// not accumulate over a long job.
+class ReplayClock
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // 'speed' > 1 replays faster than real time (10 = ten times faster).
+    explicit ReplayClock(double speed);
+
+    void start();
+
+    // Adds a layer taking 'seconds' to the schedule and returns when it is due.
+    Clock::time_point advance(int seconds);
+
+    // Blocks until 'deadline', or returns false as soon as 'stop' is set.
+    // Sleeps until shortly before the deadline and spins the rest of the way,
+    // since a sleep alone can overshoot by a scheduler tick.
+    bool waitUntil(Clock::time_point deadline, const std::atomic<bool> &stop) const;
+
+    // Records how late a layer due at 'deadline' was published.
+    void recordLag(Clock::time_point deadline, Clock::time_point published);
+
+    // Publication lag, in milliseconds.
+    const RunningStat &lag() const { return lagMs; }
+    // Print time scheduled so far, in seconds.
+    uint64_t scheduledSeconds() const { return totalSeconds; }
+    // Wall time since start(), in seconds.
+    double elapsedSeconds() const;
+
+private:
+    double speed;
+    Clock::time_point origin;
+    uint64_t totalSeconds = 0;
+    RunningStat lagMs;
+};
+
+#endif // REPLAY_CLOCK_H
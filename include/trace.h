@@ -0,0 +1,94 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Hot-path tracing. Spans are recorded into a fixed-size ring per thread,
+// without locks once the thread has its ring, and written out in the Chrome
+// trace event format (chrome://tracing, ui.perfetto.dev) when the job ends.
+// While tracing is off, a span costs a relaxed load and a branch.
+//
+// Names and outcomes must be string literals: only the pointers are kept.
+class Trace
+{
+public:
+    // Spans kept per thread; a thread that records more keeps the latest.
+    static constexpr size_t kEventsPerThread = 1 << 16;
+
+    // Starts recording. Once per process.
+    static void start();
+
+    // Stops recording and writes every thread's spans to 'path'. Threads
+    // that recorded spans must be done by then.
+    static bool finish(const std::string &path);
+
+    static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+    // Nanoseconds on the trace clock (steady_clock).
+    static uint64_t now();
+
+    // Records a span from 'start' (a now() value) until now on the calling
+    // thread. For work that ends on another thread than it started, such as
+    // an asynchronous download; scoped work uses TraceSpan. 'layer' is -1
+    // and 'outcome' null when they do not apply.
+    static void record(const char *name, uint64_t start, int layer, uint64_t bytes, const char *outcome);
+
+    // Labels the calling thread's row in the trace.
+    static void nameThread(const char *name);
+    // The calling thread's label; null if it has none or tracing is off.
+    static const char *threadName();
+
+private:
+    static std::atomic<bool> active;
+};
+
+// Records the time from its construction to its destruction as a span.
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name, int layer = -1)
+        : name(name), layer(layer), recording(Trace::enabled()), start(recording ? Trace::now() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        if (recording)
+            Trace::record(name, start, layer, bytes, outcome);
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    void setLayer(int number) { layer = number; }
+    void setBytes(uint64_t count) { bytes = count; }
+    void setOutcome(const char *text) { outcome = text; }
+
+private:
+    const char *name;
+    int layer;
+    bool recording;
+    uint64_t start;
+    uint64_t bytes = 0;
+    const char *outcome = nullptr;
+};
+
+// Labels the calling thread while in scope and restores its previous label
+// afterwards, for work that borrows a thread it does not own.
+class TraceThreadName
+{
+public:
+    explicit TraceThreadName(const char *name) : previous(Trace::threadName()) { Trace::nameThread(name); }
+    ~TraceThreadName() { Trace::nameThread(previous); }
+
+    TraceThreadName(const TraceThreadName &) = delete;
+    TraceThreadName &operator=(const TraceThreadName &) = delete;
+
+private:
+    const char *previous;
+};
+
+#endif // TRACE_H
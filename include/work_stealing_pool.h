@@ -0,0 +1,63 @@
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task deque. Tasks submitted
+// from a worker go to that worker's deque; tasks from other threads are
+// spread round-robin. An idle worker steals from the others.
+//
+// Owners take their oldest task and thieves the newest, so tasks that keep
+// resubmitting themselves (farm jobs do) take turns instead of one of them
+// monopolizing a worker.
+class WorkStealingPool
+{
+public:
+    // 0 threads means one per hardware thread.
+    explicit WorkStealingPool(unsigned threads = 0);
+
+    // Runs every task already submitted, then joins the workers.
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // Safe to call from any thread, including from inside a task.
+    void submit(std::function<void()> task);
+
+    size_t threadCount() const { return workers.size(); }
+
+    // Tasks taken from another worker's deque so far.
+    size_t steals() const { return stolen.load(std::memory_order_relaxed); }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<size_t> queued{0};
+    bool stopping = false;
+
+    std::atomic<unsigned> nextWorker{0};
+    std::atomic<size_t> stolen{0};
+
+    bool take(unsigned self, std::function<void()> &task);
+    void workerLoop(unsigned self);
+};
+
+#endif // WORK_STEALING_POOL_H
@@ -0,0 +1,486 @@
+#include "async_file_writer.h"
+#include "trace.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "spdlog/spdlog.h"
+
+#ifdef FAKEPRINTER_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// Files are created like std::ofstream creates them.
+static constexpr int kOpenFlags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+static constexpr mode_t kOpenMode = 0666;
+
+// How long an idle ring waits after the first file of a burst for more to
+// arrive, so they go to the kernel as one batch.
+static constexpr std::chrono::microseconds kGatherDelay(200);
+
+#ifdef FAKEPRINTER_HAVE_IO_URING
+
+// The operations a job goes through, kept in the low bits of user_data (jobs
+// are at least 8-byte aligned).
+enum RingOp : uint64_t
+{
+    OP_OPEN,
+    OP_WRITE,
+    OP_SYNC,
+    OP_CLOSE
+};
+
+// An io_uring set up with raw system calls, so liburing is not needed.
+struct AsyncFileWriter::Ring
+{
+    int fd = -1;
+    void *sqMap = MAP_FAILED;
+    size_t sqMapSize = 0;
+    void *cqMap = MAP_FAILED;
+    size_t cqMapSize = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sqesSize = 0;
+
+    unsigned *sqHead = nullptr;
+    unsigned *sqTail = nullptr;
+    unsigned sqMask = 0;
+    unsigned *sqArray = nullptr;
+    unsigned *cqHead = nullptr;
+    unsigned *cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+    // Entries filled since the last io_uring_enter, and operations submitted
+    // whose completion has not been reaped.
+    unsigned toSubmit = 0;
+    unsigned outstanding = 0;
+
+    ~Ring()
+    {
+        if (sqes != MAP_FAILED)
+            ::munmap(sqes, sqesSize);
+        if (cqMap != MAP_FAILED)
+            ::munmap(cqMap, cqMapSize);
+        if (sqMap != MAP_FAILED)
+            ::munmap(sqMap, sqMapSize);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    // Sets up a ring of 'entries' submission slots and checks that the kernel
+    // has every operation the writer uses. The kernel runs opens that create
+    // files on its own worker threads; at most 'workers' of them.
+    bool open(unsigned entries, unsigned workers)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0)
+            return false;
+
+        sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqMap = ::mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        cqMap = ::mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = static_cast<io_uring_sqe *>(
+            ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqMap == MAP_FAILED || cqMap == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+
+        char *sq = static_cast<char *>(sqMap);
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        char *cq = static_cast<char *>(cqMap);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // Opening and closing through the ring need Linux 5.6.
+        constexpr unsigned kProbeOps = 256;
+        std::vector<char> buffer(sizeof(io_uring_probe) + kProbeOps * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, kProbeOps) < 0)
+            return false;
+        for (unsigned op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE})
+        {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+
+        // Files created in one directory serialize on its lock, so more
+        // workers only add contention. Needs Linux 5.15; best effort.
+        unsigned maxWorkers[2] = {workers, workers};
+        ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_IOWQ_MAX_WORKERS, maxWorkers, 2);
+        return true;
+    }
+
+    // Next free submission slot, cleared. The writer never has more
+    // operations outstanding than the ring holds, so there always is one.
+    io_uring_sqe *prepare(uint8_t opcode, int fileFd, uint64_t userData, uint8_t flags = 0)
+    {
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fileFd;
+        sqe->flags = flags;
+        sqe->user_data = userData;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        toSubmit++;
+        return sqe;
+    }
+
+    // Submits what was prepared and waits until everything in flight has
+    // completed; files queued meanwhile make up the next batch. Returns false
+    // if the ring is unusable.
+    bool submitAndWait()
+    {
+        do
+        {
+            unsigned waitFor = outstanding + toSubmit;
+            long submitted = ::syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submitted < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                return false;
+            }
+            toSubmit -= static_cast<unsigned>(submitted);
+            outstanding += static_cast<unsigned>(submitted);
+        } while (toSubmit > 0);
+        return true;
+    }
+
+    // Hands every completion waiting in the ring to 'onCompletion'.
+    template <typename Handler>
+    void reap(Handler &&onCompletion)
+    {
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            onCompletion(cqe.user_data, cqe.res);
+            outstanding--;
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+};
+
+#else
+
+struct AsyncFileWriter::Ring
+{
+};
+
+#endif
+
+AsyncFileWriter::AsyncFileWriter(const AsyncFileWriterConfig &config)
+    : config(config)
+{
+    this->config.maxInFlight = std::clamp(config.maxInFlight, 1u, 1024u);
+    this->config.threads = std::max(1u, config.threads);
+
+    const char *forced = std::getenv("FAKEPRINTER_FILE_WRITER");
+    bool useRing = !forced || std::strcmp(forced, "threads") != 0;
+#ifdef FAKEPRINTER_HAVE_IO_URING
+    if (useRing)
+    {
+        // Each file has at most three operations (write, sync, close) outstanding.
+        ring = std::make_unique<Ring>();
+        if (!ring->open(this->config.maxInFlight * 3, this->config.threads))
+        {
+            spdlog::debug("io_uring is not available; writing files on threads.");
+            ring.reset();
+        }
+    }
+#else
+    (void)useRing;
+#endif
+
+    if (ring)
+    {
+        workers.emplace_back(&AsyncFileWriter::ringLoop, this);
+        return;
+    }
+    for (unsigned i = 0; i < this->config.threads; ++i)
+        workers.emplace_back(&AsyncFileWriter::threadLoop, this);
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+void AsyncFileWriter::submit(std::string path, std::shared_ptr<const std::string> data, Completion onComplete)
+{
+    auto job = std::make_unique<Job>();
+    job->path = std::move(path);
+    job->data = std::move(data);
+    job->onComplete = std::move(onComplete);
+    size_t depth;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.push_back(std::move(job));
+        unfinished++;
+        depth = queued.size();
+    }
+    // A gathering ring only needs waking for the first file and a full batch.
+    if (!ring || depth == 1 || depth == config.maxInFlight)
+        wake.notify_one();
+}
+
+void AsyncFileWriter::waitAll()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    // Ends the ring's gathering delay; nothing more is coming.
+    flushing++;
+    wake.notify_all();
+    idle.wait(lock, [this]
+              { return unfinished == 0; });
+    flushing--;
+}
+
+const char *AsyncFileWriter::backend() const
+{
+    return ring ? "io_uring" : "threads";
+}
+
+AsyncFileWriterStats AsyncFileWriter::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+void AsyncFileWriter::finish(std::unique_ptr<Job> job)
+{
+    if (job->error != 0 && job->created)
+        ::unlink(job->path.c_str());
+    if (job->onComplete)
+        job->onComplete(job->error);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (job->error == 0)
+    {
+        counters.files++;
+        counters.bytes += job->data->size();
+    }
+    else
+    {
+        counters.failed++;
+    }
+    if (--unfinished == 0)
+        idle.notify_all();
+}
+
+void AsyncFileWriter::writeNow(Job &job)
+{
+    job.fd = ::open(job.path.c_str(), kOpenFlags, kOpenMode);
+    if (job.fd < 0)
+    {
+        job.error = errno;
+        return;
+    }
+    job.created = true;
+    const std::string &data = *job.data;
+    while (job.written < data.size())
+    {
+        ssize_t n = ::pwrite(job.fd, data.data() + job.written, data.size() - job.written,
+                             static_cast<off_t>(job.written));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            job.error = n < 0 ? errno : EIO;
+            break;
+        }
+        job.written += static_cast<size_t>(n);
+    }
+    if (job.error == 0 && config.sync && ::fdatasync(job.fd) != 0)
+        job.error = errno;
+    if (::close(job.fd) != 0 && job.error == 0)
+        job.error = errno;
+    job.fd = -1;
+}
+
+void AsyncFileWriter::threadLoop()
+{
+    Trace::nameThread("file writer");
+    while (true)
+    {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]
+                      { return stopping || !queued.empty(); });
+            if (queued.empty())
+                return;
+            job = std::move(queued.front());
+            queued.pop_front();
+            counters.batches++;
+        }
+        writeNow(*job);
+        finish(std::move(job));
+    }
+}
+
+#ifdef FAKEPRINTER_HAVE_IO_URING
+
+void AsyncFileWriter::ringLoop()
+{
+    Trace::nameThread("file writer");
+    // Jobs in the ring, and those whose file is open and whose write chain
+    // goes into the next submission.
+    size_t active = 0;
+    std::vector<Job *> opened;
+
+    auto userData = [](Job *job, RingOp op)
+    { return reinterpret_cast<uint64_t>(job) | op; };
+
+    // write -> (sync) -> close, linked so the kernel runs them in order and
+    // skips the rest once one fails or writes short.
+    auto prepareWrite = [&](Job *job)
+    {
+        const std::string &data = *job->data;
+        size_t left = std::min<size_t>(data.size() - job->written, 1u << 30);
+        io_uring_sqe *sqe = ring->prepare(IORING_OP_WRITE, job->fd, userData(job, OP_WRITE), IOSQE_IO_LINK);
+        sqe->addr = reinterpret_cast<uint64_t>(data.data() + job->written);
+        sqe->len = static_cast<uint32_t>(left);
+        sqe->off = job->written;
+        job->inFlight++;
+        if (config.sync)
+        {
+            sqe = ring->prepare(IORING_OP_FSYNC, job->fd, userData(job, OP_SYNC), IOSQE_IO_LINK);
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            job->inFlight++;
+        }
+        ring->prepare(IORING_OP_CLOSE, job->fd, userData(job, OP_CLOSE));
+        job->inFlight++;
+    };
+
+    auto onCompletion = [&](uint64_t data, int32_t result)
+    {
+        Job *job = reinterpret_cast<Job *>(data & ~uint64_t(7));
+        RingOp op = static_cast<RingOp>(data & 7);
+        job->inFlight--;
+        switch (op)
+        {
+        case OP_OPEN:
+            if (result < 0)
+            {
+                job->error = -result;
+            }
+            else
+            {
+                job->fd = result;
+                job->created = true;
+            }
+            break;
+        case OP_WRITE:
+            if (result > 0)
+                job->written += static_cast<size_t>(result);
+            else if (job->error == 0)
+                job->error = result < 0 ? -result : EIO;
+            break;
+        case OP_SYNC:
+            if (result < 0 && result != -ECANCELED && job->error == 0)
+                job->error = -result;
+            break;
+        case OP_CLOSE:
+            // Cancelled when an earlier link failed or wrote short; the file is still open.
+            if (result != -ECANCELED)
+            {
+                if (result < 0 && job->error == 0)
+                    job->error = -result;
+                job->fd = -1;
+            }
+            break;
+        }
+        if (job->inFlight > 0)
+            return;
+
+        if (op == OP_OPEN && job->error == 0)
+        {
+            opened.push_back(job);
+            return;
+        }
+        if (job->fd >= 0)
+        {
+            // A short write: send the rest. Anything else: give up on the file.
+            if (job->error == 0 && job->written < job->data->size())
+            {
+                opened.push_back(job);
+                return;
+            }
+            ::close(job->fd);
+            job->fd = -1;
+        }
+        active--;
+        finish(std::unique_ptr<Job>(job));
+    };
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            // Only sleep here when the ring has nothing in flight to wait for.
+            if (active == 0)
+            {
+                wake.wait(lock, [this]
+                          { return stopping || !queued.empty(); });
+                wake.wait_for(lock, kGatherDelay, [this]
+                              { return stopping || flushing > 0 || queued.size() >= config.maxInFlight; });
+            }
+            if (active == 0 && queued.empty())
+                return;
+            while (active < config.maxInFlight && !queued.empty())
+            {
+                Job *job = queued.front().release();
+                queued.pop_front();
+                active++;
+                io_uring_sqe *sqe = ring->prepare(IORING_OP_OPENAT, AT_FDCWD, userData(job, OP_OPEN));
+                sqe->addr = reinterpret_cast<uint64_t>(job->path.c_str());
+                sqe->len = kOpenMode;
+                sqe->open_flags = kOpenFlags;
+                job->inFlight++;
+            }
+            if (ring->toSubmit > 0 || !opened.empty())
+                counters.batches++;
+        }
+        for (Job *job : opened)
+            prepareWrite(job);
+        opened.clear();
+
+        if (!ring->submitAndWait())
+        {
+            // Cannot happen with a working ring; fail loudly rather than hang.
+            spdlog::critical("io_uring_enter failed: {}", std::strerror(errno));
+            std::abort();
+        }
+        ring->reap(onCompletion);
+    }
+}
+
+#else
+
+void AsyncFileWriter::ringLoop()
+{
+}
+
+#endif
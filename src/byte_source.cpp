@@ -0,0 +1,527 @@
+#include "byte_source.h"
+#include <curl/curl.h>
+#include <zlib.h>
+#ifdef FAKEPRINTER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Compressed input read from the source below a decompressor at a time.
+static constexpr size_t kCompressedChunk = 64 * 1024;
+// How long a follow wait sleeps between checks when no change is signalled.
+static constexpr int kFollowPollMs = 100;
+
+long ByteSource::read(char *buffer, size_t size)
+{
+    if (pending.empty())
+        return readSome(buffer, size);
+    size_t count = std::min(size, pending.size());
+    std::memcpy(buffer, pending.data(), count);
+    pending.erase(0, count);
+    return static_cast<long>(count);
+}
+
+Compression detectCompression(const char *data, size_t size)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    if (size >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b)
+        return Compression::GZIP;
+    if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xb5 && bytes[2] == 0x2f && bytes[3] == 0xfd)
+        return Compression::ZSTD;
+    return Compression::NONE;
+}
+
+bool isStreamLocation(const std::string &location)
+{
+    return location == "-" || location.rfind("http://", 0) == 0 || location.rfind("https://", 0) == 0 ||
+           location.rfind("ftp://", 0) == 0;
+}
+
+// Reads a file descriptor: stdin, a FIFO or a file. When following, the end
+// of the input is a pause: the source waits for the file to grow, woken by
+// inotify where it can watch the file.
+class FdSource : public ByteSource
+{
+public:
+    FdSource(int fd, bool ownsFd, const std::string &path, const ByteSourceOptions &options)
+        : fd(fd), ownsFd(ownsFd), options(options), lastData(Clock::now())
+    {
+        if (options.follow && !path.empty())
+        {
+            watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (watch >= 0 && inotify_add_watch(watch, path.c_str(), IN_MODIFY) < 0)
+            {
+                close(watch);
+                watch = -1;
+            }
+        }
+    }
+
+    ~FdSource() override
+    {
+        if (watch >= 0)
+            close(watch);
+        if (ownsFd)
+            close(fd);
+    }
+
+protected:
+    long readSome(char *buffer, size_t size) override
+    {
+        for (;;)
+        {
+            ssize_t got = ::read(fd, buffer, size);
+            if (got > 0)
+            {
+                lastData = Clock::now();
+                return static_cast<long>(got);
+            }
+            if (got < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                failure = std::strerror(errno);
+                return -1;
+            }
+            if (!options.follow || (options.stop && *options.stop))
+                return 0;
+            if (options.followIdleSeconds > 0 &&
+                Clock::now() - lastData >= std::chrono::seconds(options.followIdleSeconds))
+                return 0;
+
+            pollfd change{watch, POLLIN, 0};
+            if (poll(&change, watch >= 0 ? 1 : 0, kFollowPollMs) > 0)
+            {
+                // Only the wake-up matters, not the events.
+                alignas(inotify_event) char events[4096];
+                while (::read(watch, events, sizeof(events)) > 0)
+                {
+                }
+            }
+        }
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    int fd;
+    bool ownsFd;
+    ByteSourceOptions options;
+    int watch = -1;
+    Clock::time_point lastData;
+};
+
+// Inflates gzip data, including files made of several concatenated members.
+class GzipSource : public ByteSource
+{
+public:
+    explicit GzipSource(std::unique_ptr<ByteSource> compressed)
+        : compressed(std::move(compressed)), input(new char[kCompressedChunk])
+    {
+        // 16 + 15: a gzip wrapper around a window of up to 32 KiB.
+        ready = inflateInit2(&stream, 16 + 15) == Z_OK;
+    }
+
+    ~GzipSource() override
+    {
+        if (ready)
+            inflateEnd(&stream);
+    }
+
+protected:
+    long readSome(char *buffer, size_t size) override
+    {
+        if (!ready)
+        {
+            failure = "gzip: cannot set up the decompressor";
+            return -1;
+        }
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = static_cast<uInt>(std::min<size_t>(size, 1u << 30));
+        const uInt room = stream.avail_out;
+        for (;;)
+        {
+            if (stream.avail_in > 0)
+                inMember = true;
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result == Z_STREAM_END)
+            {
+                // Another member may follow.
+                inflateReset(&stream);
+                inMember = false;
+            }
+            else if (result != Z_OK && result != Z_BUF_ERROR)
+            {
+                failure = std::string("gzip: ") + (stream.msg ? stream.msg : "corrupt data");
+                return -1;
+            }
+            if (stream.avail_out < room)
+                return static_cast<long>(room - stream.avail_out);
+            if (stream.avail_in > 0)
+                continue;
+
+            long got = compressed->read(input.get(), kCompressedChunk);
+            if (got < 0)
+            {
+                failure = compressed->error();
+                return -1;
+            }
+            if (got == 0)
+            {
+                if (!inMember)
+                    return 0;
+                failure = "gzip: the data ends in the middle of a member";
+                return -1;
+            }
+            stream.next_in = reinterpret_cast<Bytef *>(input.get());
+            stream.avail_in = static_cast<uInt>(got);
+        }
+    }
+
+private:
+    std::unique_ptr<ByteSource> compressed;
+    std::unique_ptr<char[]> input;
+    z_stream stream{};
+    bool ready = false;
+    bool inMember = false;
+};
+
+#ifdef FAKEPRINTER_HAVE_ZSTD
+// Decompresses zstd frames, one after another.
+class ZstdSource : public ByteSource
+{
+public:
+    explicit ZstdSource(std::unique_ptr<ByteSource> compressed)
+        : compressed(std::move(compressed)), input(new char[kCompressedChunk]), context(ZSTD_createDCtx())
+    {
+    }
+
+    ~ZstdSource() override { ZSTD_freeDCtx(context); }
+
+protected:
+    long readSome(char *buffer, size_t size) override
+    {
+        if (!context)
+        {
+            failure = "zstd: cannot set up the decompressor";
+            return -1;
+        }
+        ZSTD_outBuffer out{buffer, size, 0};
+        for (;;)
+        {
+            size_t result = ZSTD_decompressStream(context, &out, &in);
+            if (ZSTD_isError(result))
+            {
+                failure = std::string("zstd: ") + ZSTD_getErrorName(result);
+                return -1;
+            }
+            // 0 once a frame is complete.
+            frameOpen = result != 0;
+            if (out.pos > 0)
+                return static_cast<long>(out.pos);
+            if (in.pos < in.size)
+                continue;
+
+            long got = compressed->read(input.get(), kCompressedChunk);
+            if (got < 0)
+            {
+                failure = compressed->error();
+                return -1;
+            }
+            if (got == 0)
+            {
+                if (!frameOpen)
+                    return 0;
+                failure = "zstd: the data ends in the middle of a frame";
+                return -1;
+            }
+            in = ZSTD_inBuffer{input.get(), static_cast<size_t>(got), 0};
+        }
+    }
+
+private:
+    std::unique_ptr<ByteSource> compressed;
+    std::unique_ptr<char[]> input;
+    ZSTD_DCtx *context;
+    ZSTD_inBuffer in{nullptr, 0, 0};
+    bool frameOpen = false;
+};
+#endif
+
+// Downloads a URL while it is being read. The transfer runs on the reading
+// thread: each read drives the curl multi handle until data has arrived. The
+// body goes into a fixed buffer; when the reader falls behind and it is full,
+// the transfer is paused rather than the buffer grown.
+class CurlSource : public ByteSource
+{
+public:
+    CurlSource(const std::string &url, const ByteSourceOptions &options)
+        : options(options), buffer(new char[kBufferSize])
+    {
+        errorText[0] = '\0';
+        multi = curl_multi_init();
+        easy = curl_easy_init();
+        if (!multi || !easy)
+            return;
+        curl_easy_setopt(easy, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(easy, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 30L);
+        curl_easy_setopt(easy, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+        curl_easy_setopt(easy, CURLOPT_LOW_SPEED_TIME, 30L);
+        // Lets the server compress the transfer; curl inflates it.
+        curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(easy, CURLOPT_ERRORBUFFER, errorText);
+        curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &CurlSource::onData);
+        curl_easy_setopt(easy, CURLOPT_WRITEDATA, this);
+        added = curl_multi_add_handle(multi, easy) == CURLM_OK;
+    }
+
+    ~CurlSource() override
+    {
+        if (added)
+            curl_multi_remove_handle(multi, easy);
+        if (easy)
+            curl_easy_cleanup(easy);
+        if (multi)
+            curl_multi_cleanup(multi);
+    }
+
+    bool isReady() const { return added; }
+
+protected:
+    long readSome(char *out, size_t size) override
+    {
+        while (begin == end)
+        {
+            if (finished)
+            {
+                if (result == CURLE_OK)
+                    return 0;
+                failure = errorText[0] ? errorText : curl_easy_strerror(result);
+                return -1;
+            }
+            if (options.stop && *options.stop)
+            {
+                failure = "interrupted";
+                return -1;
+            }
+            if (paused)
+            {
+                // Delivers the data held back when the buffer was full.
+                paused = false;
+                curl_easy_pause(easy, CURLPAUSE_CONT);
+            }
+            int running = 0;
+            curl_multi_perform(multi, &running);
+            int left = 0;
+            while (CURLMsg *message = curl_multi_info_read(multi, &left))
+            {
+                if (message->msg == CURLMSG_DONE)
+                {
+                    finished = true;
+                    result = message->data.result;
+                }
+            }
+            if (begin == end && !finished && !paused)
+                curl_multi_poll(multi, nullptr, 0, kFollowPollMs, nullptr);
+        }
+        size_t count = std::min(size, end - begin);
+        std::memcpy(out, buffer.get() + begin, count);
+        begin += count;
+        if (begin == end)
+            begin = end = 0;
+        return static_cast<long>(count);
+    }
+
+private:
+    static constexpr size_t kBufferSize = 256 * 1024;
+
+    ByteSourceOptions options;
+    CURLM *multi = nullptr;
+    CURL *easy = nullptr;
+    bool added = false;
+    std::unique_ptr<char[]> buffer;
+    size_t begin = 0;
+    size_t end = 0;
+    bool paused = false;
+    bool finished = false;
+    CURLcode result = CURLE_OK;
+    char errorText[CURL_ERROR_SIZE];
+
+    static size_t onData(char *data, size_t size, size_t count, void *userData)
+    {
+        CurlSource &self = *static_cast<CurlSource *>(userData);
+        size_t bytes = size * count;
+        if (self.end + bytes > kBufferSize && self.begin > 0)
+        {
+            std::memmove(self.buffer.get(), self.buffer.get() + self.begin, self.end - self.begin);
+            self.end -= self.begin;
+            self.begin = 0;
+        }
+        if (self.end + bytes > kBufferSize)
+        {
+            self.paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+        std::memcpy(self.buffer.get() + self.end, data, bytes);
+        self.end += bytes;
+        return bytes;
+    }
+};
+
+// Passes the input through while saving it to <path>.part, which is renamed
+// to 'path' at the end of the input. An input abandoned early leaves nothing.
+class CopySource : public ByteSource
+{
+public:
+    CopySource(std::unique_ptr<ByteSource> input, const std::string &path)
+        : input(std::move(input)), path(path), partPath(path + ".part")
+    {
+        fd = ::open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+
+    ~CopySource() override
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(partPath.c_str());
+        }
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+protected:
+    long readSome(char *buffer, size_t size) override
+    {
+        long got = input->read(buffer, size);
+        if (got < 0)
+        {
+            failure = input->error();
+            return -1;
+        }
+        if (fd < 0)
+            return got;
+        if (got == 0)
+        {
+            bool saved = close(fd) == 0 && std::rename(partPath.c_str(), path.c_str()) == 0;
+            fd = -1;
+            if (!saved)
+            {
+                failure = "cannot save " + path + ": " + std::strerror(errno);
+                unlink(partPath.c_str());
+                return -1;
+            }
+            return 0;
+        }
+        const char *next = buffer;
+        size_t left = static_cast<size_t>(got);
+        while (left > 0)
+        {
+            ssize_t written = ::write(fd, next, left);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+            {
+                failure = "cannot save " + path + ": " + std::strerror(errno);
+                return -1;
+            }
+            next += written;
+            left -= static_cast<size_t>(written);
+        }
+        return got;
+    }
+
+private:
+    std::unique_ptr<ByteSource> input;
+    std::string path;
+    std::string partPath;
+    int fd = -1;
+};
+
+std::unique_ptr<ByteSource> openByteSource(const std::string &location, const ByteSourceOptions &options,
+                                           std::string &error)
+{
+    std::unique_ptr<ByteSource> source;
+    if (location == "-")
+    {
+        source = std::make_unique<FdSource>(STDIN_FILENO, false, std::string(), options);
+    }
+    else if (isStreamLocation(location))
+    {
+        auto download = std::make_unique<CurlSource>(location, options);
+        if (!download->isReady())
+        {
+            error = "cannot set up a download";
+            return nullptr;
+        }
+        source = std::move(download);
+    }
+    else
+    {
+        int fd = ::open(location.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            error = std::strerror(errno);
+            return nullptr;
+        }
+        source = std::make_unique<FdSource>(fd, true, location, options);
+    }
+
+    // The first bytes tell whether the input is compressed; they are put
+    // back for whichever reader comes next.
+    char magic[4];
+    size_t peeked = 0;
+    while (peeked < sizeof(magic))
+    {
+        long got = source->read(magic + peeked, sizeof(magic) - peeked);
+        if (got < 0)
+        {
+            error = source->error();
+            return nullptr;
+        }
+        if (got == 0)
+            break;
+        peeked += static_cast<size_t>(got);
+    }
+    source->unread(std::string_view(magic, peeked));
+
+    switch (detectCompression(magic, peeked))
+    {
+    case Compression::GZIP:
+        source = std::make_unique<GzipSource>(std::move(source));
+        break;
+    case Compression::ZSTD:
+#ifdef FAKEPRINTER_HAVE_ZSTD
+        source = std::make_unique<ZstdSource>(std::move(source));
+        break;
+#else
+        error = "zstd input needs a build with libzstd";
+        return nullptr;
+#endif
+    case Compression::NONE:
+        break;
+    }
+
+    if (!options.copyTo.empty())
+    {
+        auto copy = std::make_unique<CopySource>(std::move(source), options.copyTo);
+        if (!copy->isOpen())
+        {
+            error = "cannot create " + options.copyTo + ".part: " + std::strerror(errno);
+            return nullptr;
+        }
+        source = std::move(copy);
+    }
+    return source;
+}
@@ -0,0 +1,175 @@
+#include "csv_scanner.h"
+#include "csv_scanner_impl.h"
+#include <cstdlib>
+#include <string>
+#include "spdlog/spdlog.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Byte-at-a-time fallback for CPUs without a vector unit we support.
+struct ScalarMasker
+{
+    static BlockMasks classify(const char *p)
+    {
+        BlockMasks m{0, 0, 0};
+        for (size_t i = 0; i < kScanBlock; ++i)
+        {
+            uint64_t bit = 1ULL << i;
+            if (p[i] == '"')
+                m.quotes |= bit;
+            else if (p[i] == ',')
+                m.commas |= bit;
+            else if (p[i] == '\n')
+                m.newlines |= bit;
+        }
+        return m;
+    }
+};
+
+#if defined(__SSE2__)
+struct Sse2Masker
+{
+    static BlockMasks classify(const char *p)
+    {
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i comma = _mm_set1_epi8(',');
+        const __m128i newline = _mm_set1_epi8('\n');
+        BlockMasks m{0, 0, 0};
+        for (size_t i = 0; i < kScanBlock; i += 16)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            m.quotes |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))) << i;
+            m.commas |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, comma)))) << i;
+            m.newlines |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)))) << i;
+        }
+        return m;
+    }
+};
+#endif
+
+#if defined(FAKEPRINTER_HAVE_AVX2)
+// Defined in csv_scanner_avx2.cpp, which is the only file built with -mavx2.
+const char *findRecordEndAvx2(const char *begin, const char *end, bool &inQuotes);
+void splitFieldsAvx2(const char *begin, const char *end, std::vector<CSVFieldSpan> &fields);
+size_t countQuotesAvx2(const char *begin, const char *end);
+#endif
+
+static bool isAvailable(CSVScanner::Kind kind)
+{
+    switch (kind)
+    {
+    case CSVScanner::SCALAR:
+        return true;
+    case CSVScanner::SSE2:
+#if defined(__SSE2__)
+        return true;
+#else
+        return false;
+#endif
+    case CSVScanner::AVX2:
+#if defined(FAKEPRINTER_HAVE_AVX2)
+        return __builtin_cpu_supports("avx2");
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+static CSVScanner::Kind detectKind()
+{
+    if (const char *forced = std::getenv("FAKEPRINTER_CSV_SCANNER"))
+    {
+        std::string value = forced;
+        for (CSVScanner::Kind kind : {CSVScanner::SCALAR, CSVScanner::SSE2, CSVScanner::AVX2})
+        {
+            if (value == CSVScanner::name(kind))
+            {
+                if (isAvailable(kind))
+                    return kind;
+                spdlog::warn("CSV scanner '{}' is not supported on this CPU; detecting instead.", value);
+            }
+        }
+    }
+    if (isAvailable(CSVScanner::AVX2))
+        return CSVScanner::AVX2;
+    if (isAvailable(CSVScanner::SSE2))
+        return CSVScanner::SSE2;
+    return CSVScanner::SCALAR;
+}
+
+CSVScanner::Kind CSVScanner::active()
+{
+    static const Kind kind = detectKind();
+    return kind;
+}
+
+const char *CSVScanner::name(Kind kind)
+{
+    switch (kind)
+    {
+    case SCALAR:
+        return "scalar";
+    case SSE2:
+        return "sse2";
+    case AVX2:
+        return "avx2";
+    }
+    return "unknown";
+}
+
+const char *CSVScanner::findRecordEnd(const char *begin, const char *end, bool &inQuotes)
+{
+    switch (active())
+    {
+#if defined(FAKEPRINTER_HAVE_AVX2)
+    case AVX2:
+        return findRecordEndAvx2(begin, end, inQuotes);
+#endif
+#if defined(__SSE2__)
+    case SSE2:
+        return findRecordEndImpl<Sse2Masker>(begin, end, inQuotes);
+#endif
+    default:
+        return findRecordEndImpl<ScalarMasker>(begin, end, inQuotes);
+    }
+}
+
+void CSVScanner::splitFields(const char *begin, const char *end, std::vector<CSVFieldSpan> &fields)
+{
+    switch (active())
+    {
+#if defined(FAKEPRINTER_HAVE_AVX2)
+    case AVX2:
+        splitFieldsAvx2(begin, end, fields);
+        return;
+#endif
+#if defined(__SSE2__)
+    case SSE2:
+        splitFieldsImpl<Sse2Masker>(begin, end, fields);
+        return;
+#endif
+    default:
+        splitFieldsImpl<ScalarMasker>(begin, end, fields);
+        return;
+    }
+}
+
+size_t CSVScanner::countQuotes(const char *begin, const char *end)
+{
+    switch (active())
+    {
+#if defined(FAKEPRINTER_HAVE_AVX2)
+    case AVX2:
+        return countQuotesAvx2(begin, end);
+#endif
+#if defined(__SSE2__)
+    case SSE2:
+        return countQuotesImpl<Sse2Masker>(begin, end);
+#endif
+    default:
+        return countQuotesImpl<ScalarMasker>(begin, end);
+    }
+}
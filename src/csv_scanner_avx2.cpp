@@ -0,0 +1,40 @@
+// AVX2 scanner variant. This translation unit is compiled with -mavx2 and is
+// only entered after CSVScanner has confirmed CPU support at runtime.
+
+#include "csv_scanner.h"
+#include "csv_scanner_impl.h"
+#include <immintrin.h>
+
+struct Avx2Masker
+{
+    static BlockMasks classify(const char *p)
+    {
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i comma = _mm256_set1_epi8(',');
+        const __m256i newline = _mm256_set1_epi8('\n');
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+        auto mask = [](__m256i a, __m256i b, __m256i needle)
+        {
+            uint64_t low = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, needle)));
+            uint64_t high = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, needle)));
+            return low | (high << 32);
+        };
+        return BlockMasks{mask(lo, hi, quote), mask(lo, hi, comma), mask(lo, hi, newline)};
+    }
+};
+
+const char *findRecordEndAvx2(const char *begin, const char *end, bool &inQuotes)
+{
+    return findRecordEndImpl<Avx2Masker>(begin, end, inQuotes);
+}
+
+void splitFieldsAvx2(const char *begin, const char *end, std::vector<CSVFieldSpan> &fields)
+{
+    splitFieldsImpl<Avx2Masker>(begin, end, fields);
+}
+
+size_t countQuotesAvx2(const char *begin, const char *end)
+{
+    return countQuotesImpl<Avx2Masker>(begin, end);
+}
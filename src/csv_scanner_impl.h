@@ -0,0 +1,110 @@
+#ifndef CSV_SCANNER_IMPL_H
+#define CSV_SCANNER_IMPL_H
+
+// Block loops shared by the per-ISA scanner translation units. Everything here
+// has internal linkage so instantiations compiled with different target flags
+// are never merged by the linker.
+
+#include "csv_scanner.h"
+#include <cstdint>
+#include <cstring>
+
+static constexpr size_t kScanBlock = 64;
+
+struct BlockMasks
+{
+    uint64_t quotes;
+    uint64_t commas;
+    uint64_t newlines;
+};
+
+// Bit i of the result is the XOR of bits 0..i of x, i.e. the quote parity
+// up to and including byte i.
+static inline uint64_t prefixXor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Classifies one block. Short tails are copied into a zero-padded block; zero
+// bytes are never structural, so padding does not disturb the quote state.
+template <typename Masker>
+static inline BlockMasks loadBlock(const char *p, size_t avail)
+{
+    if (avail >= kScanBlock)
+    {
+        return Masker::classify(p);
+    }
+    alignas(kScanBlock) char tail[kScanBlock] = {};
+    std::memcpy(tail, p, avail);
+    return Masker::classify(tail);
+}
+
+template <typename Masker>
+static inline const char *findRecordEndImpl(const char *begin, const char *end, bool &inQuotes)
+{
+    const size_t size = static_cast<size_t>(end - begin);
+    uint64_t carry = inQuotes ? ~0ULL : 0;
+    for (size_t base = 0; base < size; base += kScanBlock)
+    {
+        BlockMasks m = loadBlock<Masker>(begin + base, size - base);
+        uint64_t inside = prefixXor(m.quotes) ^ carry;
+        uint64_t structural = m.newlines & ~inside;
+        if (structural)
+        {
+            inQuotes = false;
+            return begin + base + __builtin_ctzll(structural);
+        }
+        carry = (inside >> 63) ? ~0ULL : 0;
+    }
+    inQuotes = carry != 0;
+    return end;
+}
+
+template <typename Masker>
+static inline void splitFieldsImpl(const char *begin, const char *end, std::vector<CSVFieldSpan> &fields)
+{
+    fields.clear();
+    const size_t size = static_cast<size_t>(end - begin);
+    uint64_t carry = 0;
+    size_t quotesSeen = 0;
+    size_t fieldStart = 0;
+    size_t fieldQuotes = 0;
+    for (size_t base = 0; base < size; base += kScanBlock)
+    {
+        BlockMasks m = loadBlock<Masker>(begin + base, size - base);
+        uint64_t inside = prefixXor(m.quotes) ^ carry;
+        uint64_t separators = m.commas & ~inside;
+        while (separators)
+        {
+            unsigned bit = static_cast<unsigned>(__builtin_ctzll(separators));
+            size_t quotesBefore = quotesSeen + static_cast<size_t>(__builtin_popcountll(m.quotes & ((1ULL << bit) - 1)));
+            fields.push_back({fieldStart, base + bit, quotesBefore - fieldQuotes});
+            fieldStart = base + bit + 1;
+            fieldQuotes = quotesBefore;
+            separators &= separators - 1;
+        }
+        quotesSeen += static_cast<size_t>(__builtin_popcountll(m.quotes));
+        carry = (inside >> 63) ? ~0ULL : 0;
+    }
+    fields.push_back({fieldStart, size, quotesSeen - fieldQuotes});
+}
+
+template <typename Masker>
+static inline size_t countQuotesImpl(const char *begin, const char *end)
+{
+    const size_t size = static_cast<size_t>(end - begin);
+    size_t count = 0;
+    for (size_t base = 0; base < size; base += kScanBlock)
+    {
+        count += static_cast<size_t>(__builtin_popcountll(loadBlock<Masker>(begin + base, size - base).quotes));
+    }
+    return count;
+}
+
+#endif // CSV_SCANNER_IMPL_H
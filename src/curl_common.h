@@ -0,0 +1,361 @@
+#ifndef CURL_COMMON_H
+#define CURL_COMMON_H
+
+// libcurl helpers shared by DownloadService and DownloadEngine.
+
+#include <curl/curl.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Where the body of a download goes: a .part file, written with pwrite, or a
+// buffer the caller supplied. Both are written at explicit offsets, so the
+// ranges of a split download land in place in whatever order they arrive.
+struct DownloadSink
+{
+    int fd = -1;
+    std::string *memory = nullptr;
+};
+
+// Writes 'size' bytes at 'offset', growing the buffer if needed.
+static inline bool sinkWrite(const DownloadSink &sink, const char *data, size_t size, uint64_t offset)
+{
+    if (sink.memory)
+    {
+        std::string &memory = *sink.memory;
+        if (offset == memory.size())
+        {
+            memory.append(data, size);
+            return true;
+        }
+        if (offset + size > memory.size())
+            memory.resize(offset + size);
+        std::memcpy(memory.data() + offset, data, size);
+        return true;
+    }
+    while (size > 0)
+    {
+        ssize_t n = ::pwrite(sink.fd, data, size, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static inline bool sinkTruncate(const DownloadSink &sink, uint64_t size)
+{
+    if (sink.memory)
+    {
+        sink.memory->resize(std::min<uint64_t>(size, sink.memory->size()));
+        return true;
+    }
+    return ::ftruncate(sink.fd, static_cast<off_t>(size)) == 0;
+}
+
+// Sets aside room for 'length' bytes at 'offset' ahead of the writes, so the
+// file is laid out in few extents and the buffer is not reallocated as it
+// grows. The file size is left alone: it still tells a later download how
+// much actually arrived. Failing is harmless; the writes allocate anyway.
+static inline void sinkReserve(const DownloadSink &sink, uint64_t offset, uint64_t length)
+{
+    if (sink.memory)
+        sink.memory->reserve(offset + length);
+    else
+        ::fallocate(sink.fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(length));
+}
+
+// The file a download writes before it is renamed onto its destination.
+// "<destination>.part" is continued by later downloads, in this run or the
+// next, so it is held under an exclusive flock() while a download writes it;
+// a download that finds it taken writes a private "<destination>.part.XXXXXX"
+// instead. Bytes kept in a .part are only continued together with the
+// validator of the response they came from, saved in
+// "<destination>.part.validator" and sent as If-Range, so a changed object
+// is fetched whole rather than spliced onto the old bytes.
+struct PartFile
+{
+    std::string path;
+    int fd = -1;
+    // False for a private file, which is never continued.
+    bool resumable = false;
+    // Bytes already in the file, and the strong ETag or Last-Modified date
+    // they were sent with.
+    uint64_t size = 0;
+    std::string validator;
+};
+
+static inline std::string partValidatorPath(const PartFile &file)
+{
+    return file.path + ".validator";
+}
+
+// The validator to continue a body with: its strong ETag, or else its
+// Last-Modified date. Weak ETags cannot be used with If-Range.
+static inline std::string pickValidator(const std::string &etag, const std::string &lastModified)
+{
+    if (!etag.empty() && etag.compare(0, 2, "W/") != 0)
+        return etag;
+    return lastModified;
+}
+
+// Opens the .part file for a download to 'destinationPath'. With 'fresh',
+// or when nothing says where the bytes in it came from, it starts empty.
+static inline bool openPartFile(const std::string &destinationPath, bool fresh, PartFile &file)
+{
+    std::string path = destinationPath + ".part";
+    while (true)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        if (::flock(fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            ::close(fd);
+            break;
+        }
+        // The download that held it may have renamed it into place before
+        // letting go; then this is its destination, not a .part file.
+        struct stat opened, current;
+        if (::fstat(fd, &opened) == 0 && ::stat(path.c_str(), &current) == 0 && opened.st_dev == current.st_dev &&
+            opened.st_ino == current.st_ino)
+        {
+            file.path = path;
+            file.fd = fd;
+            file.resumable = true;
+            file.size = static_cast<uint64_t>(opened.st_size);
+            break;
+        }
+        ::close(fd);
+    }
+    if (file.fd < 0)
+    {
+        std::string privatePath = path + ".XXXXXX";
+        int fd = ::mkostemp(privatePath.data(), O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        file.path = privatePath;
+        file.fd = fd;
+        file.resumable = false;
+        file.size = 0;
+        return true;
+    }
+
+    file.validator.clear();
+    if (file.size > 0 && !fresh)
+    {
+        if (std::FILE *saved = std::fopen(partValidatorPath(file).c_str(), "r"))
+        {
+            char line[512];
+            if (std::fgets(line, sizeof(line), saved))
+                file.validator.assign(line, std::strcspn(line, "\r\n"));
+            std::fclose(saved);
+        }
+    }
+    if (file.size > 0 && file.validator.empty())
+    {
+        if (::ftruncate(file.fd, 0) != 0)
+        {
+            ::close(file.fd);
+            file.fd = -1;
+            return false;
+        }
+        file.size = 0;
+    }
+    if (file.size == 0)
+        ::unlink(partValidatorPath(file).c_str());
+    return true;
+}
+
+// Records the validator of the response now being written into the file.
+// Called before the body arrives, so a .part left by a crash is covered too.
+static inline void savePartValidator(PartFile &file, const std::string &validator)
+{
+    if (!file.resumable || validator == file.validator)
+        return;
+    file.validator = validator;
+    std::string path = partValidatorPath(file);
+    if (validator.empty())
+    {
+        ::unlink(path.c_str());
+        return;
+    }
+    if (std::FILE *saved = std::fopen(path.c_str(), "w"))
+    {
+        std::fprintf(saved, "%s\n", validator.c_str());
+        std::fclose(saved);
+    }
+}
+
+// Renames a complete file onto 'destinationPath' and closes it. The rename
+// happens while the lock is held, so no other download can take the file
+// for its .part in between.
+static inline bool publishPartFile(PartFile &file, const std::string &destinationPath, std::string &error)
+{
+    bool ok = std::rename(file.path.c_str(), destinationPath.c_str()) == 0;
+    if (!ok)
+        error = "Failed to move " + file.path + " into place: " + std::strerror(errno);
+    else if (file.resumable)
+        ::unlink(partValidatorPath(file).c_str());
+    if (::close(file.fd) != 0 && ok)
+    {
+        error = "Failed to close " + destinationPath + ": " + std::strerror(errno);
+        ok = false;
+    }
+    file.fd = -1;
+    if (!ok && !file.resumable)
+        ::unlink(file.path.c_str());
+    return ok;
+}
+
+// Closes the file of a download that did not complete. With 'keep', a
+// resumable file stays for the next download to the same destination.
+static inline void abandonPartFile(PartFile &file, bool keep)
+{
+    if (!keep || !file.resumable)
+    {
+        ::unlink(file.path.c_str());
+        if (file.resumable)
+            ::unlink(partValidatorPath(file).c_str());
+    }
+    ::close(file.fd);
+    file.fd = -1;
+}
+
+// Receives one response body into the sink shared by the transfers of a
+// download. A 206 answer is written from the start of the range that was
+// asked for; a 200 answer is the whole body, which a transfer that owns the
+// sink writes from offset 0 and a segment of a split download rejects. The
+// body of a redirect or error answer is dropped so it never lands in the sink.
+struct PartWriter
+{
+    DownloadSink sink;
+    CURL *curl = nullptr;
+    // First byte requested.
+    uint64_t rangeStart = 0;
+    // False for the segments of a split download, which must not truncate.
+    bool ownsSink = true;
+
+    bool started = false;
+    long status = 0;
+    // Next offset in the sink, and body bytes written by this response.
+    uint64_t position = 0;
+    uint64_t received = 0;
+};
+
+static inline size_t writePart(void *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    PartWriter *part = static_cast<PartWriter *>(userdata);
+    size_t count = size * nmemb;
+    if (!part->started)
+    {
+        curl_easy_getinfo(part->curl, CURLINFO_RESPONSE_CODE, &part->status);
+        part->started = true;
+        if (part->status >= 300)
+            return count;
+        if (part->status == 206)
+            part->position = part->rangeStart;
+        else if (!part->ownsSink)
+            return 0; // Aborts the transfer.
+        else
+            part->position = 0;
+        if (part->ownsSink)
+        {
+            // Drops whatever an earlier response left past this one's start.
+            if (!sinkTruncate(part->sink, part->position))
+                return 0;
+            curl_off_t length = -1;
+            curl_easy_getinfo(part->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+            if (length > 0)
+                sinkReserve(part->sink, part->position, static_cast<uint64_t>(length));
+        }
+    }
+    if (part->status >= 300)
+        return count;
+    if (!sinkWrite(part->sink, static_cast<const char *>(ptr), count, part->position))
+        return 0;
+    part->position += count;
+    part->received += count;
+    return count;
+}
+
+// True for failures worth another attempt: broken or refused connections,
+// stalls, and responses asking the client to come back later.
+static inline bool isTransient(CURLcode code, long httpStatus)
+{
+    switch (code)
+    {
+    case CURLE_OK:
+        return httpStatus == 408 || httpStatus == 429 || httpStatus / 100 == 5;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Reads the total size from a "Content-Range: bytes first-last/total" value.
+static inline bool parseContentRangeTotal(std::string_view value, uint64_t &total)
+{
+    size_t slash = value.rfind('/');
+    if (value.compare(0, 6, "bytes ") != 0 || slash == std::string_view::npos || slash + 1 == value.size())
+        return false;
+    uint64_t parsed = 0;
+    for (char c : value.substr(slash + 1))
+    {
+        if (c < '0' || c > '9')
+            return false;
+        parsed = parsed * 10 + static_cast<uint64_t>(c - '0');
+    }
+    total = parsed;
+    return true;
+}
+
+// Helper function to trim whitespace from a string.
+static inline std::string trim(const std::string &s)
+{
+    auto start = s.begin();
+    while (start != s.end() && std::isspace(static_cast<unsigned char>(*start)))
+        start++;
+    auto end = s.end();
+    while (end != start && std::isspace(static_cast<unsigned char>(*(end - 1))))
+        end--;
+    return std::string(start, end);
+}
+
+// Returns true and sets 'value' if 'line' is the header 'name' (lower case).
+static inline bool headerValue(std::string_view line, std::string_view name, std::string &value)
+{
+    if (line.size() <= name.size() || line[name.size()] != ':')
+        return false;
+    for (size_t i = 0; i < name.size(); ++i)
+    {
+        if (std::tolower(static_cast<unsigned char>(line[i])) != name[i])
+            return false;
+    }
+    value = trim(std::string(line.substr(name.size() + 1)));
+    return true;
+}
+
+#endif // CURL_COMMON_H
@@ -0,0 +1,648 @@
+#include "download_engine.h"
+#include "curl_common.h"
+#include "trace.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "spdlog/spdlog.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Finished easy handles kept for reuse by later transfers.
+static constexpr size_t kMaxSpareHandles = 64;
+
+// rangeEnd of a transfer that asks for the rest of the body.
+static constexpr uint64_t kToEnd = UINT64_MAX;
+
+// A submitted download: its .part file or buffer and what its transfers found out.
+struct EngineDownload
+{
+    DownloadEngine::Completion onComplete;
+    DownloadRequest request;
+    std::string url;
+    PartFile part;
+    DownloadSink sink;
+    // Transfers running or waiting to be retried.
+    unsigned transfers = 0;
+    // Fetched as several byte ranges; the sink may have holes.
+    bool split = false;
+    // Validator of the bytes in the sink, sent as If-Range when continuing them.
+    std::string ifRange;
+    // Status and validators come from the first transfer; bytes add up.
+    DownloadResult result;
+    bool failed = false;
+};
+
+// One request working on a download: the whole body or one range of it.
+struct EngineTransfer
+{
+    std::shared_ptr<EngineDownload> download;
+    CURL *curl = nullptr;
+    curl_slist *headers = nullptr;
+    PartWriter part;
+    // Last byte (inclusive) asked for.
+    uint64_t rangeEnd = kToEnd;
+    // The download's first request. A probe asks for the first segment only
+    // and learns the size, so the rest can be split.
+    bool first = false;
+    bool probe = false;
+    unsigned attempt = 1;
+    Clock::time_point retryAt;
+    // Headers of the final response.
+    bool headersDone = false;
+    std::string etag;
+    std::string lastModified;
+    std::string contentRange;
+    // When this attempt was handed to curl, on the trace clock.
+    uint64_t traceStart = 0;
+};
+
+// Keeps the headers of the last response; earlier ones belong to redirects.
+static size_t captureHeader(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    EngineTransfer *transfer = static_cast<EngineTransfer *>(userdata);
+    std::string_view line(buffer, size * nitems);
+    if (line.compare(0, 5, "HTTP/") == 0)
+    {
+        transfer->etag.clear();
+        transfer->lastModified.clear();
+        transfer->contentRange.clear();
+    }
+    else if (line == "\r\n" || line == "\n")
+    {
+        long status = 0;
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &status);
+        transfer->headersDone = status / 100 == 2;
+        // The body that follows is what a later download of the .part continues.
+        EngineDownload &download = *transfer->download;
+        if (transfer->headersDone && transfer->part.ownsSink && !download.sink.memory && !download.split &&
+            download.request.keepPartial)
+            savePartValidator(download.part, pickValidator(transfer->etag, transfer->lastModified));
+    }
+    else if (!headerValue(line, "etag", transfer->etag) && !headerValue(line, "last-modified", transfer->lastModified))
+    {
+        headerValue(line, "content-range", transfer->contentRange);
+    }
+    return size * nitems;
+}
+
+DownloadEngine::DownloadEngine(const DownloadEngineConfig &config, DownloadService *service)
+    : config(config),
+      ownedService(service ? nullptr : std::make_unique<DownloadService>()),
+      service(service ? service : ownedService.get()),
+      multi(curl_multi_init())
+{
+    if (!multi)
+    {
+        spdlog::error("Failed to initialize libcurl multi handle.");
+        return;
+    }
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(config.maxInFlight));
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(config.maxPerHost));
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    worker = std::thread(&DownloadEngine::loop, this);
+}
+
+DownloadEngine::~DownloadEngine()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        cancelRequested = true;
+    }
+    if (!multi)
+        return;
+    curl_multi_wakeup(multi);
+    worker.join();
+    curl_multi_cleanup(multi);
+}
+
+void DownloadEngine::submit(DownloadRequest request, Completion onComplete)
+{
+    if (!multi)
+    {
+        DownloadResult failed;
+        failed.error = "Failed to initialize libcurl.";
+        if (onComplete)
+            onComplete(failed);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.push_back(Job{std::move(request), std::move(onComplete)});
+        unfinished++;
+    }
+    curl_multi_wakeup(multi);
+}
+
+void DownloadEngine::waitAll()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]()
+              { return unfinished == 0; });
+}
+
+void DownloadEngine::cancelAll()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelRequested = true;
+    }
+    if (multi)
+        curl_multi_wakeup(multi);
+}
+
+size_t DownloadEngine::outstanding() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return unfinished;
+}
+
+void DownloadEngine::complete(Job &job, const DownloadResult &result)
+{
+    if (job.onComplete)
+        job.onComplete(result);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--unfinished == 0)
+        idle.notify_all();
+}
+
+// Sets up the request for the transfer's range and registers it with the multi handle.
+static bool startTransfer(CURLM *multi, EngineTransfer &transfer, std::string &error)
+{
+    CURL *curl = transfer.curl;
+    const EngineDownload &download = *transfer.download;
+    PartWriter &part = transfer.part;
+    part.curl = curl;
+    part.started = false;
+    part.status = 0;
+    part.received = 0;
+    transfer.headersDone = false;
+    transfer.traceStart = Trace::enabled() ? Trace::now() : 0;
+
+    curl_easy_setopt(curl, CURLOPT_URL, download.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writePart);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &part);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, captureHeader);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &transfer);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &transfer);
+    if (part.rangeStart > 0 || transfer.rangeEnd != kToEnd)
+    {
+        std::string range = std::to_string(part.rangeStart) + "-";
+        if (transfer.rangeEnd != kToEnd)
+            range += std::to_string(transfer.rangeEnd);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range.c_str());
+    }
+    // Validators only make sense while nothing of the body is kept.
+    if (transfer.first && part.rangeStart == 0)
+    {
+        if (!download.request.etag.empty())
+            transfer.headers = curl_slist_append(transfer.headers, ("If-None-Match: " + download.request.etag).c_str());
+        if (!download.request.lastModified.empty())
+            transfer.headers = curl_slist_append(transfer.headers, ("If-Modified-Since: " + download.request.lastModified).c_str());
+    }
+    else if (!download.ifRange.empty())
+    {
+        transfer.headers = curl_slist_append(transfer.headers, ("If-Range: " + download.ifRange).c_str());
+    }
+    if (transfer.headers)
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer.headers);
+    if (curl_multi_add_handle(multi, curl) != CURLM_OK)
+    {
+        error = "Failed to start transfer.";
+        return false;
+    }
+    return true;
+}
+
+void DownloadEngine::loop()
+{
+    Trace::nameThread("download engine");
+    CURLM *curlMulti = static_cast<CURLM *>(multi);
+    const DownloadPolicy &policy = service->policy();
+    std::vector<std::unique_ptr<EngineTransfer>> running;
+    std::vector<std::unique_ptr<EngineTransfer>> waiting;
+    std::vector<CURL *> spare;
+    size_t activeDownloads = 0;
+
+    auto finishDownload = [&](EngineDownload &download)
+    {
+        activeDownloads--;
+        DownloadResult &result = download.result;
+        bool ok = !download.failed && !result.cancelled;
+        if (!download.sink.memory)
+        {
+            struct stat st;
+            bool empty = ::fstat(download.sink.fd, &st) == 0 && st.st_size == 0;
+            if (ok)
+            {
+                ok = publishPartFile(download.part, download.request.destinationPath, result.error);
+                if (!ok)
+                    spdlog::error("{}", result.error);
+            }
+            else
+            {
+                // A contiguous .part file is continued by the next request for the same destination.
+                abandonPartFile(download.part, !download.split && !empty && download.request.keepPartial);
+            }
+        }
+        result.success = ok;
+        if (ok)
+            result.error.clear();
+        Job job{std::move(download.request), std::move(download.onComplete)};
+        complete(job, result);
+    };
+
+    auto recycleHandle = [&](EngineTransfer &transfer)
+    {
+        if (transfer.curl)
+        {
+            if (spare.size() < kMaxSpareHandles)
+                spare.push_back(transfer.curl);
+            else
+                curl_easy_cleanup(transfer.curl);
+            transfer.curl = nullptr;
+        }
+        curl_slist_free_all(transfer.headers);
+        transfer.headers = nullptr;
+    };
+
+    // Returns the transfer's handle and closes the download after its last transfer.
+    auto releaseTransfer = [&](std::unique_ptr<EngineTransfer> transfer)
+    {
+        recycleHandle(*transfer);
+        std::shared_ptr<EngineDownload> download = std::move(transfer->download);
+        if (--download->transfers == 0)
+            finishDownload(*download);
+    };
+
+    // Stops the other transfers of a download that cannot succeed any more.
+    auto abandonDownload = [&](const EngineDownload &download)
+    {
+        for (auto *list : {&running, &waiting})
+        {
+            for (auto it = list->begin(); it != list->end();)
+            {
+                if ((*it)->download.get() != &download)
+                {
+                    ++it;
+                    continue;
+                }
+                std::unique_ptr<EngineTransfer> transfer = std::move(*it);
+                it = list->erase(it);
+                if (list == &running)
+                    curl_multi_remove_handle(curlMulti, transfer->curl);
+                releaseTransfer(std::move(transfer));
+            }
+        }
+    };
+
+    auto fail = [&](std::unique_ptr<EngineTransfer> transfer, const std::string &error)
+    {
+        EngineDownload &download = *transfer->download;
+        spdlog::error("Download error: {}", error);
+        if (!download.failed)
+        {
+            download.failed = true;
+            download.result.error = error;
+        }
+        // This transfer still holds the download open while the others go.
+        abandonDownload(download);
+        releaseTransfer(std::move(transfer));
+    };
+
+    // Transfers that could not be started. They are failed between passes
+    // over 'running', since failing one removes its siblings from the lists.
+    std::vector<std::pair<std::unique_ptr<EngineTransfer>, std::string>> broken;
+    auto failBroken = [&]()
+    {
+        std::vector<std::pair<std::unique_ptr<EngineTransfer>, std::string>> failing = std::move(broken);
+        broken.clear();
+        for (auto &entry : failing)
+            fail(std::move(entry.first), entry.second);
+    };
+
+    auto launch = [&](std::unique_ptr<EngineTransfer> transfer)
+    {
+        if (!spare.empty())
+        {
+            transfer->curl = spare.back();
+            spare.pop_back();
+            curl_easy_reset(transfer->curl);
+        }
+        else
+        {
+            transfer->curl = curl_easy_init();
+        }
+        if (!transfer->curl)
+        {
+            broken.emplace_back(std::move(transfer), "Failed to initialize libcurl.");
+            return;
+        }
+        service->configureHandle(transfer->curl);
+        std::string error;
+        if (!startTransfer(curlMulti, *transfer, error))
+        {
+            broken.emplace_back(std::move(transfer), error);
+            return;
+        }
+        running.push_back(std::move(transfer));
+    };
+
+    auto startDownload = [&](Job &job)
+    {
+        auto download = std::make_shared<EngineDownload>();
+        download->request = std::move(job.request);
+        download->onComplete = std::move(job.onComplete);
+        download->url = trim(download->request.url);
+        if (download->request.memory)
+        {
+            download->sink.memory = download->request.memory;
+            download->sink.memory->clear();
+        }
+        else
+        {
+            // A conditional request is about a cached copy, not about a .part file.
+            bool conditional = !download->request.etag.empty() || !download->request.lastModified.empty();
+            if (openPartFile(download->request.destinationPath, conditional, download->part))
+            {
+                download->sink.fd = download->part.fd;
+                download->ifRange = download->part.validator;
+            }
+        }
+        if (!download->sink.memory && download->sink.fd < 0)
+        {
+            DownloadResult failed;
+            failed.error = "Failed to open file: " + download->request.destinationPath + ".part";
+            spdlog::error("{}", failed.error);
+            Job failedJob{std::move(download->request), std::move(download->onComplete)};
+            complete(failedJob, failed);
+            return;
+        }
+        activeDownloads++;
+        spdlog::info("Downloading from URL: {}", download->url);
+
+        auto transfer = std::make_unique<EngineTransfer>();
+        transfer->first = true;
+        transfer->part.sink = download->sink;
+        if (!download->sink.memory && download->part.size > 0)
+        {
+            transfer->part.rangeStart = download->part.size;
+            spdlog::debug("Continuing {} at byte {}.", download->part.path, transfer->part.rangeStart);
+        }
+        else if (config.maxSegments > 1 && config.segmentBytes > 0)
+        {
+            transfer->probe = true;
+            transfer->rangeEnd = config.segmentBytes - 1;
+        }
+        download->transfers = 1;
+        transfer->download = std::move(download);
+        launch(std::move(transfer));
+    };
+
+    // Once a probe's headers show a 206 for a large object, fetches the rest in parallel ranges.
+    auto splitDownload = [&](EngineTransfer &probe)
+    {
+        probe.probe = false;
+        EngineDownload &download = *probe.download;
+        long status = 0;
+        curl_easy_getinfo(probe.curl, CURLINFO_RESPONSE_CODE, &status);
+        uint64_t total = 0;
+        if (status != 206 || !parseContentRangeTotal(probe.contentRange, total) || total <= probe.rangeEnd + 1)
+            return;
+        uint64_t first = probe.rangeEnd + 1;
+        uint64_t remaining = total - first;
+        uint64_t segments = std::min<uint64_t>(config.maxSegments - 1, (remaining + config.segmentBytes - 1) / config.segmentBytes);
+        uint64_t length = (remaining + segments - 1) / segments;
+        spdlog::debug("Fetching {} ({} bytes) in {} ranges.", download.url, total, segments + 1);
+        download.split = true;
+        download.ifRange = pickValidator(probe.etag, probe.lastModified);
+        // From now on no transfer may truncate the file.
+        probe.part.ownsSink = false;
+        sinkReserve(download.sink, 0, total);
+        for (uint64_t start = first; start < total; start += length)
+        {
+            auto segment = std::make_unique<EngineTransfer>();
+            segment->download = probe.download;
+            segment->part.sink = download.sink;
+            segment->part.ownsSink = false;
+            segment->part.rangeStart = start;
+            segment->rangeEnd = std::min(total, start + length) - 1;
+            download.transfers++;
+            launch(std::move(segment));
+        }
+    };
+
+    // Accounts for a transfer curl has finished with: done, retried or failed.
+    auto finishTransfer = [&](std::unique_ptr<EngineTransfer> transfer, CURLcode code, long status)
+    {
+        EngineDownload &download = *transfer->download;
+        PartWriter &part = transfer->part;
+        download.result.bytes += part.received;
+        if (transfer->traceStart)
+            Trace::record("transfer", transfer->traceStart, download.request.layerNumber, part.received,
+                          code == CURLE_OK && status < 400 ? "ok" : "failed");
+        if (part.started && part.status / 100 == 2)
+        {
+            std::string validator = pickValidator(transfer->etag, transfer->lastModified);
+            if (!validator.empty())
+                download.ifRange = validator;
+        }
+        if (transfer->first)
+        {
+            download.result.httpStatus = status;
+            download.result.etag = transfer->etag;
+            download.result.lastModified = transfer->lastModified;
+        }
+
+        // An empty body still replaces the file; a 304 keeps it.
+        if (code == CURLE_OK && !part.started && part.ownsSink && status < 300 &&
+            !sinkTruncate(part.sink, status == 206 ? part.rangeStart : 0))
+            code = CURLE_WRITE_ERROR;
+
+        bool retry = false;
+        std::string reason;
+        if (code == CURLE_OK && status == 416 && part.rangeStart > 0 && part.ownsSink)
+        {
+            // The .part file does not fit the object (any more); start over.
+            spdlog::warn("Cannot continue {} at byte {}; downloading it again.", download.url, part.rangeStart);
+            part.rangeStart = 0;
+            retry = true;
+            reason = "HTTP 416";
+        }
+        else if (isTransient(code, status))
+        {
+            // A 2xx body that broke off is continued from where it stopped;
+            // an error answer left the file as it was.
+            if (part.started && part.status / 100 == 2)
+                part.rangeStart = part.position;
+            retry = transfer->rangeEnd == kToEnd || part.rangeStart <= transfer->rangeEnd;
+            reason = code == CURLE_OK ? "HTTP " + std::to_string(status) : curl_easy_strerror(code);
+        }
+
+        if (retry)
+        {
+            if (transfer->attempt >= policy.maxAttempts)
+            {
+                fail(std::move(transfer), "Giving up on " + download.url + " after " +
+                                              std::to_string(policy.maxAttempts) + " attempts: " + reason);
+                return;
+            }
+            std::chrono::milliseconds delay = policy.backoff(transfer->attempt);
+            transfer->attempt++;
+            spdlog::warn("Download of {} failed ({}); retrying in {} ms (attempt {} of {}).", download.url, reason,
+                         delay.count(), transfer->attempt, policy.maxAttempts);
+            transfer->retryAt = Clock::now() + delay;
+            recycleHandle(*transfer);
+            waiting.push_back(std::move(transfer));
+            return;
+        }
+        if (code != CURLE_OK)
+        {
+            fail(std::move(transfer), curl_easy_strerror(code));
+            return;
+        }
+        if (status >= 400)
+        {
+            fail(std::move(transfer), "HTTP " + std::to_string(status) + " from " + download.url);
+            return;
+        }
+        releaseTransfer(std::move(transfer));
+    };
+
+    while (true)
+    {
+        std::deque<Job> starting;
+        std::deque<Job> cancelled;
+        bool cancelRunning = false;
+        bool exiting = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (cancelRequested)
+            {
+                cancelled.swap(queued);
+                cancelRunning = true;
+                cancelRequested = false;
+            }
+            while (!queued.empty() && activeDownloads + starting.size() < config.maxInFlight)
+            {
+                starting.push_back(std::move(queued.front()));
+                queued.pop_front();
+            }
+            // The destructor always cancels together with stopping, so
+            // nothing is left to start once we get here.
+            exiting = stopping;
+        }
+
+        DownloadResult cancelledResult;
+        cancelledResult.cancelled = true;
+        cancelledResult.error = "Cancelled.";
+        for (Job &job : cancelled)
+        {
+            complete(job, cancelledResult);
+        }
+        if (cancelRunning)
+        {
+            for (auto *list : {&running, &waiting})
+            {
+                std::vector<std::unique_ptr<EngineTransfer>> stopped = std::move(*list);
+                list->clear();
+                for (auto &transfer : stopped)
+                {
+                    if (list == &running)
+                        curl_multi_remove_handle(curlMulti, transfer->curl);
+                    transfer->download->result.cancelled = true;
+                    transfer->download->result.error = cancelledResult.error;
+                    releaseTransfer(std::move(transfer));
+                }
+            }
+        }
+        if (exiting)
+            break;
+
+        for (Job &job : starting)
+        {
+            startDownload(job);
+        }
+        failBroken();
+
+        // Retries whose delay has passed.
+        Clock::time_point now = Clock::now();
+        std::vector<std::unique_ptr<EngineTransfer>> due;
+        for (auto it = waiting.begin(); it != waiting.end();)
+        {
+            if ((*it)->retryAt <= now)
+            {
+                due.push_back(std::move(*it));
+                it = waiting.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        for (auto &transfer : due)
+        {
+            launch(std::move(transfer));
+        }
+        failBroken();
+
+        int stillRunning = 0;
+        curl_multi_perform(curlMulti, &stillRunning);
+
+        // Probes whose headers say the object is worth splitting. Handles can
+        // only be added here, not from inside curl's callbacks.
+        for (size_t i = 0; i < running.size(); ++i)
+        {
+            if (running[i]->probe && running[i]->headersDone)
+                splitDownload(*running[i]);
+        }
+        failBroken();
+
+        int messagesLeft = 0;
+        while (CURLMsg *message = curl_multi_info_read(curlMulti, &messagesLeft))
+        {
+            if (message->msg != CURLMSG_DONE)
+                continue;
+            CURL *curl = message->easy_handle;
+            EngineTransfer *transfer = nullptr;
+            curl_easy_getinfo(curl, CURLINFO_PRIVATE, reinterpret_cast<char **>(&transfer));
+            long status = 0;
+            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+            CURLcode code = message->data.result;
+            curl_multi_remove_handle(curlMulti, curl);
+
+            auto it = std::find_if(running.begin(), running.end(), [transfer](const auto &entry)
+                                   { return entry.get() == transfer; });
+            if (it == running.end())
+                continue; // Abandoned while its message was queued.
+            std::unique_ptr<EngineTransfer> finished = std::move(*it);
+            running.erase(it);
+            if (finished->probe && finished->headersDone)
+                splitDownload(*finished);
+            finishTransfer(std::move(finished), code, status);
+        }
+        failBroken();
+
+        int timeoutMs = 1000;
+        for (const auto &transfer : waiting)
+        {
+            auto untilDue = std::chrono::duration_cast<std::chrono::milliseconds>(transfer->retryAt - Clock::now());
+            timeoutMs = std::max(0, std::min<int>(timeoutMs, static_cast<int>(untilDue.count())));
+        }
+        curl_multi_poll(curlMulti, nullptr, 0, timeoutMs, nullptr);
+    }
+
+    for (CURL *curl : spare)
+    {
+        curl_easy_cleanup(curl);
+    }
+}
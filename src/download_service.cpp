@@ -1,88 +1,347 @@
 #include "download_service.h"
-#include <curl/curl.h>
-#include <fstream>
-#include <iostream>
+#include "curl_common.h"
+#include "trace.h"
+#include <array>
+#include <cstdio>
+#include <cstring>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "spdlog/spdlog.h"
 
-// RAII wrapper for CURL*.
-class CurlHandle
+// Idle easy handles beyond this many are closed instead of pooled.
+static constexpr size_t kMaxIdleHandles = 16;
+
+// State shared by every transfer of one DownloadService.
+struct DownloadShare
+{
+    CURLSH *share = nullptr;
+    std::array<std::mutex, CURL_LOCK_DATA_LAST> locks;
+
+    std::mutex poolMutex;
+    std::vector<CURL *> idle;
+};
+
+static void lockShare(CURL *, curl_lock_data data, curl_lock_access, void *userptr)
+{
+    static_cast<DownloadShare *>(userptr)->locks[data].lock();
+}
+
+static void unlockShare(CURL *, curl_lock_data data, void *userptr)
+{
+    static_cast<DownloadShare *>(userptr)->locks[data].unlock();
+}
+
+std::chrono::milliseconds DownloadPolicy::backoff(unsigned retry) const
+{
+    // Doubling stops at the cap (and before the shift could overflow).
+    auto ceiling = maxRetryDelay;
+    if (retry <= 20)
+        ceiling = std::min(maxRetryDelay, retryDelay * (1 << (retry - 1)));
+    thread_local std::mt19937 random{std::random_device{}()};
+    std::uniform_int_distribution<long long> jitter(0, std::max<long long>(0, ceiling.count()));
+    return std::chrono::milliseconds(jitter(random));
+}
+
+DownloadService::DownloadService(const DownloadPolicy &policy)
+    : retryPolicy(policy), shared(std::make_unique<DownloadShare>())
+{
+    // DNS and TLS sessions are shared across threads. Live connections stay
+    // with each pooled handle instead: libcurl does not support sharing its
+    // connection cache between concurrently running threads.
+    shared->share = curl_share_init();
+    if (shared->share)
+    {
+        curl_share_setopt(shared->share, CURLSHOPT_LOCKFUNC, lockShare);
+        curl_share_setopt(shared->share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+        curl_share_setopt(shared->share, CURLSHOPT_USERDATA, shared.get());
+        curl_share_setopt(shared->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(shared->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    else
+    {
+        spdlog::warn("Failed to initialize libcurl share handle; DNS and TLS caches will not be shared.");
+    }
+}
+
+DownloadService::~DownloadService()
+{
+    for (CURL *curl : shared->idle)
+    {
+        curl_easy_cleanup(curl);
+    }
+    if (shared->share)
+    {
+        curl_share_cleanup(shared->share);
+    }
+}
+
+void DownloadService::configureHandle(void *handle)
+{
+    CURL *curl = static_cast<CURL *>(handle);
+    if (shared->share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, shared->share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // Wait for an existing HTTP/2 connection to multiplex on rather than opening another.
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    // Give up on stalled transfers rather than on slow ones, however large the image.
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, retryPolicy.connectTimeoutSeconds);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, retryPolicy.lowSpeedBytes);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, retryPolicy.lowSpeedSeconds);
+}
+
+void *DownloadService::acquireHandle()
 {
-public:
-    CurlHandle() : curl(curl_easy_init()) {}
-    ~CurlHandle()
+    CURL *curl = nullptr;
     {
-        if (curl)
+        std::lock_guard<std::mutex> lock(shared->poolMutex);
+        if (!shared->idle.empty())
         {
-            curl_easy_cleanup(curl);
+            curl = shared->idle.back();
+            shared->idle.pop_back();
         }
     }
-    CURL *get() { return curl; }
+    if (curl)
+    {
+        // Resets options only; the handle keeps its live connections.
+        curl_easy_reset(curl);
+    }
+    else
+    {
+        curl = curl_easy_init();
+    }
+    if (curl)
+    {
+        configureHandle(curl);
+    }
+    return curl;
+}
+
+void DownloadService::releaseHandle(void *handle)
+{
+    CURL *curl = static_cast<CURL *>(handle);
+    {
+        std::lock_guard<std::mutex> lock(shared->poolMutex);
+        if (shared->idle.size() < kMaxIdleHandles)
+        {
+            shared->idle.push_back(curl);
+            return;
+        }
+    }
+    curl_easy_cleanup(curl);
+}
+
+// Outcome of one attempt at a download.
+enum class AttemptResult
+{
+    COMPLETE,
+    RETRY,
+    FAILED
+};
 
-private:
-    CURL *curl;
+// Validators of the response an attempt receives. The final 2xx response's
+// is saved for the .part file, if there is one, before its body arrives.
+struct AttemptHeaders
+{
+    CURL *curl = nullptr;
+    PartFile *file = nullptr;
+    std::string etag;
+    std::string lastModified;
 };
 
-static size_t writeData(void *ptr, size_t size, size_t nmemb, void *stream)
+// Keeps the headers of the last response; earlier ones belong to redirects.
+static size_t captureValidators(char *buffer, size_t size, size_t nitems, void *userdata)
 {
-    std::ofstream *ofs = static_cast<std::ofstream *>(stream);
-    size_t count = size * nmemb;
-    ofs->write(static_cast<char *>(ptr), count);
-    return count;
+    AttemptHeaders *headers = static_cast<AttemptHeaders *>(userdata);
+    std::string_view line(buffer, size * nitems);
+    if (line.compare(0, 5, "HTTP/") == 0)
+    {
+        headers->etag.clear();
+        headers->lastModified.clear();
+    }
+    else if (line == "\r\n" || line == "\n")
+    {
+        long status = 0;
+        curl_easy_getinfo(headers->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status / 100 == 2 && headers->file)
+            savePartValidator(*headers->file, pickValidator(headers->etag, headers->lastModified));
+    }
+    else if (!headerValue(line, "etag", headers->etag))
+    {
+        headerValue(line, "last-modified", headers->lastModified);
+    }
+    return size * nitems;
 }
 
-// Helper function to trim whitespace from a string.
-#include <algorithm>
-#include <cctype>
-#include <locale>
-static inline std::string trim(const std::string &s)
-{
-    auto start = s.begin();
-    while (start != s.end() && std::isspace(*start))
-        start++;
-    auto end = s.end();
-    do
-    {
-        end--;
-    } while (std::distance(start, end) > 0 && std::isspace(*end));
-    return std::string(start, end + 1);
+// Fetches 'url' into the part's sink, continuing after 'part.rangeStart'
+// bytes already there if they still match 'ifRange'. 'ifRange' is updated
+// from the response.
+static AttemptResult performAttempt(CURL *curl, const std::string &url, PartWriter &part, PartFile *file,
+                                    std::string &ifRange)
+{
+    part.curl = curl;
+    part.started = false;
+    part.status = 0;
+    AttemptHeaders headers;
+    headers.curl = curl;
+    headers.file = file;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writePart);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &part);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, captureValidators);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &headers);
+    // A plain Range header rather than CURLOPT_RESUME_FROM, which turns an
+    // answer that is not a 206 into an error before its status is seen.
+    std::string range = std::to_string(part.rangeStart) + "-";
+    curl_easy_setopt(curl, CURLOPT_RANGE, part.rangeStart > 0 ? range.c_str() : nullptr);
+    // A changed object comes back whole (200) instead of as a range of it.
+    curl_slist *requestHeaders = nullptr;
+    if (part.rangeStart > 0 && !ifRange.empty())
+        requestHeaders = curl_slist_append(requestHeaders, ("If-Range: " + ifRange).c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, requestHeaders);
+
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(requestHeaders);
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    if (part.started && part.status / 100 == 2)
+    {
+        std::string validator = pickValidator(headers.etag, headers.lastModified);
+        if (!validator.empty())
+            ifRange = validator;
+    }
+    if (res == CURLE_OK && status == 416 && part.rangeStart > 0)
+    {
+        // The .part file does not fit the object (any more); start over.
+        spdlog::warn("Cannot continue {} at byte {}; downloading it again.", url, part.rangeStart);
+        part.rangeStart = 0;
+        return AttemptResult::RETRY;
+    }
+    // An empty body still replaces the file.
+    if (res == CURLE_OK && !part.started && status < 300 && !sinkTruncate(part.sink, status == 206 ? part.rangeStart : 0))
+        res = CURLE_WRITE_ERROR;
+    if (isTransient(res, status))
+    {
+        spdlog::warn("Download of {} failed: {}", url,
+                     res == CURLE_OK ? "HTTP " + std::to_string(status) : curl_easy_strerror(res));
+        // A 2xx body that broke off is continued from where it stopped; an
+        // error answer left the file as it was.
+        if (part.started && part.status / 100 == 2)
+            part.rangeStart = part.position;
+        return AttemptResult::RETRY;
+    }
+    if (res != CURLE_OK)
+    {
+        spdlog::error("Download error: {}", curl_easy_strerror(res));
+        return AttemptResult::FAILED;
+    }
+    if (status >= 400)
+    {
+        spdlog::error("Download of {} failed: HTTP {}", url, status);
+        return AttemptResult::FAILED;
+    }
+    return AttemptResult::COMPLETE;
+}
+
+// Runs attempts until one completes, one fails for good or the policy's
+// attempts are used up.
+static bool fetchWithRetries(CURL *curl, const std::string &url, PartWriter &part, PartFile *file,
+                             const DownloadPolicy &policy)
+{
+    std::string ifRange = file ? file->validator : std::string();
+    for (unsigned attempt = 1;; ++attempt)
+    {
+        AttemptResult result = performAttempt(curl, url, part, file, ifRange);
+        if (result != AttemptResult::RETRY)
+            return result == AttemptResult::COMPLETE;
+        if (attempt >= policy.maxAttempts)
+        {
+            spdlog::error("Giving up on {} after {} attempts.", url, attempt);
+            return false;
+        }
+        std::chrono::milliseconds delay = policy.backoff(attempt);
+        spdlog::info("Retrying {} in {} ms (attempt {} of {}).", url, delay.count(), attempt + 1, policy.maxAttempts);
+        std::this_thread::sleep_for(delay);
+    }
 }
 
 bool DownloadService::downloadFile(const std::string &url, const std::string &destinationPath)
 {
     std::string trimmedUrl = trim(url);
     spdlog::info("Downloading from URL: {}", trimmedUrl);
+    TraceSpan span("downloadFile");
+    span.setOutcome("failed");
 
-    CurlHandle curlHandle;
-    CURL *curl = curlHandle.get();
+    PartFile file;
+    if (!openPartFile(destinationPath, false, file))
+    {
+        spdlog::error("Failed to open file: {}.part", destinationPath);
+        return false;
+    }
+    PartWriter part;
+    part.sink.fd = file.fd;
+    if (file.size > 0)
+    {
+        part.rangeStart = file.size;
+        spdlog::debug("Continuing {} at byte {}.", file.path, part.rangeStart);
+    }
+
+    CURL *curl = static_cast<CURL *>(acquireHandle());
     if (!curl)
     {
         spdlog::error("Failed to initialize libcurl.");
+        abandonPartFile(file, true);
         return false;
     }
+    bool complete = fetchWithRetries(curl, trimmedUrl, part, &file, retryPolicy);
+    releaseHandle(curl);
 
-    std::ofstream ofs(destinationPath, std::ios::binary);
-    if (!ofs.is_open())
+    struct stat st;
+    bool empty = ::fstat(file.fd, &st) == 0 && st.st_size == 0;
+    if (!empty)
+        span.setBytes(static_cast<uint64_t>(st.st_size));
+    if (!complete)
+    {
+        // Whatever did arrive is kept for the next attempt at this destination.
+        abandonPartFile(file, !empty);
+        return false;
+    }
+    std::string error;
+    if (!publishPartFile(file, destinationPath, error))
     {
-        spdlog::error("Failed to open file: {}", destinationPath);
+        spdlog::error("{}", error);
         return false;
     }
+    span.setOutcome("ok");
+    return true;
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, trimmedUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeData);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ofs);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    // Set a timeout (in seconds) to avoid hanging.
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+bool DownloadService::downloadToMemory(const std::string &url, std::string &body)
+{
+    std::string trimmedUrl = trim(url);
+    spdlog::info("Downloading from URL: {}", trimmedUrl);
 
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK)
+    TraceSpan span("downloadToMemory");
+    body.clear();
+    PartWriter part;
+    part.sink.memory = &body;
+    CURL *curl = static_cast<CURL *>(acquireHandle());
+    if (!curl)
     {
-        spdlog::error("Download error: {}", curl_easy_strerror(res));
-        ofs.close();
+        spdlog::error("Failed to initialize libcurl.");
         return false;
     }
-
-    ofs.close();
-    return true;
+    bool ok = fetchWithRetries(curl, trimmedUrl, part, nullptr, retryPolicy);
+    releaseHandle(curl);
+    span.setBytes(body.size());
+    span.setOutcome(ok ? "ok" : "failed");
+    return ok;
 }
@@ -1,16 +1,32 @@
 #include "fake_printer.h"
+#include "byte_source.h"
+#include "compiled_dataset.h"
 #include "csv_reader.h"
 #include "download_service.h"
+#include "layer_decoder.h"
+#include "layer_json.h"
+#include "parallel_csv_reader.h"
+#include "trace.h"
 #include "spdlog/spdlog.h"
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 #include <atomic>
+#include <chrono>
+#include <climits>
 #include <csignal>
 
+#include <algorithm>
 #include <iomanip>
+#include <iterator>
 #include <map>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <future>
+#include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -18,17 +34,28 @@ namespace fs = std::filesystem;
 // Declare external shutdown flag.
 extern std::atomic<bool> g_shutdownRequested;
 
-// Function to read user input asynchronously
-void userInputListener(std::atomic<bool> &inputReceived, std::string &inputBuffer)
+static std::string layerFileName(int layerNumber)
 {
-    std::getline(std::cin, inputBuffer);
-    inputReceived = true;
+    char jsonFileName[100];
+    std::snprintf(jsonFileName, sizeof(jsonFileName), "layer_%05d.json", layerNumber);
+    return jsonFileName;
+}
+
+// Log message for a row that could not be decoded into a layer.
+static std::string describeRowError(int rowNumber, const LayerDecodeError &error)
+{
+    if (error.reason == LayerDecodeError::MISSING_COLUMN)
+        return fmt::format("Row {} does not have enough columns. Skipping.", rowNumber);
+    return fmt::format("Row {} column {} ({}): {} '{}'. Skipping.", rowNumber, error.column,
+                       error.columnName(), error.describe(), error.value);
 }
 
 FakePrinter::FakePrinter(const std::string &printName,
                          const std::string &destFolder,
-                         Mode mode)
-    : printName(printName), destFolder(destFolder), mode(mode)
+                         Mode mode,
+                         const PrintOptions &options)
+    : printName(printName), destFolder(destFolder), mode(mode), options(options), log(spdlog::default_logger()),
+      downloader(options.downloadPolicy)
 {
 }
 
@@ -39,10 +66,14 @@ bool FakePrinter::prepareOutputDirectory()
     {
         if (!fs::exists(outputPath))
             fs::create_directories(outputPath);
+        // Images are downloaded into images/ even when they end up in the pack.
+        fs::create_directories(outputPath / "images");
+        if (options.output == PrintOptions::FILES)
+            fs::create_directories(outputPath / "layers");
     }
     catch (const fs::filesystem_error &e)
     {
-        spdlog::error("Error creating output directory: {}", e.what());
+        log->error("Error creating output directory: {}", e.what());
         return false;
     }
     return true;
@@ -50,6 +81,8 @@ bool FakePrinter::prepareOutputDirectory()
 
 bool FakePrinter::validateLayer(const Layer &layer, std::string &errorMsg)
 {
+    TraceSpan span("validate", layer.layerNumber);
+    span.setOutcome("invalid");
     if (layer.layerError != "SUCCESS")
     {
         errorMsg = "Layer error reported: " + layer.layerError;
@@ -61,388 +94,1269 @@ bool FakePrinter::validateLayer(const Layer &layer, std::string &errorMsg)
         return false;
     }
     // Additional validations can be added here.
+    span.setOutcome("ok");
     return true;
 }
 
+void FakePrinter::writeLayerData(const Layer &layer, std::function<void(bool written)> onWritten)
+{
+    // A staged record is a file; it goes into the pack when the layer is published.
+    if (pack && !stager)
+    {
+        // One serialization buffer per write worker, reused for every layer.
+        thread_local std::string json;
+        TraceSpan span("pack.append", layer.layerNumber);
+        json.clear();
+        appendLayerJson(json, layer);
+        span.setBytes(json.size());
+        bool appended = pack->append(PackRecordKind::LAYER, layer.layerNumber, json);
+        span.setOutcome(appended ? "ok" : "failed");
+        if (!appended)
+            log->error("Failed to add layer {} to the pack file.", layer.layerNumber);
+        onWritten(appended);
+        return;
+    }
+
+    // The file writer holds on to the buffer until the file is written.
+    auto json = std::make_shared<std::string>();
+    {
+        TraceSpan span("serialize", layer.layerNumber);
+        appendLayerJson(*json, layer);
+        if (!pack)
+            json->push_back('\n');
+        span.setBytes(json->size());
+    }
+    std::string jsonFileName = layerFileName(layer.layerNumber);
+    std::string jsonFilePath = stager ? stager->stagedPath("layers", layer.layerNumber, jsonFileName)
+                                      : (fs::path(destFolder) / printName / "layers" / jsonFileName).string();
+    AsyncFileWriter &writer = shared.writer ? *shared.writer : *fileWriter;
+    // From submission until the writer is done with the file, queueing included.
+    uint64_t traceStart = Trace::enabled() ? Trace::now() : 0;
+    int layerNumber = layer.layerNumber;
+    uint64_t bytes = json->size();
+    writer.submit(jsonFilePath, std::move(json),
+                  [this, jsonFilePath, traceStart, layerNumber, bytes, onWritten = std::move(onWritten)](int error)
+                  {
+                      if (traceStart)
+                          Trace::record("write", traceStart, layerNumber, bytes, error == 0 ? "ok" : "failed");
+                      if (error != 0)
+                          log->error("Failed to write layer file: {} ({})", jsonFilePath, std::strerror(error));
+                      onWritten(error == 0);
+                  });
+}
+
+bool FakePrinter::publishLayer(const Layer &layer)
+{
+    TraceSpan span("publish", layer.layerNumber);
+    std::string jsonFileName = layerFileName(layer.layerNumber);
+    bool published;
+    if (pack)
+    {
+        published = pack->appendFile(PackRecordKind::LAYER, layer.layerNumber,
+                                     stager->stagedPath("layers", layer.layerNumber, jsonFileName));
+        stager->discard("layers", layer.layerNumber, jsonFileName);
+    }
+    else
+    {
+        published = stager->publish("layers", layer.layerNumber, jsonFileName);
+    }
+    published = published && stager->publish("images", layer.layerNumber, layer.fileName);
+    span.setOutcome(published ? "ok" : "failed");
+    return published;
+}
+
 bool FakePrinter::processLayer(const Layer &layer)
 {
-    fs::path basePath = fs::path(destFolder) / printName;
-    fs::path layerDataPath = basePath / "layers";
-    fs::path imagePath = basePath / "images";
+    TraceSpan span("processLayer", layer.layerNumber);
+    span.setOutcome("failed");
+    // The layer file is written while the image downloads.
+    std::promise<bool> writeDone;
+    std::future<bool> written = writeDone.get_future();
+    writeLayerData(layer, [&writeDone](bool ok)
+                   { writeDone.set_value(ok); });
 
-    try
+    std::optional<std::string> image;
+    if (spoolsImages(imageCache.get()))
+        image.emplace();
+    bool downloaded = image ? downloader.downloadToMemory(layer.imageUrl, *image) : downloadImage(layer);
+    if (!written.get())
     {
-        if (!fs::exists(layerDataPath))
-            fs::create_directories(layerDataPath);
-        if (!fs::exists(imagePath))
-            fs::create_directories(imagePath);
+        return false;
     }
-    catch (const fs::filesystem_error &e)
+    if (!downloaded)
     {
-        spdlog::error("Error creating output directories: {}", e.what());
+        log->error("Failed to download image for layer {}", layer.layerNumber);
         return false;
     }
+    if (!packImage(layer, image ? &*image : nullptr))
+        return false;
+    span.setOutcome("ok");
+    return true;
+}
 
-    // Write layer data as a JSON file.
-    char jsonFileName[100];
-    std::snprintf(jsonFileName, sizeof(jsonFileName), "layer_%05d.json", layer.layerNumber);
-    fs::path jsonFilePath = layerDataPath / jsonFileName;
-    std::ofstream ofs(jsonFilePath);
-    if (!ofs)
+bool FakePrinter::spoolsImages(const ImageCache *cache) const
+{
+    return pack && options.output == PrintOptions::PACK_WITH_IMAGES && !cache && !stager;
+}
+
+bool FakePrinter::packImage(const Layer &layer, const std::string *image)
+{
+    if (!pack || options.output != PrintOptions::PACK_WITH_IMAGES)
+        return true;
+    if (image)
     {
-        spdlog::error("Failed to write layer file: {}", jsonFilePath.string());
+        if (pack->append(PackRecordKind::IMAGE, layer.layerNumber, *image))
+            return true;
+        log->error("Failed to add the image of layer {} to the pack file.", layer.layerNumber);
         return false;
     }
-    ofs << layer.toString() << "\n";
-    ofs.close();
-
-    // Use the DownloadService to download the image.
-    DownloadService downloader;
-    fs::path imageFilePath = imagePath / layer.fileName;
-    if (!downloader.downloadFile(layer.imageUrl, imageFilePath.string()))
+    fs::path imageFilePath = fs::path(destFolder) / printName / "images" / layer.fileName;
+    if (!pack->appendFile(PackRecordKind::IMAGE, layer.layerNumber, imageFilePath.string()))
     {
-        spdlog::error("Failed to download image for layer {}", layer.layerNumber);
+        log->error("Failed to add the image of layer {} to the pack file.", layer.layerNumber);
         return false;
     }
+    std::error_code ec;
+    fs::remove(imageFilePath, ec);
     return true;
 }
 
-void FakePrinter::printSummary() {
-    spdlog::info("\n=== Fake Print Summary ===");
+void FakePrinter::startDownloads()
+{
+    AsyncFileWriterConfig writerConfig;
+    writerConfig.sync = options.syncFiles;
+    fileWriter = std::make_unique<AsyncFileWriter>(writerConfig);
 
-    // General statistics
-    spdlog::info("Total layers processed: {}", totalLayersPrinted);
-    spdlog::info("Total errors encountered: {}", totalErrors);
-    if (totalLayersPrinted == 0) {
-        spdlog::warn("No layers were successfully printed.");
+    // Supervised mode downloads one image at a time through 'downloader'
+    // unless the cache or the lookahead pipeline needs the engine.
+    bool useCache = options.imageCacheBytes > 0;
+    if (mode != SUPERVISED || useCache || options.lookahead > 0)
+    {
+        DownloadEngineConfig engineConfig;
+        engineConfig.maxInFlight = std::max(1u, options.maxDownloads);
+        engineConfig.maxPerHost = std::max(1u, options.maxDownloadsPerHost);
+        engineConfig.maxSegments = std::max(1u, options.downloadSegments);
+        downloadEngine = std::make_unique<DownloadEngine>(engineConfig, &downloader);
+    }
+    if (!useCache)
         return;
+
+    ImageCacheConfig cacheConfig;
+    cacheConfig.directory = options.imageCacheDir.empty()
+                                ? (fs::path(destFolder) / ".image-cache").string()
+                                : options.imageCacheDir;
+    cacheConfig.maxBytes = options.imageCacheBytes;
+    imageCache = std::make_unique<ImageCache>(cacheConfig, *downloadEngine, fileWriter.get());
+    if (!imageCache->open())
+    {
+        log->warn("Image cache unavailable; downloading every image.");
+        imageCache.reset();
     }
+}
 
-    // Layer error breakdown
-    std::map<std::string, int> errorCounts;
-    std::map<std::string, int> materialUsage;
-    std::map<int, int> printSpeeds;
-    double totalPrintTime = 0.0;
-    double minPrintSpeed = 9999, maxPrintSpeed = 0, avgPrintSpeed = 0;
-    int minLayerTime = 9999, maxLayerTime = 0;
+bool FakePrinter::downloadImage(const Layer &layer)
+{
+    fs::path imageFilePath = fs::path(destFolder) / printName / "images" / layer.fileName;
+    if (!imageCache)
+        return downloader.downloadFile(layer.imageUrl, imageFilePath.string());
 
-    for (const auto& layer : layers) {
-        if (!layer.layerError.empty() && layer.layerError != "SUCCESS") {
-            errorCounts[layer.layerError]++;
+    std::promise<DownloadResult> done;
+    std::future<DownloadResult> result = done.get_future();
+    imageCache->fetch(layer.imageUrl, imageFilePath.string(), [&done](const DownloadResult &finished)
+                      { done.set_value(finished); }, layer.layerNumber);
+    return result.get().success;
+}
+
+// Prints one bar per non-empty bucket of a histogram, labelled by 'label'.
+static void printHistogram(const FixedHistogram &histogram, const std::function<std::string(int lower)> &label) {
+    auto printBar = [](const std::string &name, uint64_t count) {
+        std::cout << "  " << name << " | ";
+        for (uint64_t i = 0; i < count; ++i) {
+            std::cout << "#";
         }
-        materialUsage[layer.materialType]++;
-        printSpeeds[layer.printSpeed]++;
-
-        // Print speed analysis
-        if (layer.printSpeed > maxPrintSpeed) maxPrintSpeed = layer.printSpeed;
-        if (layer.printSpeed < minPrintSpeed) minPrintSpeed = layer.printSpeed;
-        avgPrintSpeed += layer.printSpeed;
-
-        // Time analysis (parsing time from "5min_12sec" format)
-        int layerTimeSec = 0;
-        try {
-            size_t minPos = layer.layerTime.find("min");
-            size_t secPos = layer.layerTime.find("sec");
-            if (minPos != std::string::npos) {
-                layerTimeSec += std::stoi(layer.layerTime.substr(0, minPos)) * 60;
-            }
-            if (secPos != std::string::npos) {
-                layerTimeSec += std::stoi(layer.layerTime.substr(minPos + 4, secPos));
-            }
-            totalPrintTime += layerTimeSec;
-            if (layerTimeSec < minLayerTime) minLayerTime = layerTimeSec;
-            if (layerTimeSec > maxLayerTime) maxLayerTime = layerTimeSec;
-        } catch (...) {
-            spdlog::warn("Error parsing time for layer {}", layer.layerNumber);
+        std::cout << " (" << count << " layers)\n";
+    };
+    if (histogram.underflow() > 0) {
+        printBar("below " + label(histogram.bucketLower(0)), histogram.underflow());
+    }
+    for (size_t i = 0; i < histogram.bucketCount(); ++i) {
+        if (histogram.count(i) > 0) {
+            printBar(label(histogram.bucketLower(i)), histogram.count(i));
         }
     }
+    if (histogram.overflow() > 0) {
+        printBar("from " + label(histogram.bucketLower(histogram.bucketCount())), histogram.overflow());
+    }
+}
+
+void FakePrinter::printSummary() {
+    // Farm jobs can finish at the same time; keep each summary in one piece.
+    static std::mutex outputMutex;
+    std::lock_guard<std::mutex> lock(outputMutex);
+
+    log->info("\n=== Fake Print Summary ===");
+
+    // General statistics
+    log->info("Total layers processed: {}", totalLayersPrinted);
+    log->info("Total errors encountered: {}", totalErrors);
+    if (totalLayersPrinted == 0) {
+        log->warn("No layers were successfully printed.");
+        return;
+    }
+
+    if (options.keepLayers) {
+        log->debug("Layer table: {} layers in {} bytes.", printedLayers.size(), printedLayers.memoryUsage());
+        statistics.addTable(printedLayers);
+    }
 
-    avgPrintSpeed /= totalLayersPrinted;
+    const RunningStat &speed = statistics.printSpeed();
+    const RunningStat &temperature = statistics.extrusionTemperature();
+    const RunningStat &layerTime = statistics.layerTime();
+    const auto &errorCounts = statistics.errorCounts();
 
     // Print material usage statistics
-    spdlog::info("\nMaterial Usage:");
-    for (const auto& material : materialUsage) {
-        spdlog::info("  - {}: {} layers", material.first, material.second);
+    log->info("\nMaterial Usage:");
+    for (const auto& material : statistics.materialCounts()) {
+        log->info("  - {}: {} layers", material.first, material.second);
     }
 
     // Print speed statistics
-    spdlog::info("\nPrint Speed Analysis:");
-    spdlog::info("  - Min Speed: {} mm/s", minPrintSpeed);
-    spdlog::info("  - Max Speed: {} mm/s", maxPrintSpeed);
-    spdlog::info("  - Avg Speed: {:.2f} mm/s", avgPrintSpeed);
+    log->info("\nPrint Speed Analysis:");
+    log->info("  - Min Speed: {} mm/s", speed.min());
+    log->info("  - Max Speed: {} mm/s", speed.max());
+    log->info("  - Avg Speed: {:.2f} mm/s", speed.mean());
+    log->info("  - Std Dev: {:.2f} mm/s", speed.stddev());
+
+    // Print extrusion temperature statistics
+    log->info("\nExtrusion Temperature Analysis:");
+    log->info("  - Min Temperature: {} C", temperature.min());
+    log->info("  - Max Temperature: {} C", temperature.max());
+    log->info("  - Avg Temperature: {:.2f} C", temperature.mean());
+    log->info("  - Std Dev: {:.2f} C", temperature.stddev());
 
     // Print time statistics
-    spdlog::info("\nTime Statistics:");
-    spdlog::info("  - Total print time: {:.2f} minutes", totalPrintTime / 60.0);
-    spdlog::info("  - Min layer time: {} sec", minLayerTime);
-    spdlog::info("  - Max layer time: {} sec", maxLayerTime);
+    log->info("\nTime Statistics:");
+    log->info("  - Total print time: {:.2f} minutes", layerTime.sum() / 60.0);
+    log->info("  - Min layer time: {} sec", layerTime.min());
+    log->info("  - Max layer time: {} sec", layerTime.max());
+    log->info("  - Avg layer time: {:.2f} sec", layerTime.mean());
 
     // Print error breakdown
     if (!errorCounts.empty()) {
-        spdlog::info("\nError Breakdown:");
+        log->info("\nError Breakdown:");
         for (const auto& err : errorCounts) {
-            spdlog::error("  - {}: {} occurrences", err.first, err.second);
+            log->error("  - {}: {} occurrences", err.first, err.second);
+        }
+    }
+
+    // Print failed layers per material, which needs every layer kept
+    if (options.keepLayers && !errorCounts.empty()) {
+        RowMask failed = printedLayers.selectAll();
+        printedLayers.whereNotEquals(LayerTable::LAYER_ERROR, "SUCCESS", failed);
+        printedLayers.whereNotEquals(LayerTable::LAYER_ERROR, "", failed);
+        log->info("\nFailed Layers by Material:");
+        for (const auto& material : statistics.materialCounts()) {
+            RowMask rows = failed;
+            printedLayers.whereEquals(LayerTable::MATERIAL_TYPE, material.first, rows);
+            ColumnAggregate speeds = printedLayers.aggregate(LayerTable::PRINT_SPEED, &rows);
+            log->info("  - {}: {} layers, avg speed {:.2f} mm/s", material.first, speeds.count, speeds.mean());
         }
     }
 
     // Print ASCII Bar Chart for error frequency
-    spdlog::info("\nError Distribution:");
+    log->info("\nError Distribution:");
     for (const auto& err : errorCounts) {
         std::cout << "  " << std::setw(15) << std::left << err.first << " | ";
-        for (int i = 0; i < err.second; ++i) {
+        for (uint64_t i = 0; i < err.second; ++i) {
             std::cout << "#";
         }
         std::cout << " (" << err.second << ")\n";
     }
 
-    // Print ASCII Bar Chart for print speed distribution
-    spdlog::info("\nPrint Speed Distribution:");
-    for (const auto& speed : printSpeeds) {
-        std::cout << "  " << std::setw(3) << speed.first << " mm/s | ";
-        for (int i = 0; i < speed.second; ++i) {
-            std::cout << "#";
+    // Print ASCII Bar Charts for the print speed, temperature and layer time distributions
+    log->info("\nPrint Speed Distribution:");
+    printHistogram(statistics.printSpeedHistogram(), [](int lower) {
+        return fmt::format("{:<3} mm/s", lower);
+    });
+
+    log->info("\nExtrusion Temperature Distribution:");
+    int temperatureStep = statistics.extrusionTemperatureHistogram().bucketWidth();
+    printHistogram(statistics.extrusionTemperatureHistogram(), [temperatureStep](int lower) {
+        return fmt::format("{:>3}-{:<3} C", lower, lower + temperatureStep - 1);
+    });
+
+    log->info("\nLayer Time Distribution:");
+    printHistogram(statistics.layerTimeHistogram(), [](int lower) {
+        return fmt::format("{:>3} min", lower / 60);
+    });
+
+    log->info("\n=== End of Fake Print Summary ===");
+}
+
+void FakePrinter::readRows(const std::string &csvFileName, unsigned parseThreads, const ByteSourceOptions &sourceOptions,
+                           uint64_t startOffset, const std::function<bool(const std::vector<std::string_view> &row, uint64_t endOffset)> &onRow)
+{
+    // Files below this size parse faster on one thread than it takes to fan out.
+    constexpr uintmax_t kParallelThreshold = 64ull * 1024 * 1024;
+
+    unsigned threads = parseThreads;
+    if (threads == 0)
+    {
+        std::error_code ec;
+        uintmax_t size = fs::file_size(csvFileName, ec);
+        threads = (!ec && size >= kParallelThreshold) ? std::thread::hardware_concurrency() : 1;
+    }
+    // Only a plain file can be cut into ranges; streams are parsed as they arrive.
+    bool streamed = sourceOptions.follow || !sourceOptions.copyTo.empty() || isStreamLocation(csvFileName);
+    if (threads > 1 && !streamed)
+    {
+        ParallelCSVReader parallelReader(csvFileName, threads);
+        if (parallelReader.isMapped())
+        {
+            spdlog::debug("Parsing {} ({} bytes) on {} threads.", csvFileName, parallelReader.size(), threads);
+            parallelReader.forEachRow(onRow, startOffset);
+            return;
         }
-        std::cout << " (" << speed.second << " layers)\n";
+        spdlog::debug("{} cannot be memory-mapped; parsing on one thread.", csvFileName);
     }
 
-    spdlog::info("\n=== End of Fake Print Summary ===");
+    CSVReader reader(csvFileName, sourceOptions);
+    if (startOffset > 0 && !reader.seek(startOffset))
+    {
+        spdlog::error("Cannot continue {} at byte {}.", csvFileName, startOffset);
+        return;
+    }
+    std::vector<std::string_view> row;
+    while (true)
+    {
+        // Recorded only once a row has been read, so the read that finds the
+        // end of the file leaves no span.
+        uint64_t traceStart = Trace::enabled() ? Trace::now() : 0;
+        uint64_t rowStart = reader.offset();
+        if (!reader.readNextRow(row))
+            break;
+        if (traceStart != 0)
+            Trace::record("csv.record", traceStart, -1, reader.offset() - rowStart, nullptr);
+        if (!onRow(row, reader.offset()))
+            return;
+    }
+    if (!reader.error().empty())
+        spdlog::error("Cannot read {}: {}", csvFileName, reader.error());
 }
 
+// Maps the compiled dataset if there is one and it matches 'csvFileName',
+// which must be the default CSV read as a whole.
+static std::unique_ptr<CompiledDataset> openCompiledDataset(const std::string &csvFileName,
+                                                            const ByteSourceOptions &sourceOptions)
+{
+    if (csvFileName != kPrintDataFile || sourceOptions.follow || !fs::exists(kCompiledDataFile))
+        return nullptr;
+    auto compiled = std::make_unique<CompiledDataset>();
+    if (!compiled->open(kCompiledDataFile, csvFileName))
+    {
+        spdlog::info("{} does not match {}; parsing the CSV. Run --compile-dataset to update it.", kCompiledDataFile,
+                     csvFileName);
+        return nullptr;
+    }
+    spdlog::info("Reading {} rows from {}.", compiled->rowCount(), kCompiledDataFile);
+    return compiled;
+}
 
-void FakePrinter::run()
+bool LayerDataset::read(size_t index, int &rowNumber, Layer &layer, std::string &error) const
 {
-    if (!prepareOutputDirectory())
+    if (compiled)
+    {
+        rowNumber = compiled->rowNumber(index);
+        return compiled->read(index, layer, error);
+    }
+    const Row &row = rows[index];
+    rowNumber = row.rowNumber;
+    if (row.layer < 0)
     {
-        spdlog::error("Error preparing output directory. Exiting.");
+        error = errors[row.error];
+        return false;
+    }
+    layer = layers.row(row.layer);
+    return true;
+}
+
+void FakePrinter::readLayers(const std::string &csvFileName, unsigned parseThreads, const ByteSourceOptions &sourceOptions,
+                            int firstRow, uint64_t startOffset,
+                            const std::function<bool(int rowNumber, uint64_t endOffset, Layer *layer, const std::string &error)> &onLayer)
+{
+    std::unique_ptr<CompiledDataset> compiled = openCompiledDataset(csvFileName, sourceOptions);
+    if (!compiled)
+    {
+        readCsvLayers(csvFileName, parseThreads, sourceOptions, firstRow, startOffset, onLayer);
         return;
     }
+    Layer layer;
+    std::string error;
+    for (size_t row = compiled->findOffset(startOffset); row < compiled->rowCount(); ++row)
+    {
+        bool decoded = compiled->read(row, layer, error);
+        if (!onLayer(compiled->rowNumber(row), compiled->endOffset(row), decoded ? &layer : nullptr, error))
+            break;
+    }
+}
+
+void FakePrinter::readCsvLayers(const std::string &csvFileName, unsigned parseThreads,
+                               const ByteSourceOptions &sourceOptions, int firstRow, uint64_t startOffset,
+                               const std::function<bool(int rowNumber, uint64_t endOffset, Layer *layer, const std::string &error)> &onLayer)
+{
+    int rowNumber = startOffset == 0 ? 0 : firstRow - 1;
+    Layer layer;
+    std::string error;
+    readRows(csvFileName, parseThreads, sourceOptions, startOffset,
+             [&](const std::vector<std::string_view> &row, uint64_t endOffset)
+             {
+                 rowNumber++;
+                 // Skip header row.
+                 if (rowNumber == 1)
+                     return true;
+                 bool decoded;
+                 {
+                     TraceSpan span("decode");
+                     LayerDecodeError decodeError;
+                     decoded = decodeLayer(row, layer, decodeError);
+                     if (decoded)
+                         span.setLayer(layer.layerNumber);
+                     else
+                         error = describeRowError(rowNumber, decodeError);
+                     span.setOutcome(decoded ? "ok" : "error");
+                 }
+                 return onLayer(rowNumber, endOffset, decoded ? &layer : nullptr, error);
+             });
+}
 
-    // Ensure the CSV file exists locally; if not, download it.
-    const std::string csvFileName = "fake_print_data.csv";
-    if (!fs::exists(csvFileName))
+bool FakePrinter::compileDataset(const std::string &csvFileName, const std::string &datasetFileName, unsigned parseThreads)
+{
+    // Stamped before parsing, so a CSV changed meanwhile makes the result stale.
+    DatasetSource source;
+    if (!source.describe(csvFileName, true))
     {
-        spdlog::info("CSV data file not found locally. Attempting to download...");
-        std::string cmd = "curl -L -o " + csvFileName + " https://bit.ly/3AE4mbA";
-        if (std::system(cmd.c_str()) != 0)
-        {
-            spdlog::error("Failed to download CSV data file. Exiting.");
-            return;
-        }
+        spdlog::error("Cannot read {}.", csvFileName);
+        return false;
     }
+    CompiledDatasetWriter writer;
+    if (!writer.open(datasetFileName))
+        return false;
+    readCsvLayers(csvFileName, parseThreads, ByteSourceOptions(), 0, 0,
+                  [&](int rowNumber, uint64_t endOffset, Layer *layer, const std::string &error)
+                  {
+                      writer.add(rowNumber, endOffset, layer, error);
+                      return !g_shutdownRequested;
+                  });
+    if (g_shutdownRequested || !writer.finish(source))
+        return false;
+    spdlog::info("Compiled {} rows of {} into {}.", writer.rowCount(), csvFileName, datasetFileName);
+    return true;
+}
 
-    CSVReader reader(csvFileName);
-    std::vector<std::string> row;
-    int rowNumber = 0;
-    while (reader.readNextRow(row))
+bool FakePrinter::dumpPack(const std::string &packPath, unsigned fromLayer, unsigned toLayer)
+{
+    LayerPackReader reader;
+    if (!reader.open(packPath))
+        return false;
+    std::vector<int> numbers = reader.layerNumbers();
+    if (fromLayer > 0 || toLayer > 0)
     {
-        if (g_shutdownRequested)
+        // Every number in the range is looked up, so gaps are reported.
+        int first = static_cast<int>(std::max(1u, fromLayer));
+        int last = toLayer > 0 ? static_cast<int>(toLayer) : (numbers.empty() ? 0 : numbers.back());
+        numbers.clear();
+        for (int layerNumber = first; layerNumber <= last; ++layerNumber)
+            numbers.push_back(layerNumber);
+    }
+    bool ok = true;
+    std::string_view json;
+    for (int layerNumber : numbers)
+    {
+        if (reader.findLayer(layerNumber, json))
         {
-            spdlog::info("Shutdown requested. Exiting print job.");
-            break;
+            std::cout << json << '\n';
         }
-        rowNumber++;
-        // Skip header row.
-        if (rowNumber == 1)
-            continue;
-        if (row.size() < 18)
+        else
         {
-            spdlog::error("Row {} does not have enough columns. Skipping.", rowNumber);
-            totalErrors++;
-            continue;
+            spdlog::error("Layer {} is not in {}.", layerNumber, packPath);
+            ok = false;
         }
+    }
+    std::cout.flush();
+    spdlog::debug("{} holds {} layers and {} images.", packPath, reader.layerCount(), reader.imageCount());
+    return ok;
+}
 
-        Layer layer;
-        layer.layerError = row[0];
-        try
-        {
-            layer.layerNumber = std::stoi(row[1]);
-        }
-        catch (...)
-        {
-            totalErrors++;
-            continue;
-        }
-        try
-        {
-            layer.layerHeight = std::stod(row[2]);
-        }
-        catch (...)
-        {
-            totalErrors++;
-            continue;
-        }
-        layer.materialType = row[3];
-        try
-        {
-            layer.extrusionTemperature = std::stoi(row[4]);
-        }
-        catch (...)
+bool FakePrinter::fetchDataFile(const std::string &csvFileName)
+{
+    if (fs::exists(csvFileName))
+        return true;
+    spdlog::info("CSV data file not found locally. Attempting to download...");
+    ByteSourceOptions sourceOptions;
+    sourceOptions.stop = &g_shutdownRequested;
+    sourceOptions.copyTo = csvFileName;
+    std::string error;
+    std::unique_ptr<ByteSource> download = openByteSource(kPrintDataUrl, sourceOptions, error);
+    if (download)
+    {
+        // Reading to the end saves the file.
+        std::vector<char> buffer(64 * 1024);
+        long got;
+        while ((got = download->read(buffer.data(), buffer.size())) > 0)
         {
-            totalErrors++;
-            continue;
         }
-        try
+        if (got == 0)
+            return true;
+        error = download->error();
+    }
+    spdlog::error("Failed to download CSV data file: {}. Exiting.", error);
+    return false;
+}
+
+ByteSourceOptions FakePrinter::sourceOptions(const PrintOptions &options)
+{
+    ByteSourceOptions sourceOptions;
+    sourceOptions.follow = options.followInput;
+    sourceOptions.followIdleSeconds = options.followIdleSeconds;
+    sourceOptions.stop = &g_shutdownRequested;
+    return sourceOptions;
+}
+
+void FakePrinter::loadDataset(const std::string &csvFileName, unsigned parseThreads,
+                              const ByteSourceOptions &sourceOptions, LayerDataset &dataset)
+{
+    dataset.compiled = openCompiledDataset(csvFileName, sourceOptions);
+    if (dataset.compiled)
+        return;
+    readCsvLayers(csvFileName, parseThreads, sourceOptions, 0, 0,
+                  [&](int rowNumber, uint64_t, Layer *layer, const std::string &error)
+                  {
+                      LayerDataset::Row entry;
+                      entry.rowNumber = rowNumber;
+                      if (layer)
+                      {
+                          entry.layer = static_cast<int>(dataset.layers.size());
+                          dataset.layers.append(*layer);
+                      }
+                      else
+                      {
+                          entry.error = static_cast<int>(dataset.errors.size());
+                          dataset.errors.push_back(error);
+                      }
+                      dataset.rows.push_back(entry);
+                      return !g_shutdownRequested;
+                  });
+}
+
+bool FakePrinter::loadLayerIndex(const std::string &csvFileName, unsigned parseThreads, LayerIndex &index)
+{
+    std::string indexPath = LayerIndex::pathFor(csvFileName);
+    if (index.load(indexPath, csvFileName))
+        return true;
+
+    spdlog::info("Indexing {} by layer number...", csvFileName);
+    auto start = std::chrono::steady_clock::now();
+    index = LayerIndex();
+    // Taken before the pass, so a CSV changed during it is indexed again next time.
+    DatasetSource source;
+    bool described = source.describe(csvFileName, true);
+    uint64_t rowStart = 0;
+    readLayers(csvFileName, parseThreads, ByteSourceOptions(), 0, 0,
+               [&](int rowNumber, uint64_t endOffset, Layer *layer, const std::string &)
+               {
+                   index.add(rowNumber, rowStart, layer ? layer->layerNumber : 0);
+                   rowStart = endOffset;
+                   return !g_shutdownRequested;
+               });
+    if (g_shutdownRequested)
+        return false;
+    if (described && index.save(indexPath, source))
+        spdlog::info("Indexed {} in {:.2f} s: {} entries in {}.", csvFileName,
+                     std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), index.size(),
+                     indexPath);
+    return true;
+}
+
+bool FakePrinter::openPack()
+{
+    if (options.output == PrintOptions::FILES)
+        return true;
+    LayerPackOptions packOptions;
+    packOptions.sync = options.packSync;
+    pack = std::make_unique<LayerPackWriter>(packOptions);
+    fs::path packPath = fs::path(destFolder) / printName / "layers.pack";
+    if (!pack->open(packPath.string()))
+    {
+        log->error("Error creating the pack file. Exiting.");
+        return false;
+    }
+    return true;
+}
+
+void FakePrinter::run()
+{
+    if (!prepareOutputDirectory())
+    {
+        log->error("Error preparing output directory. Exiting.");
+        return;
+    }
+
+    // The CSV comes from --input, or else from the local copy. Without one,
+    // the dataset is streamed from its URL and printed while it downloads,
+    // and saved for later runs; a checkpointed job downloads it first, since
+    // its checkpoints point into the file.
+    std::string csvFileName = options.input.empty() ? kPrintDataFile : options.input;
+    csvSource = sourceOptions(options);
+    if (options.input.empty() && !fs::exists(csvFileName) && options.checkpointEvery == 0)
+    {
+        log->info("CSV data file not found locally. Streaming it from {} and saving a copy.", kPrintDataUrl);
+        csvSource.copyTo = csvFileName;
+        csvFileName = kPrintDataUrl;
+    }
+    else if (options.input.empty() && !fetchDataFile(csvFileName))
+    {
+        return;
+    }
+    if (!openPack() || !restoreCheckpoint(csvFileName) || !seekLayerRange(csvFileName))
+        return;
+
+    if (mode == SUPERVISED)
+    {
+        // Supervised-mode commands come from stdin unless a script is given.
+        input = std::make_unique<InputReactor>();
+        bool inputReady = options.inputScript.empty() ? input->start() : input->open(options.inputScript);
+        if (!inputReady)
         {
-            layer.printSpeed = std::stoi(row[5]);
+            log->error("Failed to read commands from {}: {}",
+                       options.inputScript.empty() ? "stdin" : options.inputScript, std::strerror(errno));
+            return;
         }
-        catch (...)
+    }
+
+    startDownloads();
+    if (mode != SUPERVISED || options.lookahead > 0)
+    {
+        runPipeline(csvFileName);
+    }
+    else
+    {
+        uint64_t rowStart = watermark.offset();
+        readLayers(csvFileName, options.parseThreads, csvSource, watermark.nextRow(), watermark.offset(),
+                   [&](int, uint64_t endOffset, Layer *layer, const std::string &error)
+                   {
+                       if (g_shutdownRequested)
+                       {
+                           log->info("Shutdown requested. Exiting print job.");
+                           return false;
+                       }
+                       if (rowStart >= rangeEndOffset)
+                           return false;
+                       rowStart = endOffset;
+                       return !inLayerRange(layer) || handleRow(layer, error);
+                   });
+    }
+    input.reset();
+
+    downloadEngine.reset();
+    // Finishes the cache's blob writes before the cache goes.
+    fileWriter->waitAll();
+    AsyncFileWriterStats writerStats = fileWriter->stats();
+    log->debug("File writer ({}): {} files ({} bytes) in {} submissions, {} failed.", fileWriter->backend(),
+               writerStats.files, writerStats.bytes, writerStats.batches, writerStats.failed);
+    fileWriter.reset();
+    if (imageCache)
+    {
+        ImageCacheStats cacheStats = imageCache->stats();
+        log->info("Image cache: {} hits, {} revalidated, {} downloaded ({} bytes, {} already stored), {} evicted.",
+                  cacheStats.hits, cacheStats.revalidated, cacheStats.fetched + cacheStats.deduplicated,
+                  cacheStats.bytesDownloaded, cacheStats.deduplicated, cacheStats.evicted);
+        imageCache.reset();
+    }
+    if (pack && !pack->close())
+        log->error("Failed to finish the pack file.");
+    printSummary();
+}
+
+void FakePrinter::runPipeline(const std::string &csvFileName)
+{
+    PipelineConfig pipelineConfig;
+    pipelineConfig.validateWorkers = options.validateWorkers;
+    pipelineConfig.writeWorkers = options.writeWorkers;
+    pipelineConfig.downloadsInFlight = std::max(1u, options.maxDownloads);
+    pipelineConfig.queueCapacity = std::max(1u, options.queueCapacity);
+    PrintPipeline pipeline(pipelineConfig, *downloadEngine, g_shutdownRequested);
+
+    fs::path jobPath = fs::path(destFolder) / printName;
+    fs::path imagePath = jobPath / "images";
+    if (mode != AUTOMATIC)
+    {
+        stager = std::make_unique<LayerStager>(jobPath.string());
+        if (!stager->open({"layers", "images"}))
         {
-            totalErrors++;
-            continue;
+            stager.reset();
+            return;
         }
-        layer.layerAdhesionQuality = row[6];
-        try
+    }
+    // A resumed job continues at its checkpoint, and a layer range where the
+    // index points; the header is only read when starting from the top.
+    const int firstRow = watermark.nextRow();
+    const uint64_t startOffset = watermark.offset();
+    // Supervised mode: rows handed to the pipeline and rows the sink is done
+    // with, so no more than the lookahead is prepared past the layer waiting
+    // for the operator.
+    std::mutex windowMutex;
+    std::condition_variable windowSpace;
+    size_t rowsEmitted = 0;
+    size_t rowsDone = 0;
+    PipelineStages stages;
+    stages.parse = [&](const std::function<bool(LayerTask &&task)> &emit)
+    {
+        uint64_t rowStart = startOffset;
+        readLayers(csvFileName, options.parseThreads, csvSource, firstRow, startOffset,
+                   [&](int rowNumber, uint64_t endOffset, Layer *layer, const std::string &error)
+                   {
+                       if (g_shutdownRequested)
+                       {
+                           log->info("Shutdown requested. Exiting print job.");
+                           return false;
+                       }
+                       if (rowStart >= rangeEndOffset)
+                           return false;
+                       rowStart = endOffset;
+                       LayerTask task;
+                       task.rowNumber = rowNumber;
+                       task.endOffset = endOffset;
+                       // Rows outside the range still pass through, so replay mode sees every row in order.
+                       if (std::binary_search(resumedRows.begin(), resumedRows.end(), rowNumber) ||
+                           !inLayerRange(layer))
+                           task.status = LayerTask::SKIPPED;
+                       else if (layer)
+                           task.layer = std::move(*layer);
+                       else
+                       {
+                           task.status = LayerTask::DECODE_FAILED;
+                           task.error = error;
+                       }
+                       if (mode == SUPERVISED)
+                       {
+                           std::unique_lock<std::mutex> lock(windowMutex);
+                           // Woken when the sink finishes a row or ends the job; the
+                           // timeout catches a shutdown.
+                           while (rowsEmitted - rowsDone > options.lookahead && !pipeline.cancelled() &&
+                                  !g_shutdownRequested)
+                               windowSpace.wait_for(lock, std::chrono::milliseconds(100));
+                           rowsEmitted++;
+                       }
+                       return emit(std::move(task));
+                   });
+    };
+    stages.validate = [this](const Layer &layer, std::string &errorMsg)
+    {
+        return validateLayer(layer, errorMsg);
+    };
+    stages.write = [this](const Layer &layer, std::function<void(bool written)> onWritten)
+    {
+        writeLayerData(layer, std::move(onWritten));
+    };
+    bool spool = spoolsImages(imageCache.get());
+    stages.download = [this, &imagePath, spool](LayerTask &task, DownloadEngine::Completion onComplete)
+    {
+        const Layer &layer = task.layer;
+        std::string destinationPath = stager ? stager->stagedPath("images", layer.layerNumber, layer.fileName)
+                                             : (imagePath / layer.fileName).string();
+        DownloadRequest request;
+        request.url = layer.imageUrl;
+        request.destinationPath = destinationPath;
+        request.layerNumber = layer.layerNumber;
+        if (spool)
+            request.memory = &task.image.emplace();
+        if (Trace::enabled())
         {
-            layer.infillDensity = std::stoi(row[7]);
+            // From submission until the engine or the cache reports back.
+            onComplete = [traceStart = Trace::now(), layerNumber = layer.layerNumber,
+                          onComplete = std::move(onComplete)](const DownloadResult &result)
+            {
+                const char *outcome = result.cancelled ? "cancelled"
+                                      : !result.success ? "failed"
+                                      : result.fromCache ? "cached"
+                                                         : "ok";
+                Trace::record("download", traceStart, layerNumber, result.bytes, outcome);
+                onComplete(result);
+            };
         }
-        catch (...)
+        if (imageCache)
+            imageCache->fetch(layer.imageUrl, destinationPath, std::move(onComplete), layer.layerNumber);
+        else
+            downloadEngine->submit(std::move(request), std::move(onComplete));
+    };
+    ReplayClock clock(options.replaySpeed);
+    // Replay and supervised mode publish layers in file order; tasks that arrive early wait here.
+    std::map<int, LayerTask> arrived;
+    int nextRow = firstRow;
+    // Supervised mode: set once the operator ends the job; layers prepared
+    // after that are dropped with the staging directory.
+    bool ended = false;
+    size_t discarded = 0;
+    stages.sink = [&](LayerTask &task)
+    {
+        if (!stager)
         {
-            totalErrors++;
-            continue;
+            recordTask(task);
+            return;
         }
-        layer.infillPattern = row[8];
-        try
+        arrived.emplace(task.rowNumber, std::move(task));
+        for (auto it = arrived.begin(); it != arrived.end() && it->first == nextRow; it = arrived.erase(it), ++nextRow)
         {
-            layer.shellThickness = std::stoi(row[9]);
+            if (mode == REPLAY)
+            {
+                replayTask(it->second, clock);
+                continue;
+            }
+            if (ended)
+            {
+                discarded++;
+            }
+            else if (!superviseTask(it->second))
+            {
+                ended = true;
+                pipeline.cancel();
+            }
+            std::lock_guard<std::mutex> lock(windowMutex);
+            rowsDone++;
+            windowSpace.notify_all();
         }
-        catch (...)
+    };
+    if (mode == REPLAY)
+    {
+        log->info("Replaying at {}x speed.", options.replaySpeed);
+        clock.start();
+    }
+    pipeline.run(stages);
+
+    if (mode == SUPERVISED)
+    {
+        discarded += arrived.size();
+        if (discarded > 0)
+            log->info("Discarded {} layers prepared ahead.", discarded);
+        stager.reset();
+    }
+    else if (stager)
+    {
+        // Rows after a gap left by the shutdown.
+        for (auto &entry : arrived)
+            replayTask(entry.second, clock);
+        const RunningStat &lag = clock.lag();
+        log->info("Replay: {} s of print time in {:.1f} s; {} layers published {:.3f} ms late on average, {:.3f} ms at most.",
+                  clock.scheduledSeconds(), clock.elapsedSeconds(), lag.count(), lag.mean(), lag.max());
+        stager.reset();
+    }
+
+    if (options.checkpointEvery > 0)
+        saveCheckpoint();
+    if (totalCancelled > 0)
+        log->warn("{} layers were discarded by the shutdown.", totalCancelled);
+}
+
+std::string FakePrinter::checkpointPath() const
+{
+    return (fs::path(destFolder) / printName / "checkpoint").string();
+}
+
+bool FakePrinter::restoreCheckpoint(const std::string &csvFileName)
+{
+    if (options.checkpointEvery == 0)
+        return true;
+    std::string path = checkpointPath();
+    if (!options.resume || !fs::exists(path))
+    {
+        if (options.resume)
+            log->info("No checkpoint at {}; starting from the first row.", path);
+        if (checkpoint.csv.describe(csvFileName, false))
+            return true;
+        log->error("Cannot read the size of {}. Exiting.", csvFileName);
+        return false;
+    }
+
+    if (!checkpoint.load(path))
+    {
+        log->error("Checkpoint {} is damaged; remove it to start the job over.", path);
+        return false;
+    }
+    if (!checkpoint.sameCsv(csvFileName))
+    {
+        log->error("{} has changed since checkpoint {} was saved; remove the checkpoint to start the job over.",
+                   csvFileName, path);
+        return false;
+    }
+    totalLayersPrinted = checkpoint.layersPrinted;
+    totalErrors = checkpoint.errors;
+    statistics = checkpoint.statistics;
+    watermark.reset(checkpoint.nextRow, checkpoint.offset);
+    resumedRows = checkpoint.rowsDone;
+    log->info("Resuming at row {} (byte {}): {} layers printed and {} errors so far.", checkpoint.nextRow,
+              checkpoint.offset, totalLayersPrinted, totalErrors);
+    return true;
+}
+
+bool FakePrinter::seekLayerRange(const std::string &csvFileName)
+{
+    if (!options.layerRange())
+        return true;
+    int fromLayer = static_cast<int>(std::max(1u, options.fromLayer));
+    int toLayer = options.toLayer > 0 ? static_cast<int>(options.toLayer) : INT_MAX;
+    log->info("Printing layers {} to {}, every {}.", fromLayer,
+              options.toLayer > 0 ? std::to_string(toLayer) : std::string("the end"), options.everyLayer);
+    // Streams cannot seek, and a growing file would outdate the index at once.
+    if (csvSource.follow || !csvSource.copyTo.empty() || isStreamLocation(csvFileName))
+        return true;
+
+    LayerIndex index;
+    if (!loadLayerIndex(csvFileName, options.parseThreads, index))
+        return false;
+    const LayerIndexEntry &entry = index.seek(fromLayer);
+    rangeEndOffset = index.endOffset(toLayer);
+    watermark.reset(entry.rowNumber, entry.offset);
+    log->info("Starting at row {} (byte {}).", entry.rowNumber, entry.offset);
+    return true;
+}
+
+bool FakePrinter::inLayerRange(const Layer *layer) const
+{
+    if (!options.layerRange())
+        return true;
+    // Rows without a valid layer number belong to no range.
+    if (!layer || layer->layerNumber <= 0)
+        return false;
+    unsigned number = static_cast<unsigned>(layer->layerNumber);
+    unsigned fromLayer = std::max(1u, options.fromLayer);
+    return number >= fromLayer && (options.toLayer == 0 || number <= options.toLayer) &&
+           (number - fromLayer) % options.everyLayer == 0;
+}
+
+void FakePrinter::saveCheckpoint()
+{
+    checkpoint.offset = watermark.offset();
+    checkpoint.nextRow = watermark.nextRow();
+    // Rows the resumed job skips but has not reached yet are still done.
+    std::vector<int> ahead = watermark.rowsAhead();
+    auto unreached = std::lower_bound(resumedRows.begin(), resumedRows.end(), checkpoint.nextRow);
+    checkpoint.rowsDone.clear();
+    std::set_union(ahead.begin(), ahead.end(), unreached, resumedRows.end(), std::back_inserter(checkpoint.rowsDone));
+    checkpoint.layersPrinted = totalLayersPrinted;
+    checkpoint.errors = totalErrors;
+    checkpoint.statistics = statistics;
+    if (checkpoint.save(checkpointPath()))
+        log->debug("Checkpoint saved: row {}, byte {}, {} rows done ahead.", checkpoint.nextRow, checkpoint.offset,
+                   checkpoint.rowsDone.size());
+    sinceCheckpoint = 0;
+}
+
+bool FakePrinter::startSlices(const SharedJobResources &resources)
+{
+    shared = resources;
+    if (shared.logger)
+        log = shared.logger;
+    if (!prepareOutputDirectory())
+    {
+        log->error("Error preparing output directory. Exiting.");
+        return false;
+    }
+    return openPack();
+}
+
+bool FakePrinter::runSlice(size_t maxLayers, const std::function<void()> &resume)
+{
+    bool stopping = g_shutdownRequested;
+    for (size_t i = 0; i < slice.size(); ++i)
+    {
+        LayerTask &task = slice[i];
+        // Downloads cut short by the shutdown.
+        if (stopping && task.status == LayerTask::DOWNLOAD_FAILED)
+            task.status = LayerTask::CANCELLED;
+        if (sliceWriteFailed[i] && task.status != LayerTask::CANCELLED)
+            task.status = LayerTask::WRITE_FAILED;
+        recordTask(task);
+    }
+    slice.clear();
+
+    const LayerDataset &dataset = *shared.dataset;
+    if (stopping)
+    {
+        log->info("Shutdown requested. Exiting print job.");
+        return false;
+    }
+
+    // Holds one extra count while writes and downloads are submitted, so
+    // 'resume' cannot run before the last one has started. Write completions
+    // find their task by index, so neither vector may grow past its reserve.
+    slicePending.store(1, std::memory_order_relaxed);
+    slice.reserve(maxLayers);
+    sliceWriteFailed.assign(maxLayers, 0);
+    auto finished = [this, resume]
+    {
+        if (slicePending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            resume();
+    };
+    while (slice.size() < maxLayers && nextDatasetRow < dataset.size())
+    {
+        size_t index = slice.size();
+        slice.emplace_back();
+        LayerTask &task = slice.back();
+        if (!dataset.read(nextDatasetRow++, task.rowNumber, task.layer, task.error))
         {
-            totalErrors++;
+            task.status = LayerTask::DECODE_FAILED;
             continue;
         }
-        try
-        {
-            layer.overhangAngle = std::stoi(row[10]);
-        }
-        catch (...)
-        {
-            totalErrors++;
+        std::string errorMsg;
+        if (!validateLayer(task.layer, errorMsg))
+            task.validationError = errorMsg;
+        slicePending.fetch_add(1, std::memory_order_relaxed);
+        writeLayerData(task.layer, [this, index, finished](bool written)
+                       {
+                           if (!written)
+                               sliceWriteFailed[index] = 1;
+                           finished();
+                       });
+    }
+    if (slice.empty())
+        return false;
+
+    fs::path imagePath = fs::path(destFolder) / printName / "images";
+    for (LayerTask &task : slice)
+    {
+        if (task.status != LayerTask::PENDING)
             continue;
-        }
-        try
+        slicePending.fetch_add(1, std::memory_order_relaxed);
+        auto onComplete = [&task, finished](const DownloadResult &result)
         {
-            layer.coolingFanSpeed = std::stoi(row[11]);
-        }
-        catch (...)
-        {
-            totalErrors++;
-            continue;
-        }
-        layer.retractionSettings = row[12];
-        try
+            if (result.success)
+            {
+                task.status = LayerTask::PRINTED;
+            }
+            else
+            {
+                task.status = result.cancelled ? LayerTask::CANCELLED : LayerTask::DOWNLOAD_FAILED;
+                task.error = result.error;
+            }
+            finished();
+        };
+        std::string destinationPath = (imagePath / task.layer.fileName).string();
+        DownloadRequest request;
+        request.url = task.layer.imageUrl;
+        request.destinationPath = destinationPath;
+        request.layerNumber = task.layer.layerNumber;
+        if (spoolsImages(shared.cache))
+            request.memory = &task.image.emplace();
+        if (shared.cache)
+            shared.cache->fetch(task.layer.imageUrl, destinationPath, std::move(onComplete), task.layer.layerNumber);
+        else
+            shared.engine->submit(std::move(request), std::move(onComplete));
+    }
+    finished();
+    return true;
+}
+
+void FakePrinter::finishSlices()
+{
+    if (totalCancelled > 0)
+        log->warn("{} layers were discarded by the shutdown.", totalCancelled);
+    if (pack && !pack->close())
+        log->error("Failed to finish the pack file.");
+    printSummary();
+}
+
+void FakePrinter::replayTask(LayerTask &task, ReplayClock &clock)
+{
+    if (task.status == LayerTask::PRINTED)
+    {
+        ReplayClock::Clock::time_point deadline = clock.advance(task.layer.layerTimeSeconds);
+        if (!clock.waitUntil(deadline, g_shutdownRequested))
         {
-            layer.zOffsetAdjustment = std::stod(row[13]);
+            task.status = LayerTask::CANCELLED;
         }
-        catch (...)
+        else if (!publishLayer(task.layer))
         {
-            totalErrors++;
-            continue;
+            task.status = LayerTask::WRITE_FAILED;
         }
-        try
+        else
         {
-            layer.printBedTemperature = std::stoi(row[14]);
+            ReplayClock::Clock::time_point published = ReplayClock::Clock::now();
+            clock.recordLag(deadline, published);
+            log->debug("Layer {} published {:.3f} ms after its deadline.", task.layer.layerNumber,
+                       std::chrono::duration<double, std::milli>(published - deadline).count());
         }
-        catch (...)
+    }
+    recordTask(task);
+}
+
+void FakePrinter::recordPrinted(const Layer &layer)
+{
+    totalLayersPrinted++;
+    if (options.keepLayers)
+        printedLayers.append(layer);
+    else
+        statistics.addLayer(layer);
+    log->info("Layer {} printed successfully.", layer.layerNumber);
+}
+
+void FakePrinter::recordTask(LayerTask &task)
+{
+    const Layer &layer = task.layer;
+    bool discarded = task.status == LayerTask::CANCELLED || task.status == LayerTask::PENDING;
+    // A discarded layer is printed again by a resumed job, which reports the error then.
+    if (!task.validationError.empty() && !discarded)
+    {
+        log->error("Error in layer {}: {}. Continuing automatically.", layer.layerNumber, task.validationError);
+        totalErrors++;
+    }
+    switch (task.status)
+    {
+    case LayerTask::PRINTED:
+        if (!packImage(layer, task.image ? &*task.image : nullptr))
         {
+            log->error("Failed to process layer {}.", layer.layerNumber);
             totalErrors++;
-            continue;
+            break;
         }
-        layer.layerTime = row[15];
-        layer.fileName = row[16];
-        layer.imageUrl = row[17];
+        recordPrinted(task.layer);
+        break;
+    case LayerTask::DECODE_FAILED:
+        log->error("{}", task.error);
+        totalErrors++;
+        break;
+    case LayerTask::DOWNLOAD_FAILED:
+        log->error("Failed to download image for layer {}", layer.layerNumber);
+        log->error("Failed to process layer {}.", layer.layerNumber);
+        totalErrors++;
+        break;
+    case LayerTask::WRITE_FAILED:
+        log->error("Failed to process layer {}.", layer.layerNumber);
+        totalErrors++;
+        break;
+    case LayerTask::CANCELLED:
+    case LayerTask::PENDING:
+        totalCancelled++;
+        break;
+    case LayerTask::SKIPPED:
+        break;
+    }
 
-        std::string errorMsg;
-        if (!validateLayer(layer, errorMsg))
+    if (options.checkpointEvery > 0 && !discarded)
+    {
+        watermark.markDone(task.rowNumber, task.endOffset);
+        if (task.status != LayerTask::SKIPPED && ++sinceCheckpoint >= options.checkpointEvery)
+            saveCheckpoint();
+    }
+}
+
+bool FakePrinter::superviseTask(LayerTask &task)
+{
+    const Layer &layer = task.layer;
+    switch (task.status)
+    {
+    case LayerTask::SKIPPED:
+    case LayerTask::DECODE_FAILED:
+        recordTask(task);
+        return true;
+    case LayerTask::CANCELLED:
+    case LayerTask::PENDING:
+        // Only a shutdown cancels tasks before the job has ended.
+        return false;
+    default:
+        break;
+    }
+
+    if (!task.validationError.empty())
+    {
+        totalErrors++;
+        log->error("Error in layer {}: {}", layer.layerNumber, task.validationError);
+        log->info("Type 'i' to ignore or 'e' to end the FakePrint: ");
+        std::string userInput;
+        if (!awaitCommand(userInput))
+            return false;
+        if (userInput == "e" || userInput == "E")
         {
-            totalErrors++;
-            if (mode == SUPERVISED)
-            {
-                spdlog::error("Error in layer {}: {}", layer.layerNumber, errorMsg);
-                spdlog::info("Type 'i' to ignore or 'e' to end the FakePrint: ");
-                std::atomic<bool> inputReceived(false);
-                std::string userInput;
-                std::thread inputThread(userInputListener, std::ref(inputReceived), std::ref(userInput));
-
-                // Polling loop to check for shutdown requests
-                while (!inputReceived)
-                {
-                    if (g_shutdownRequested)
-                    {
-                        spdlog::warn("Shutdown requested. Exiting supervised mode.");
-                        break;
-                    }
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Avoid busy waiting
-                }
-
-                // Clean up input thread if still running
-                if (inputThread.joinable())
-                {
-                    inputThread.detach(); // Prevent blocking
-                }
-
-                if (g_shutdownRequested)
-                {
-                    spdlog::warn("Shutdown requested. Exiting FakePrint.");
-                    break;
-                }
-                if (userInput == "e" || userInput == "E")
-                {
-                    spdlog::info("Ending FakePrint.");
-                    break;
-                }
-                else
-                {
-                    spdlog::info("Ignoring error and continuing.");
-                }
-            }
-            else
-            {
-                spdlog::error("Error in layer {}: {}. Continuing automatically.", layer.layerNumber, errorMsg);
-            }
+            log->info("Ending FakePrint.");
+            return false;
         }
+        log->info("Ignoring error and continuing.");
+        // Counted here; recordTask() would report it again.
+        task.validationError.clear();
+    }
+
+    log->info("Press <return> to print layer {}...", layer.layerNumber);
+    std::string userInput;
+    if (!awaitCommand(userInput))
+        return false;
+    if (task.status == LayerTask::PRINTED && !publishLayer(layer))
+        task.status = LayerTask::WRITE_FAILED;
+    recordTask(task);
+    return true;
+}
+
+bool FakePrinter::awaitCommand(std::string &command)
+{
+    TraceSpan span("prompt");
+    if (input->nextLine(command))
+        return true;
+    log->warn("Shutdown requested. Exiting supervised mode.");
+    log->warn("Shutdown requested. Exiting FakePrint.");
+    return false;
+}
+
+bool FakePrinter::handleRow(Layer *decoded, const std::string &decodeError)
+{
+    if (!decoded)
+    {
+        log->error("{}", decodeError);
+        totalErrors++;
+        return true;
+    }
+    const Layer &layer = *decoded;
 
+    std::string errorMsg;
+    if (!validateLayer(layer, errorMsg))
+    {
+        totalErrors++;
         if (mode == SUPERVISED)
         {
-            spdlog::info("Press <return> to print layer {}...", layer.layerNumber);
-            std::atomic<bool> inputReceived(false);
+            log->error("Error in layer {}: {}", layer.layerNumber, errorMsg);
+            log->info("Type 'i' to ignore or 'e' to end the FakePrint: ");
             std::string userInput;
-            std::thread inputThread(userInputListener, std::ref(inputReceived), std::ref(userInput));
-
-            // Polling loop to check for shutdown requests
-            while (!inputReceived)
-            {
-                if (g_shutdownRequested)
-                {
-                    spdlog::warn("Shutdown requested. Exiting supervised mode.");
-                    break;
-                }
-                std::this_thread::sleep_for(std::chrono::milliseconds(100)); // Avoid busy waiting
-            }
-
-            // Clean up input thread if still running
-            if (inputThread.joinable())
+            if (!awaitCommand(userInput))
+                return false;
+            if (userInput == "e" || userInput == "E")
             {
-                inputThread.detach(); // Prevent blocking
+                log->info("Ending FakePrint.");
+                return false;
             }
-
-            if (g_shutdownRequested)
+            else
             {
-                spdlog::warn("Shutdown requested. Exiting FakePrint.");
-                break;
+                log->info("Ignoring error and continuing.");
             }
         }
-
-        if (processLayer(layer))
-        {
-            totalLayersPrinted++;
-            layers.push_back(layer);
-            spdlog::info("Layer {} printed successfully.", layer.layerNumber);
-        }
         else
         {
-            spdlog::error("Failed to process layer {}.", layer.layerNumber);
-            totalErrors++;
+            log->error("Error in layer {}: {}. Continuing automatically.", layer.layerNumber, errorMsg);
         }
     }
-    printSummary();
+
+    if (mode == SUPERVISED)
+    {
+        log->info("Press <return> to print layer {}...", layer.layerNumber);
+        std::string userInput;
+        if (!awaitCommand(userInput))
+            return false;
+    }
+
+    if (processLayer(layer))
+    {
+        recordPrinted(layer);
+    }
+    else
+    {
+        log->error("Failed to process layer {}.", layer.layerNumber);
+        totalErrors++;
+    }
+    return true;
 }
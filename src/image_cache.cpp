@@ -0,0 +1,645 @@
+#include "image_cache.h"
+#include "binary_io.h"
+#include "curl_common.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <utility>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include "spdlog/spdlog.h"
+
+namespace fs = std::filesystem;
+
+// Creates (or replaces) the file at 'path' holding 'data'.
+static bool writeFile(const std::string &path, std::string_view data)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = true;
+    while (ok && !data.empty())
+    {
+        ssize_t n = ::write(fd, data.data(), data.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        if (ok)
+            data.remove_prefix(static_cast<size_t>(n));
+    }
+    ok = ::close(fd) == 0 && ok;
+    if (!ok)
+        ::unlink(path.c_str());
+    return ok;
+}
+
+// Places a cached blob at 'destination', replacing whatever is there.
+static bool linkBlob(const fs::path &blob, const fs::path &destination)
+{
+    std::error_code ec;
+    fs::remove(destination, ec);
+
+#ifdef FICLONE
+    // A reflink shares the blob's extents copy-on-write, so it is as cheap as
+    // a hard link but later edits to the job's copy never reach the cache.
+    int source = ::open(blob.c_str(), O_RDONLY | O_CLOEXEC);
+    if (source >= 0)
+    {
+        int target = ::open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        bool cloned = target >= 0 && ::ioctl(target, FICLONE, source) == 0;
+        if (target >= 0)
+            ::close(target);
+        ::close(source);
+        if (cloned)
+            return true;
+        if (target >= 0)
+            fs::remove(destination, ec);
+    }
+#endif
+
+    fs::create_hard_link(blob, destination, ec);
+    if (!ec)
+        return true;
+    ec.clear();
+    fs::copy_file(blob, destination, fs::copy_options::overwrite_existing, ec);
+    return !ec;
+}
+
+// Milliseconds since the epoch: last-use times are compared between processes.
+static uint64_t nowMillis()
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+// Held around every read and write of the index: 'processMutex' keeps this
+// process's threads apart, the flock() on index.lock other processes.
+class IndexLock
+{
+public:
+    IndexLock(std::mutex &processMutex, const std::string &lockPath)
+        : guard(processMutex), fd(::open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644))
+    {
+        while (fd >= 0 && ::flock(fd, LOCK_EX) != 0)
+        {
+            if (errno != EINTR)
+            {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0)
+            spdlog::error("Failed to lock image cache index {}: {}", lockPath, std::strerror(errno));
+    }
+
+    ~IndexLock()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    IndexLock(const IndexLock &) = delete;
+    IndexLock &operator=(const IndexLock &) = delete;
+
+    bool locked() const { return fd >= 0; }
+
+private:
+    std::lock_guard<std::mutex> guard;
+    int fd;
+};
+
+// Appends one index record: url, blob, size, last used, ETag, Last-Modified.
+// Tabs and newlines would break the record; such URLs are simply not persisted.
+static void formatIndexLine(std::string &out, const std::string &url, const std::string &blob, uint64_t size,
+                            uint64_t lastUsed, const std::string &etag, const std::string &lastModified)
+{
+    if (url.find_first_of("\t\n") != std::string::npos || etag.find_first_of("\t\n") != std::string::npos ||
+        lastModified.find_first_of("\t\n") != std::string::npos)
+        return;
+    out += url + '\t' + blob + '\t' + std::to_string(size) + '\t' + std::to_string(lastUsed) + '\t' + etag + '\t' +
+           lastModified + '\n';
+}
+
+// Removes what processes that are no longer running left in tmp/. Every file
+// there is named after the process id of its writer.
+static void removeDeadTemporaries(const std::string &directory)
+{
+    std::error_code ec;
+    for (const fs::directory_entry &file : fs::directory_iterator(directory, ec))
+    {
+        long pid = std::strtol(file.path().filename().c_str(), nullptr, 10);
+        if (pid > 0 && (::kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH))
+            continue;
+        std::error_code removeError;
+        fs::remove(file.path(), removeError);
+    }
+}
+
+ImageCache::ImageCache(const ImageCacheConfig &config, DownloadEngine &engine, AsyncFileWriter *writer)
+    : config(config),
+      engine(engine),
+      writer(writer),
+      blobDirectory((fs::path(config.directory) / "blobs").string()),
+      tempDirectory((fs::path(config.directory) / "tmp").string()),
+      indexPath((fs::path(config.directory) / "index.tsv").string()),
+      lockPath((fs::path(config.directory) / "index.lock").string())
+{
+}
+
+ImageCache::~ImageCache()
+{
+    save();
+}
+
+bool ImageCache::open()
+{
+    try
+    {
+        fs::create_directories(blobDirectory);
+        fs::create_directories(tempDirectory);
+    }
+    catch (const fs::filesystem_error &e)
+    {
+        spdlog::error("Error creating image cache directory: {}", e.what());
+        return false;
+    }
+
+    removeDeadTemporaries(tempDirectory);
+    if (!save())
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    spdlog::debug("Image cache {}: {} URLs, {} blobs, {} bytes.", config.directory, entries.size(), blobs.size(),
+                  totalBytes);
+    return true;
+}
+
+bool ImageCache::save()
+{
+    IndexLock indexLock(indexMutex, lockPath);
+    if (!indexLock.locked())
+        return false;
+
+    // The index as every process sharing the cache left it. It grows by
+    // appending, so a URL may appear more than once; its latest use wins.
+    std::unordered_map<std::string, Entry> merged;
+    std::ifstream in(indexPath);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        // url, blob, size, last used, ETag, Last-Modified.
+        std::vector<std::string> fields;
+        std::istringstream columns(line);
+        std::string field;
+        while (std::getline(columns, field, '\t'))
+            fields.push_back(field);
+        fields.resize(6);
+        if (fields[0].empty() || fields[1].empty())
+            continue;
+        Entry entry;
+        try
+        {
+            entry.lastUsed = std::stoull(fields[3]);
+        }
+        catch (...)
+        {
+            continue;
+        }
+        entry.blob = fields[1];
+        entry.etag = fields[4];
+        entry.lastModified = fields[5];
+        auto [it, added] = merged.emplace(fields[0], entry);
+        if (!added && it->second.lastUsed <= entry.lastUsed)
+            it->second = entry;
+    }
+    in.close();
+
+    // What blobs/ holds, listed or not, is what counts against the cap. Blobs
+    // are only added under the index lock, so none can appear meanwhile.
+    std::unordered_map<std::string, Blob> stored;
+    std::error_code ec;
+    for (const fs::directory_entry &file : fs::directory_iterator(blobDirectory, ec))
+    {
+        struct stat st;
+        if (::stat(file.path().c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        uint64_t modified = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000 +
+                            static_cast<uint64_t>(st.st_mtim.tv_nsec) / 1000000;
+        stored.emplace(file.path().filename().string(), Blob{static_cast<uint64_t>(st.st_size), modified});
+    }
+
+    std::vector<std::string> evicted;
+    std::string text;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &[url, entry] : entries)
+        {
+            auto [it, added] = merged.emplace(url, entry);
+            if (!added && it->second.lastUsed < entry.lastUsed)
+                it->second = entry;
+            else if (!added && it->second.blob == entry.blob)
+                it->second.validated = entry.validated;
+        }
+        // Entries whose blob is gone (evicted, deleted by hand) are dropped.
+        for (auto it = merged.begin(); it != merged.end();)
+        {
+            auto blob = stored.find(it->second.blob);
+            if (blob == stored.end())
+            {
+                it = merged.erase(it);
+                continue;
+            }
+            blob->second.lastUsed = std::max(blob->second.lastUsed, it->second.lastUsed);
+            ++it;
+        }
+        totalBytes = 0;
+        for (const auto &[name, blob] : stored)
+            totalBytes += blob.size;
+
+        if (totalBytes > config.maxBytes)
+        {
+            // Evicts down to 90% of the cap, so the stores that follow do not
+            // each have to compact again.
+            uint64_t target = config.maxBytes - config.maxBytes / 10;
+            std::vector<std::pair<uint64_t, std::string>> byAge;
+            for (const auto &[name, blob] : stored)
+                byAge.emplace_back(blob.lastUsed, name);
+            std::sort(byAge.begin(), byAge.end());
+            for (const auto &[lastUsed, name] : byAge)
+            {
+                if (totalBytes <= target)
+                    break;
+                totalBytes -= stored[name].size;
+                stored.erase(name);
+                evicted.push_back(name);
+            }
+            counters.evicted += evicted.size();
+            std::unordered_set<std::string> gone(evicted.begin(), evicted.end());
+            for (auto it = merged.begin(); it != merged.end();)
+            {
+                if (gone.count(it->second.blob))
+                    it = merged.erase(it);
+                else
+                    ++it;
+            }
+        }
+        for (const auto &[url, entry] : merged)
+            formatIndexLine(text, url, entry.blob, stored[entry.blob].size, entry.lastUsed, entry.etag,
+                            entry.lastModified);
+        entries = std::move(merged);
+        blobs = std::move(stored);
+    }
+
+    for (const std::string &name : evicted)
+        fs::remove(fs::path(blobDirectory) / name, ec);
+
+    // Other processes sharing the cache see either the old index or the new one.
+    std::string tempPath = (fs::path(tempDirectory) / (std::to_string(::getpid()) + ".index")).string();
+    if (!writeFile(tempPath, text))
+    {
+        spdlog::error("Failed to write image cache index: {}", tempPath);
+        return false;
+    }
+    fs::rename(tempPath, indexPath, ec);
+    if (ec)
+    {
+        spdlog::error("Failed to replace image cache index: {}", ec.message());
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    return true;
+}
+
+ImageCacheStats ImageCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return counters;
+}
+
+uint64_t ImageCache::touch()
+{
+    clock = std::max(clock + 1, nowMillis());
+    return clock;
+}
+
+void ImageCache::appendIndex(const std::string &url, const Entry &entry, uint64_t size)
+{
+    std::string line;
+    formatIndexLine(line, url, entry.blob, size, entry.lastUsed, entry.etag, entry.lastModified);
+    if (line.empty())
+        return;
+    int fd = ::open(indexPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    bool ok = fd >= 0;
+    if (ok)
+    {
+        ssize_t n;
+        while ((n = ::write(fd, line.data(), line.size())) < 0 && errno == EINTR)
+        {
+        }
+        ok = n == static_cast<ssize_t>(line.size());
+        ok = ::close(fd) == 0 && ok;
+    }
+    if (!ok)
+        spdlog::warn("Failed to append to image cache index {}: {}", indexPath, std::strerror(errno));
+}
+
+void ImageCache::fetch(const std::string &rawUrl, const std::string &destinationPath,
+                       DownloadEngine::Completion onComplete, int layerNumber)
+{
+    std::string url = trim(rawUrl);
+    DownloadRequest request;
+    request.url = url;
+    request.layerNumber = layerNumber;
+    Entry hit;
+    uint64_t hitSize = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto pending = inFlight.find(url);
+        if (pending != inFlight.end())
+        {
+            pending->second.push_back(Waiter{destinationPath, std::move(onComplete)});
+            return;
+        }
+
+        // An entry whose blob has gone (evicted, deleted by hand) is fetched
+        // unconditionally and re-stored.
+        auto it = entries.find(url);
+        auto blob = it != entries.end() ? blobs.find(it->second.blob) : blobs.end();
+        bool stored = blob != blobs.end();
+        if (stored && it->second.validated)
+        {
+            it->second.lastUsed = touch();
+            blob->second.lastUsed = it->second.lastUsed;
+            hit = it->second;
+            hitSize = blob->second.size;
+        }
+        else
+        {
+            if (stored)
+            {
+                request.etag = it->second.etag;
+                request.lastModified = it->second.lastModified;
+            }
+            inFlight[url].push_back(Waiter{destinationPath, std::move(onComplete)});
+        }
+    }
+
+    if (!hit.blob.empty())
+    {
+        placeHit(url, hit, hitSize, destinationPath, std::move(onComplete), layerNumber);
+        return;
+    }
+    // The body is hashed in memory and only written to disk if the cache
+    // does not hold it yet.
+    auto body = std::make_shared<std::string>();
+    request.memory = body.get();
+    engine.submit(std::move(request), [this, url, body](const DownloadResult &result)
+                  { finishFetch(url, body, result); });
+}
+
+void ImageCache::placeHit(const std::string &url, const Entry &entry, uint64_t size,
+                          const std::string &destinationPath, DownloadEngine::Completion onComplete, int layerNumber)
+{
+    fs::path blobPath = fs::path(blobDirectory) / entry.blob;
+    DownloadResult hit;
+    hit.fromCache = true;
+    hit.bytes = size;
+    hit.success = linkBlob(blobPath, destinationPath);
+    if (hit.success)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.hits++;
+        }
+        IndexLock indexLock(indexMutex, lockPath);
+        if (indexLock.locked())
+            appendIndex(url, entry, size);
+    }
+    else
+    {
+        std::error_code ec;
+        if (!fs::exists(blobPath, ec) && !ec)
+        {
+            // Deleted behind the cache's back: forget it and download it again.
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = entries.find(url);
+                if (it != entries.end() && it->second.blob == entry.blob)
+                    entries.erase(it);
+                auto blob = blobs.find(entry.blob);
+                if (blob != blobs.end())
+                {
+                    totalBytes -= blob->second.size;
+                    blobs.erase(blob);
+                }
+            }
+            fetch(url, destinationPath, std::move(onComplete), layerNumber);
+            return;
+        }
+        hit.error = "Failed to place cached image at " + destinationPath;
+    }
+    if (onComplete)
+        onComplete(hit);
+}
+
+void ImageCache::finishFetch(const std::string &url, const std::shared_ptr<std::string> &body,
+                             const DownloadResult &result)
+{
+    bool cacheable = result.success && (result.httpStatus == 0 || result.httpStatus / 100 == 2);
+    if (!cacheable)
+    {
+        storeFetch(url, *body, result, std::string(), std::string());
+        return;
+    }
+
+    // Hash and write a new blob outside the lock, into a temporary file that
+    // belongs to this transfer alone.
+    char name[48];
+    std::snprintf(name, sizeof(name), "%016llx-%llu", static_cast<unsigned long long>(fnv1a(*body)),
+                  static_cast<unsigned long long>(body->size()));
+    std::string blobName = name;
+    std::string tempPath;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!blobs.count(blobName))
+            tempPath = (fs::path(tempDirectory) / (std::to_string(::getpid()) + "." + std::to_string(++tempCounter)))
+                           .string();
+    }
+    if (tempPath.empty())
+    {
+        storeFetch(url, *body, result, blobName, tempPath);
+        return;
+    }
+    if (writer)
+    {
+        writer->submit(tempPath, body, [this, url, body, result, blobName, tempPath](int error)
+                       {
+                           if (error != 0)
+                               spdlog::warn("Failed to store {} in the image cache: {}", url, std::strerror(error));
+                           storeFetch(url, *body, result, error == 0 ? blobName : std::string(),
+                                      error == 0 ? tempPath : std::string());
+                       });
+        return;
+    }
+    if (!writeFile(tempPath, *body))
+    {
+        spdlog::warn("Failed to store {} in the image cache.", url);
+        blobName.clear();
+        tempPath.clear();
+    }
+    storeFetch(url, *body, result, blobName, tempPath);
+}
+
+void ImageCache::storeFetch(const std::string &url, const std::string &body, const DownloadResult &result,
+                            const std::string &blobName, const std::string &tempPath)
+{
+    bool notModified = result.success && result.httpStatus == 304;
+    bool cacheable = !blobName.empty();
+
+    std::vector<Waiter> waiters;
+    std::string placeBlob;
+    uint64_t placeSize = 0;
+    bool overCap = false;
+    {
+        // New blobs are renamed into place and listed under the index lock, so
+        // a compaction sees either both or neither.
+        IndexLock indexLock(indexMutex, lockPath);
+        bool added = false;
+        bool duplicate = false;
+        if (!notModified && cacheable && indexLock.locked())
+        {
+            std::error_code ec;
+            fs::path blobPath = fs::path(blobDirectory) / blobName;
+            if (fs::exists(blobPath, ec))
+            {
+                // Already stored, or stored by another transfer since the check above.
+                duplicate = true;
+            }
+            else if (!tempPath.empty())
+            {
+                fs::rename(tempPath, blobPath, ec);
+                // Blobs may be hard-linked into jobs; keep them from being edited in place.
+                if (!ec)
+                    fs::permissions(blobPath, fs::perms::owner_read | fs::perms::group_read | fs::perms::others_read,
+                                    ec);
+                added = !ec;
+            }
+        }
+        if (!tempPath.empty() && !added)
+        {
+            std::error_code ec;
+            fs::remove(tempPath, ec);
+        }
+
+        Entry placed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            waiters = std::move(inFlight[url]);
+            inFlight.erase(url);
+
+            if (notModified)
+            {
+                auto it = entries.find(url);
+                if (it != entries.end() && blobs.count(it->second.blob))
+                {
+                    Entry &entry = it->second;
+                    entry.validated = true;
+                    if (!result.etag.empty())
+                        entry.etag = result.etag;
+                    if (!result.lastModified.empty())
+                        entry.lastModified = result.lastModified;
+                    placeBlob = entry.blob;
+                    counters.revalidated++;
+                }
+            }
+            else if (added || duplicate)
+            {
+                if (blobs.emplace(blobName, Blob{body.size(), 0}).second)
+                    totalBytes += body.size();
+                Entry &entry = entries[url];
+                entry.blob = blobName;
+                entry.etag = result.etag;
+                entry.lastModified = result.lastModified;
+                entry.validated = true;
+                placeBlob = blobName;
+                if (added)
+                    counters.fetched++;
+                else
+                    counters.deduplicated++;
+            }
+            if (!notModified && cacheable)
+                counters.bytesDownloaded += body.size();
+
+            if (!placeBlob.empty())
+            {
+                Entry &entry = entries[url];
+                Blob &blob = blobs[placeBlob];
+                entry.lastUsed = touch();
+                blob.lastUsed = entry.lastUsed;
+                placed = entry;
+                placeSize = blob.size;
+                overCap = totalBytes > config.maxBytes;
+            }
+        }
+        if (!placeBlob.empty() && indexLock.locked())
+            appendIndex(url, placed, placeSize);
+    }
+
+    // Placing the image is file work, done outside every lock.
+    size_t joined = 0;
+    std::vector<std::pair<DownloadEngine::Completion, DownloadResult>> completions;
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        Waiter &waiter = waiters[i];
+        DownloadResult waiterResult = result;
+        if (!placeBlob.empty())
+        {
+            waiterResult.bytes = placeSize;
+            waiterResult.success = linkBlob(fs::path(blobDirectory) / placeBlob, waiter.destinationPath);
+            if (!waiterResult.success)
+                waiterResult.error = "Failed to place cached image at " + waiter.destinationPath;
+            else if (i > 0)
+                joined++; // Joined another layer's transfer.
+        }
+        else if (notModified)
+        {
+            // The blob was evicted while the request was in flight.
+            waiterResult.success = false;
+            waiterResult.error = "Cached image was evicted during revalidation.";
+        }
+        else if (result.success)
+        {
+            // Not cacheable (the blob could not be written, say): hand over
+            // the body as it came, like an uncached download.
+            if (!writeFile(waiter.destinationPath, body))
+            {
+                waiterResult.success = false;
+                waiterResult.error = "Failed to place image at " + waiter.destinationPath;
+            }
+        }
+        completions.emplace_back(std::move(waiter.onComplete), std::move(waiterResult));
+    }
+    if (joined > 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.hits += joined;
+    }
+
+    for (auto &[onComplete, waiterResult] : completions)
+    {
+        if (onComplete)
+            onComplete(waiterResult);
+    }
+    if (overCap)
+        save();
+}
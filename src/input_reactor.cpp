@@ -0,0 +1,154 @@
+#include "input_reactor.h"
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Write end of the running reactor's wake-up pipe, for interrupt().
+static std::atomic<int> activeWakeFd{-1};
+
+InputReactor::InputReactor(int fd) : fd(fd)
+{
+}
+
+InputReactor::~InputReactor()
+{
+    if (reader.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        char byte = 0;
+        while (write(wakePipe[1], &byte, 1) < 0 && errno == EINTR)
+        {
+        }
+        reader.join();
+    }
+    int expected = wakePipe[1];
+    activeWakeFd.compare_exchange_strong(expected, -1);
+    for (int end : wakePipe)
+    {
+        if (end >= 0)
+            close(end);
+    }
+    if (ownsFd && fd >= 0)
+        close(fd);
+}
+
+bool InputReactor::start()
+{
+    if (pipe2(wakePipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        return false;
+    activeWakeFd = wakePipe[1];
+    reader = std::thread(&InputReactor::readLoop, this);
+    return true;
+}
+
+bool InputReactor::open(const std::string &path)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ownsFd = true;
+    return start();
+}
+
+bool InputReactor::nextLine(std::string &line)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this]
+               { return interrupted || ended || !lines.empty(); });
+    if (interrupted)
+        return false;
+    if (lines.empty())
+    {
+        line.clear();
+        return true;
+    }
+    line = std::move(lines.front());
+    lines.pop_front();
+    return true;
+}
+
+void InputReactor::interrupt()
+{
+    int wakeFd = activeWakeFd.load();
+    if (wakeFd < 0)
+        return;
+    char byte = 0;
+    ssize_t ignored = write(wakeFd, &byte, 1);
+    (void)ignored;
+}
+
+void InputReactor::readLoop()
+{
+    std::string partial;
+    char buffer[4096];
+    bool inputOpen = true;
+    for (;;)
+    {
+        pollfd fds[2] = {{wakePipe[0], POLLIN, 0}, {fd, POLLIN, 0}};
+        // Once the input has ended, only the wake-up pipe is left to wait for.
+        if (poll(fds, inputOpen ? 2 : 1, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::lock_guard<std::mutex> lock(mutex);
+            inputOpen = false;
+            ended = true;
+            ready.notify_all();
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            while (read(wakePipe[0], buffer, sizeof(buffer)) > 0)
+            {
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping)
+                return;
+            interrupted = true;
+            ready.notify_all();
+            continue;
+        }
+
+        if (!inputOpen || fds[1].revents == 0)
+            continue;
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (got <= 0)
+        {
+            // A last line without a line break still counts.
+            if (!partial.empty() && partial.back() == '\r')
+                partial.pop_back();
+            if (!partial.empty())
+                lines.push_back(std::move(partial));
+            inputOpen = false;
+            ended = true;
+            ready.notify_all();
+            continue;
+        }
+        size_t queued = lines.size();
+        for (ssize_t i = 0; i < got; i++)
+        {
+            if (buffer[i] != '\n')
+            {
+                partial += buffer[i];
+                continue;
+            }
+            // Lines from a script written on Windows end in "\r\n".
+            if (!partial.empty() && partial.back() == '\r')
+                partial.pop_back();
+            lines.push_back(std::move(partial));
+            partial.clear();
+        }
+        if (lines.size() != queued)
+            ready.notify_all();
+    }
+}
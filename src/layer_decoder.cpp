@@ -0,0 +1,146 @@
+#include "layer_decoder.h"
+#include <charconv>
+#include <iterator>
+#include <limits>
+#include <system_error>
+#include <type_traits>
+
+// Strips the blanks std::stoi/std::stod used to tolerate, plus a trailing CR.
+static std::string_view trimNumber(std::string_view text)
+{
+    auto isBlank = [](char c)
+    { return c == ' ' || c == '\t' || c == '\r'; };
+    while (!text.empty() && isBlank(text.front()))
+        text.remove_prefix(1);
+    while (!text.empty() && isBlank(text.back()))
+        text.remove_suffix(1);
+    if (text.size() > 1 && text.front() == '+')
+        text.remove_prefix(1);
+    return text;
+}
+
+// Parses the whole of 'text' into 'value'; on failure 'reason' says why.
+template <typename T>
+static bool parseNumber(std::string_view text, T &value, LayerDecodeError::Reason &reason)
+{
+    text = trimNumber(text);
+    std::from_chars_result result;
+    if constexpr (std::is_floating_point_v<T>)
+        result = std::from_chars(text.data(), text.data() + text.size(), value, std::chars_format::general);
+    else
+        result = std::from_chars(text.data(), text.data() + text.size(), value);
+
+    if (result.ec == std::errc() && result.ptr == text.data() + text.size() && !text.empty())
+        return true;
+    reason = result.ec == std::errc::result_out_of_range ? LayerDecodeError::OUT_OF_RANGE : LayerDecodeError::MALFORMED;
+    return false;
+}
+
+bool parseDuration(std::string_view text, int &seconds)
+{
+    struct Unit
+    {
+        std::string_view suffix;
+        long long seconds;
+    };
+    static constexpr Unit kUnits[] = {{"h", 3600}, {"min", 60}, {"sec", 1}};
+
+    text = trimNumber(text);
+    if (text.empty())
+        return false;
+
+    long long total = 0;
+    size_t nextUnit = 0;
+    while (true)
+    {
+        long long amount = 0;
+        auto result = std::from_chars(text.data(), text.data() + text.size(), amount);
+        if (result.ec != std::errc() || result.ptr == text.data() || amount < 0)
+            return false;
+        text.remove_prefix(static_cast<size_t>(result.ptr - text.data()));
+
+        // Units must come in descending order, so search from the last one used.
+        size_t unit = nextUnit;
+        while (unit < std::size(kUnits) && text.substr(0, kUnits[unit].suffix.size()) != kUnits[unit].suffix)
+            unit++;
+        if (unit == std::size(kUnits) || amount > std::numeric_limits<int>::max() / kUnits[unit].seconds)
+            return false;
+        total += amount * kUnits[unit].seconds;
+        if (total > std::numeric_limits<int>::max())
+            return false;
+        text.remove_prefix(kUnits[unit].suffix.size());
+        nextUnit = unit + 1;
+
+        if (text.empty())
+            break;
+        if (text.front() != '_' || text.size() == 1)
+            return false;
+        text.remove_prefix(1);
+    }
+    seconds = static_cast<int>(total);
+    return true;
+}
+
+bool decodeLayer(const std::vector<std::string_view> &row, Layer &layer, LayerDecodeError &error)
+{
+    if (row.size() < kLayerColumns.size())
+    {
+        error.reason = LayerDecodeError::MISSING_COLUMN;
+        error.column = row.size();
+        error.value = std::string_view();
+        return false;
+    }
+
+    for (size_t i = 0; i < kLayerColumns.size(); ++i)
+    {
+        const LayerColumn &column = kLayerColumns[i];
+        bool ok = true;
+        LayerDecodeError::Reason reason = LayerDecodeError::MALFORMED;
+        switch (column.kind)
+        {
+        case ColumnKind::TEXT:
+            (layer.*column.text).assign(row[i]);
+            break;
+        case ColumnKind::INTEGER:
+            ok = parseNumber(row[i], layer.*column.integer, reason);
+            break;
+        case ColumnKind::REAL:
+            ok = parseNumber(row[i], layer.*column.real, reason);
+            break;
+        case ColumnKind::DURATION:
+            (layer.*column.text).assign(row[i]);
+            ok = parseDuration(row[i], layer.*column.integer);
+            reason = LayerDecodeError::BAD_DURATION;
+            break;
+        }
+        if (!ok)
+        {
+            error.reason = reason;
+            error.column = i;
+            error.value = row[i];
+            return false;
+        }
+    }
+    return true;
+}
+
+const char *LayerDecodeError::columnName() const
+{
+    return column < kLayerColumns.size() ? kLayerColumns[column].name : "?";
+}
+
+const char *LayerDecodeError::describe() const
+{
+    switch (reason)
+    {
+    case MISSING_COLUMN:
+        return "missing column";
+    case MALFORMED:
+        return "malformed number";
+    case OUT_OF_RANGE:
+        return "number out of range";
+    case BAD_DURATION:
+        return "malformed duration";
+    }
+    return "unknown error";
+}
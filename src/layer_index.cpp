@@ -0,0 +1,135 @@
+#include "layer_index.h"
+#include "binary_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "spdlog/spdlog.h"
+
+static constexpr char kMagic[8] = {'F', 'P', 'L', 'I', 'D', 'X', '1', '\0'};
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kEntrySize = 24;
+
+std::string LayerIndex::pathFor(const std::string &csvFileName)
+{
+    return csvFileName + ".index";
+}
+
+void LayerIndex::add(int rowNumber, uint64_t startOffset, int layerNumber)
+{
+    if (rowsAdded++ % kStride == 0)
+    {
+        LayerIndexEntry entry;
+        entry.offset = entries.empty() ? 0 : startOffset;
+        entry.rowNumber = rowNumber;
+        entry.maxLayerBefore = highestLayer;
+        entry.minLayerFrom = INT_MAX;
+        entries.push_back(entry);
+    }
+    if (layerNumber > 0)
+    {
+        highestLayer = std::max(highestLayer, layerNumber);
+        // The lowest in this entry's rows for now; save() carries it back.
+        entries.back().minLayerFrom = std::min(entries.back().minLayerFrom, layerNumber);
+    }
+}
+
+bool LayerIndex::save(const std::string &path, const DatasetSource &source)
+{
+    for (size_t i = entries.size(); i-- > 1;)
+        entries[i - 1].minLayerFrom = std::min(entries[i - 1].minLayerFrom, entries[i].minLayerFrom);
+
+    std::string data(kMagic, sizeof(kMagic));
+    putU32(data, kVersion);
+    putU32(data, kStride);
+    putU64(data, source.size);
+    putU64(data, static_cast<uint64_t>(source.modified));
+    putU64(data, source.hash);
+    putU64(data, entries.size());
+    for (const LayerIndexEntry &entry : entries)
+    {
+        putU64(data, entry.offset);
+        putU32(data, static_cast<uint32_t>(entry.rowNumber));
+        putU32(data, static_cast<uint32_t>(entry.maxLayerBefore));
+        putU32(data, static_cast<uint32_t>(entry.minLayerFrom));
+        putU32(data, 0);
+    }
+    putU64(data, fnv1a(data));
+
+    // Nothing depends on the index surviving a crash; it is rebuilt if lost.
+    std::string tempPath = path + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    out.close();
+    if (!out || std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        spdlog::error("Failed to write {}: {}", path, std::strerror(errno));
+        std::remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool LayerIndex::load(const std::string &path, const std::string &csvFileName)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(kMagic) + 8 || std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0)
+        return false;
+    std::string_view body(data.data(), data.size() - 8);
+    if (getU64(data.data() + body.size()) != fnv1a(body))
+        return false;
+
+    ByteReader reader(body.substr(sizeof(kMagic)));
+    uint32_t version, stride;
+    uint64_t csvSize, csvModified, csvHash, count;
+    if (!reader.u32(version) || version != kVersion || !reader.u32(stride) || stride != kStride ||
+        !reader.u64(csvSize) || !reader.u64(csvModified) || !reader.u64(csvHash) || !reader.u64(count) ||
+        reader.remaining() != count * kEntrySize)
+        return false;
+
+    DatasetSource source;
+    if (!source.describe(csvFileName, false) || source.size != csvSize)
+        return false;
+    if (source.modified != static_cast<int64_t>(csvModified) &&
+        (!source.describe(csvFileName, true) || source.hash != csvHash))
+        return false;
+
+    entries.resize(count);
+    for (LayerIndexEntry &entry : entries)
+    {
+        uint32_t rowNumber = 0, maxLayerBefore = 0, minLayerFrom = 0, reserved = 0;
+        reader.u64(entry.offset);
+        reader.u32(rowNumber);
+        reader.u32(maxLayerBefore);
+        reader.u32(minLayerFrom);
+        reader.u32(reserved);
+        entry.rowNumber = static_cast<int>(rowNumber);
+        entry.maxLayerBefore = static_cast<int>(maxLayerBefore);
+        entry.minLayerFrom = static_cast<int>(minLayerFrom);
+    }
+    rowsAdded = count * kStride;
+    return true;
+}
+
+const LayerIndexEntry &LayerIndex::seek(int fromLayer) const
+{
+    static const LayerIndexEntry start;
+    // maxLayerBefore never decreases along the file.
+    auto past = std::partition_point(entries.begin(), entries.end(), [fromLayer](const LayerIndexEntry &entry)
+                                     { return entry.maxLayerBefore < fromLayer; });
+    return past == entries.begin() ? start : *(past - 1);
+}
+
+uint64_t LayerIndex::endOffset(int toLayer) const
+{
+    // Nor does minLayerFrom, once save() has carried it back.
+    auto end = std::partition_point(entries.begin(), entries.end(), [toLayer](const LayerIndexEntry &entry)
+                                    { return entry.minLayerFrom <= toLayer; });
+    return end == entries.end() ? UINT64_MAX : end->offset;
+}
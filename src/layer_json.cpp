@@ -0,0 +1,199 @@
+#include "layer_json.h"
+#include "layer_decoder.h"
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+// Everything is written through a raw pointer into space reserved up front
+// with one resize(); the buffer is trimmed to the bytes written at the end.
+// This keeps a whole layer down to a couple of std::string operations.
+
+// Worst-case output sizes.
+static constexpr size_t kMaxInt = 11;    // "-2147483648"
+static constexpr size_t kMaxDouble = 24; // Shortest round-trip, e.g. "-2.2250738585072014e-308"
+static constexpr size_t kEscapedByte = 6; // "\u001f"
+
+// Bytes that cannot appear unescaped inside a JSON string.
+static constexpr std::array<bool, 256> kNeedsEscape = []()
+{
+    std::array<bool, 256> table{};
+    for (int c = 0; c < 0x20; ++c)
+        table[c] = true;
+    table['"'] = true;
+    table['\\'] = true;
+    return table;
+}();
+
+static char *writeJsonString(char *p, std::string_view value)
+{
+    static const char kHex[] = "0123456789abcdef";
+    *p++ = '"';
+    size_t runStart = 0;
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        unsigned char c = static_cast<unsigned char>(value[i]);
+        if (!kNeedsEscape[c])
+            continue;
+        // Copy the clean run before the character that needs escaping.
+        std::memcpy(p, value.data() + runStart, i - runStart);
+        p += i - runStart;
+        runStart = i + 1;
+        *p++ = '\\';
+        switch (c)
+        {
+        case '"':
+        case '\\':
+            *p++ = static_cast<char>(c);
+            break;
+        case '\n':
+            *p++ = 'n';
+            break;
+        case '\r':
+            *p++ = 'r';
+            break;
+        case '\t':
+            *p++ = 't';
+            break;
+        case '\b':
+            *p++ = 'b';
+            break;
+        case '\f':
+            *p++ = 'f';
+            break;
+        default:
+            std::memcpy(p, "u00", 3);
+            p += 3;
+            *p++ = kHex[c >> 4];
+            *p++ = kHex[c & 0xf];
+            break;
+        }
+    }
+    std::memcpy(p, value.data() + runStart, value.size() - runStart);
+    p += value.size() - runStart;
+    *p++ = '"';
+    return p;
+}
+
+static char *writeJsonNumber(char *p, int value)
+{
+    return std::to_chars(p, p + kMaxInt, value).ptr;
+}
+
+static char *writeJsonNumber(char *p, double value)
+{
+    // JSON has no NaN or infinity.
+    if (!std::isfinite(value))
+    {
+        std::memcpy(p, "null", 4);
+        return p + 4;
+    }
+    return std::to_chars(p, p + kMaxDouble, value).ptr;
+}
+
+// Runs 'write' on at least 'maxSize' bytes of space at the end of 'out'.
+template <typename Write>
+static void appendWith(std::string &out, size_t maxSize, Write write)
+{
+    size_t start = out.size();
+    out.resize(start + maxSize);
+    char *end = write(out.data() + start);
+    out.resize(static_cast<size_t>(end - out.data()));
+}
+
+void appendJsonString(std::string &out, std::string_view value)
+{
+    appendWith(out, value.size() * kEscapedByte + 2, [value](char *p)
+               { return writeJsonString(p, value); });
+}
+
+void appendJsonNumber(std::string &out, int value)
+{
+    appendWith(out, kMaxInt, [value](char *p)
+               { return writeJsonNumber(p, value); });
+}
+
+void appendJsonNumber(std::string &out, double value)
+{
+    appendWith(out, kMaxDouble, [value](char *p)
+               { return writeJsonNumber(p, value); });
+}
+
+// "{ \"layerError\": ", ", \"layerNumber\": ", ... built once from the schema.
+struct JsonKey
+{
+    char text[48];
+    size_t size;
+};
+
+static const std::array<JsonKey, kLayerColumns.size()> &layerKeys()
+{
+    static const std::array<JsonKey, kLayerColumns.size()> keys = []()
+    {
+        std::array<JsonKey, kLayerColumns.size()> table{};
+        for (size_t i = 0; i < kLayerColumns.size(); ++i)
+        {
+            std::string key = std::string(i == 0 ? "{ \"" : ", \"") + kLayerColumns[i].name + "\": ";
+            std::memcpy(table[i].text, key.data(), key.size());
+            table[i].size = key.size();
+        }
+        return table;
+    }();
+    return keys;
+}
+
+void appendLayerJson(std::string &out, const Layer &layer)
+{
+    const auto &keys = layerKeys();
+    size_t maxSize = 2;
+    for (size_t i = 0; i < kLayerColumns.size(); ++i)
+    {
+        const LayerColumn &column = kLayerColumns[i];
+        maxSize += keys[i].size;
+        if (column.kind == ColumnKind::TEXT || column.kind == ColumnKind::DURATION)
+            maxSize += (layer.*column.text).size() * kEscapedByte + 2;
+        else
+            maxSize += column.kind == ColumnKind::INTEGER ? kMaxInt : kMaxDouble;
+    }
+
+    appendWith(out, maxSize, [&](char *p)
+               {
+                   for (size_t i = 0; i < kLayerColumns.size(); ++i)
+                   {
+                       const LayerColumn &column = kLayerColumns[i];
+                       std::memcpy(p, keys[i].text, keys[i].size);
+                       p += keys[i].size;
+                       switch (column.kind)
+                       {
+                       case ColumnKind::TEXT:
+                       case ColumnKind::DURATION:
+                           p = writeJsonString(p, layer.*column.text);
+                           break;
+                       case ColumnKind::INTEGER:
+                           p = writeJsonNumber(p, layer.*column.integer);
+                           break;
+                       case ColumnKind::REAL:
+                           p = writeJsonNumber(p, layer.*column.real);
+                           break;
+                       }
+                   }
+                   std::memcpy(p, " }", 2);
+                   return p + 2;
+               });
+}
+
+void appendLayersNdjson(std::string &out, const std::vector<Layer> &layers)
+{
+    for (const Layer &layer : layers)
+    {
+        appendLayerJson(out, layer);
+        out.push_back('\n');
+    }
+}
+
+std::string Layer::toString() const
+{
+    std::string out;
+    appendLayerJson(out, *this);
+    return out;
+}
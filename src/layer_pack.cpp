@@ -0,0 +1,273 @@
+#include "layer_pack.h"
+#include "binary_io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "spdlog/spdlog.h"
+
+static constexpr char kHeaderMagic[8] = {'F', 'P', 'P', 'A', 'C', 'K', '1', '\0'};
+static constexpr char kTrailerMagic[8] = {'F', 'P', 'P', 'K', 'E', 'N', 'D', '\0'};
+static constexpr uint32_t kVersion = 1;
+static constexpr size_t kHeaderSize = 16;
+static constexpr size_t kRecordHeaderSize = 16;
+static constexpr size_t kIndexEntrySize = 24;
+static constexpr size_t kTrailerSize = 24;
+// Payloads at least this large are not copied into the batch; they are
+// written straight from the caller's buffer, right after it.
+static constexpr size_t kDirectPayloadBytes = 64 * 1024;
+
+LayerPackWriter::LayerPackWriter(const LayerPackOptions &options)
+    : options(options)
+{
+}
+
+LayerPackWriter::~LayerPackWriter()
+{
+    if (isOpen())
+        close();
+}
+
+bool LayerPackWriter::open(const std::string &packPath)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    path = packPath;
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        spdlog::error("Failed to open pack file {}: {}", path, std::strerror(errno));
+        return false;
+    }
+    batch.clear();
+    index.clear();
+    written = 0;
+    batch.append(kHeaderMagic, sizeof(kHeaderMagic));
+    putU32(batch, kVersion);
+    putU32(batch, 0);
+    return true;
+}
+
+bool LayerPackWriter::writeAll(struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = ::writev(fd, iov, count);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            spdlog::error("Failed to write pack file {}: {}", path, std::strerror(errno));
+            return false;
+        }
+        // Skip what went out and continue with the rest.
+        size_t done = static_cast<size_t>(n);
+        while (count > 0 && done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+bool LayerPackWriter::flushBatch(std::string_view tail)
+{
+    if (batch.empty() && tail.empty())
+        return true;
+    struct iovec iov[2] = {{batch.data(), batch.size()}, {const_cast<char *>(tail.data()), tail.size()}};
+    if (!writeAll(iov, tail.empty() ? 1 : 2))
+        return false;
+    written += batch.size() + tail.size();
+    batch.clear();
+    if (options.sync == PackSync::EVERY_BATCH && ::fsync(fd) != 0)
+    {
+        spdlog::error("Failed to sync pack file {}: {}", path, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool LayerPackWriter::append(PackRecordKind kind, int layerNumber, std::string_view payload)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0)
+        return false;
+    putU32(batch, static_cast<uint32_t>(kind));
+    putU32(batch, static_cast<uint32_t>(layerNumber));
+    putU64(batch, payload.size());
+    index.push_back(IndexEntry{layerNumber, kind, written + batch.size(), payload.size()});
+    if (payload.size() >= kDirectPayloadBytes)
+        return flushBatch(payload);
+    batch.append(payload.data(), payload.size());
+    if (batch.size() >= options.batchBytes)
+        return flushBatch();
+    return true;
+}
+
+bool LayerPackWriter::appendFile(PackRecordKind kind, int layerNumber, const std::string &filePath)
+{
+    std::ifstream in(filePath, std::ios::binary | std::ios::ate);
+    std::string contents;
+    if (in)
+    {
+        contents.resize(static_cast<size_t>(in.tellg()));
+        in.seekg(0);
+        in.read(contents.data(), static_cast<std::streamsize>(contents.size()));
+    }
+    if (!in)
+    {
+        spdlog::error("Failed to read {} for the pack file.", filePath);
+        return false;
+    }
+    return append(kind, layerNumber, contents);
+}
+
+bool LayerPackWriter::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0)
+        return false;
+
+    uint64_t indexOffset = written + batch.size();
+    for (const IndexEntry &entry : index)
+    {
+        putU32(batch, static_cast<uint32_t>(entry.layerNumber));
+        putU32(batch, static_cast<uint32_t>(entry.kind));
+        putU64(batch, entry.offset);
+        putU64(batch, entry.length);
+    }
+    putU64(batch, indexOffset);
+    putU64(batch, index.size());
+    batch.append(kTrailerMagic, sizeof(kTrailerMagic));
+
+    bool ok = flushBatch();
+    if (ok && options.sync == PackSync::ON_CLOSE && ::fsync(fd) != 0)
+    {
+        spdlog::error("Failed to sync pack file {}: {}", path, std::strerror(errno));
+        ok = false;
+    }
+    if (::close(fd) != 0)
+        ok = false;
+    fd = -1;
+    spdlog::debug("Closed pack file {}: {} records, {} bytes.", path, index.size(), written);
+    return ok;
+}
+
+bool LayerPackReader::open(const std::string &path)
+{
+    file = std::make_unique<MappedFile>(path);
+    layers.clear();
+    images.clear();
+    if (!file->isOpen() || file->size() < kHeaderSize ||
+        std::memcmp(file->data(), kHeaderMagic, sizeof(kHeaderMagic)) != 0)
+    {
+        spdlog::error("{} is not a pack file.", path);
+        return false;
+    }
+    if (getU32(file->data() + 8) != kVersion)
+    {
+        spdlog::error("Unsupported pack file version in {}.", path);
+        return false;
+    }
+    if (readIndex())
+        return true;
+    spdlog::warn("Pack file {} has no index (the writer did not finish); scanning its records.", path);
+    return scanRecords();
+}
+
+void LayerPackReader::addEntry(int layerNumber, uint32_t kind, uint64_t offset, uint64_t length)
+{
+    if (kind == static_cast<uint32_t>(PackRecordKind::LAYER))
+        layers[layerNumber] = Span{offset, length};
+    else if (kind == static_cast<uint32_t>(PackRecordKind::IMAGE))
+        images[layerNumber] = Span{offset, length};
+}
+
+bool LayerPackReader::readIndex()
+{
+    const char *data = file->data();
+    uint64_t size = file->size();
+    if (size < kHeaderSize + kTrailerSize ||
+        std::memcmp(data + size - sizeof(kTrailerMagic), kTrailerMagic, sizeof(kTrailerMagic)) != 0)
+        return false;
+
+    const char *trailer = data + size - kTrailerSize;
+    uint64_t indexOffset = getU64(trailer);
+    uint64_t count = getU64(trailer + 8);
+    uint64_t indexEnd = size - kTrailerSize;
+    if (indexOffset < kHeaderSize || indexOffset > indexEnd || (indexEnd - indexOffset) / kIndexEntrySize != count ||
+        (indexEnd - indexOffset) % kIndexEntrySize != 0)
+        return false;
+
+    layers.reserve(count);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const char *entry = data + indexOffset + i * kIndexEntrySize;
+        uint64_t offset = getU64(entry + 8);
+        uint64_t length = getU64(entry + 16);
+        if (offset > indexOffset || length > indexOffset - offset)
+            return false;
+        addEntry(static_cast<int>(getU32(entry)), getU32(entry + 4), offset, length);
+    }
+    return true;
+}
+
+bool LayerPackReader::scanRecords()
+{
+    layers.clear();
+    images.clear();
+    const char *data = file->data();
+    uint64_t size = file->size();
+    uint64_t pos = kHeaderSize;
+    while (size - pos >= kRecordHeaderSize)
+    {
+        uint32_t kind = getU32(data + pos);
+        int layerNumber = static_cast<int>(getU32(data + pos + 4));
+        uint64_t length = getU64(data + pos + 8);
+        uint64_t payload = pos + kRecordHeaderSize;
+        if (length > size - payload)
+            break; // Torn final record.
+        if (kind != static_cast<uint32_t>(PackRecordKind::LAYER) && kind != static_cast<uint32_t>(PackRecordKind::IMAGE))
+            break; // Part of an index that was never finished.
+        addEntry(layerNumber, kind, payload, length);
+        pos = payload + length;
+    }
+    return true;
+}
+
+bool LayerPackReader::findLayer(int layerNumber, std::string_view &json) const
+{
+    auto it = layers.find(layerNumber);
+    if (it == layers.end())
+        return false;
+    json = std::string_view(file->data() + it->second.offset, it->second.length);
+    return true;
+}
+
+std::vector<int> LayerPackReader::layerNumbers() const
+{
+    std::vector<int> numbers;
+    numbers.reserve(layers.size());
+    for (const auto &layer : layers)
+        numbers.push_back(layer.first);
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+bool LayerPackReader::findImage(int layerNumber, std::string_view &bytes) const
+{
+    auto it = images.find(layerNumber);
+    if (it == images.end())
+        return false;
+    bytes = std::string_view(file->data() + it->second.offset, it->second.length);
+    return true;
+}
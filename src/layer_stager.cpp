@@ -0,0 +1,58 @@
+#include "layer_stager.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include "spdlog/spdlog.h"
+
+namespace fs = std::filesystem;
+
+LayerStager::LayerStager(const std::string &jobDir)
+    : jobDir(jobDir), stagingDir((fs::path(jobDir) / ".staging").string())
+{
+}
+
+LayerStager::~LayerStager()
+{
+    std::error_code ec;
+    fs::remove_all(stagingDir, ec);
+}
+
+bool LayerStager::open(const std::vector<std::string> &subdirs)
+{
+    for (const std::string &subdir : subdirs)
+    {
+        std::error_code ec;
+        fs::create_directories(fs::path(stagingDir) / subdir, ec);
+        if (!ec)
+            fs::create_directories(fs::path(jobDir) / subdir, ec);
+        if (ec)
+        {
+            spdlog::error("Error creating staging directories: {}", ec.message());
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string LayerStager::stagedPath(const std::string &subdir, int layerNumber, const std::string &fileName) const
+{
+    return (fs::path(stagingDir) / subdir / (std::to_string(layerNumber) + "_" + fileName)).string();
+}
+
+bool LayerStager::publish(const std::string &subdir, int layerNumber, const std::string &fileName) const
+{
+    std::string from = stagedPath(subdir, layerNumber, fileName);
+    std::string to = (fs::path(jobDir) / subdir / fileName).string();
+    if (std::rename(from.c_str(), to.c_str()) != 0)
+    {
+        spdlog::error("Failed to publish {}: {}", to, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void LayerStager::discard(const std::string &subdir, int layerNumber, const std::string &fileName) const
+{
+    std::remove(stagedPath(subdir, layerNumber, fileName).c_str());
+}
@@ -0,0 +1,213 @@
+#include "layer_table.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <string>
+
+std::string_view StringArena::store(std::string_view value)
+{
+    if (value.empty())
+        return std::string_view();
+    if (value.size() > left)
+    {
+        size_t size = std::max(kBlockSize, value.size());
+        blocks.push_back(std::make_unique<char[]>(size));
+        cursor = blocks.back().get();
+        left = size;
+        reserved += size;
+    }
+    std::memcpy(cursor, value.data(), value.size());
+    std::string_view stored(cursor, value.size());
+    cursor += value.size();
+    left -= value.size();
+    return stored;
+}
+
+uint32_t StringDictionary::intern(std::string_view value, StringArena &arena)
+{
+    auto it = codes.find(value);
+    if (it != codes.end())
+        return it->second;
+    uint32_t code = static_cast<uint32_t>(values.size());
+    std::string_view stored = arena.store(value);
+    values.push_back(stored);
+    codes.emplace(stored, code);
+    return code;
+}
+
+bool StringDictionary::find(std::string_view value, uint32_t &code) const
+{
+    auto it = codes.find(value);
+    if (it == codes.end())
+        return false;
+    code = it->second;
+    return true;
+}
+
+void LayerTable::append(const Layer &layer)
+{
+    ints[LAYER_NUMBER].push_back(layer.layerNumber);
+    ints[EXTRUSION_TEMPERATURE].push_back(layer.extrusionTemperature);
+    ints[PRINT_SPEED].push_back(layer.printSpeed);
+    ints[INFILL_DENSITY].push_back(layer.infillDensity);
+    ints[SHELL_THICKNESS].push_back(layer.shellThickness);
+    ints[OVERHANG_ANGLE].push_back(layer.overhangAngle);
+    ints[COOLING_FAN_SPEED].push_back(layer.coolingFanSpeed);
+    ints[PRINT_BED_TEMPERATURE].push_back(layer.printBedTemperature);
+    ints[LAYER_TIME_SECONDS].push_back(layer.layerTimeSeconds);
+    layerHeight.push_back(layer.layerHeight);
+    zOffsetAdjustment.push_back(layer.zOffsetAdjustment);
+
+    const std::string *text[TEXT_COLUMN_COUNT] = {
+        &layer.layerError, &layer.materialType, &layer.layerAdhesionQuality,
+        &layer.infillPattern, &layer.retractionSettings, &layer.layerTime};
+    for (int column = 0; column < TEXT_COLUMN_COUNT; ++column)
+        texts[column].push_back(dictionaries[column].intern(*text[column], arena));
+
+    fileName.push_back(arena.store(layer.fileName));
+    imageUrl.push_back(arena.store(layer.imageUrl));
+    rowCount++;
+}
+
+size_t LayerTable::memoryUsage() const
+{
+    size_t bytes = arena.capacity();
+    for (const auto &column : ints)
+        bytes += column.capacity() * sizeof(int32_t);
+    for (const auto &column : texts)
+        bytes += column.capacity() * sizeof(uint32_t);
+    for (const auto &dictionary : dictionaries)
+        bytes += dictionary.size() * (2 * sizeof(std::string_view) + 2 * sizeof(void *) + sizeof(uint32_t));
+    bytes += (layerHeight.capacity() + zOffsetAdjustment.capacity()) * sizeof(double);
+    bytes += (fileName.capacity() + imageUrl.capacity()) * sizeof(std::string_view);
+    return bytes;
+}
+
+Layer LayerTable::row(size_t row) const
+{
+    Layer layer;
+    layer.layerNumber = ints[LAYER_NUMBER][row];
+    layer.extrusionTemperature = ints[EXTRUSION_TEMPERATURE][row];
+    layer.printSpeed = ints[PRINT_SPEED][row];
+    layer.infillDensity = ints[INFILL_DENSITY][row];
+    layer.shellThickness = ints[SHELL_THICKNESS][row];
+    layer.overhangAngle = ints[OVERHANG_ANGLE][row];
+    layer.coolingFanSpeed = ints[COOLING_FAN_SPEED][row];
+    layer.printBedTemperature = ints[PRINT_BED_TEMPERATURE][row];
+    layer.layerTimeSeconds = ints[LAYER_TIME_SECONDS][row];
+    layer.layerHeight = layerHeight[row];
+    layer.zOffsetAdjustment = zOffsetAdjustment[row];
+
+    std::string *text[TEXT_COLUMN_COUNT] = {
+        &layer.layerError, &layer.materialType, &layer.layerAdhesionQuality,
+        &layer.infillPattern, &layer.retractionSettings, &layer.layerTime};
+    for (int column = 0; column < TEXT_COLUMN_COUNT; ++column)
+        text[column]->assign(dictionaries[column].value(texts[column][row]));
+
+    layer.fileName.assign(fileName[row]);
+    layer.imageUrl.assign(imageUrl[row]);
+    return layer;
+}
+
+// The filter and aggregate loops below are branch-free over plain arrays so
+// the compiler can vectorize them.
+
+void LayerTable::whereEquals(TextColumn column, std::string_view value, RowMask &rows) const
+{
+    uint32_t code;
+    if (!dictionaries[column].find(value, code))
+    {
+        std::fill(rows.begin(), rows.end(), 0);
+        return;
+    }
+    const uint32_t *values = texts[column].data();
+    uint8_t *mask = rows.data();
+    for (size_t i = 0; i < rowCount; ++i)
+        mask[i] &= static_cast<uint8_t>(values[i] == code);
+}
+
+void LayerTable::whereNotEquals(TextColumn column, std::string_view value, RowMask &rows) const
+{
+    uint32_t code;
+    if (!dictionaries[column].find(value, code))
+        return;
+    const uint32_t *values = texts[column].data();
+    uint8_t *mask = rows.data();
+    for (size_t i = 0; i < rowCount; ++i)
+        mask[i] &= static_cast<uint8_t>(values[i] != code);
+}
+
+void LayerTable::whereBetween(IntColumn column, int32_t lower, int32_t upper, RowMask &rows) const
+{
+    const int32_t *values = ints[column].data();
+    uint8_t *mask = rows.data();
+    for (size_t i = 0; i < rowCount; ++i)
+        mask[i] &= static_cast<uint8_t>((values[i] >= lower) & (values[i] <= upper));
+}
+
+ColumnAggregate LayerTable::aggregate(IntColumn column, const RowMask *rows) const
+{
+    const int32_t *values = ints[column].data();
+    ColumnAggregate result;
+    int64_t sum = 0;
+    int64_t sumOfSquares = 0;
+    int32_t lowest = std::numeric_limits<int32_t>::max();
+    int32_t highest = std::numeric_limits<int32_t>::min();
+
+    if (!rows)
+    {
+        for (size_t i = 0; i < rowCount; ++i)
+        {
+            int64_t value = values[i];
+            sum += value;
+            sumOfSquares += value * value;
+            lowest = std::min(lowest, values[i]);
+            highest = std::max(highest, values[i]);
+        }
+        result.count = rowCount;
+    }
+    else
+    {
+        const uint8_t *mask = rows->data();
+        uint64_t count = 0;
+        for (size_t i = 0; i < rowCount; ++i)
+        {
+            // All ones for a selected row, zero otherwise.
+            int64_t keep = -static_cast<int64_t>(mask[i]);
+            int64_t value = values[i];
+            count += mask[i];
+            sum += value & keep;
+            sumOfSquares += (value * value) & keep;
+            lowest = std::min(lowest, mask[i] ? values[i] : std::numeric_limits<int32_t>::max());
+            highest = std::max(highest, mask[i] ? values[i] : std::numeric_limits<int32_t>::min());
+        }
+        result.count = count;
+    }
+
+    if (result.count > 0)
+    {
+        result.sum = sum;
+        result.sumOfSquares = sumOfSquares;
+        result.min = lowest;
+        result.max = highest;
+    }
+    return result;
+}
+
+std::vector<uint64_t> LayerTable::countBy(TextColumn column, const RowMask *rows) const
+{
+    std::vector<uint64_t> counts(dictionaries[column].size(), 0);
+    const uint32_t *values = texts[column].data();
+    if (!rows)
+    {
+        for (size_t i = 0; i < rowCount; ++i)
+            counts[values[i]]++;
+    }
+    else
+    {
+        const uint8_t *mask = rows->data();
+        for (size_t i = 0; i < rowCount; ++i)
+            counts[values[i]] += mask[i];
+    }
+    return counts;
+}
@@ -1,10 +1,16 @@
+#include "byte_source.h"
 #include "fake_printer.h"
+#include "input_reactor.h"
+#include "print_farm.h"
+#include "trace.h"
+#include <curl/curl.h>
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/sinks/basic_file_sink.h"
 #include <iostream>
 #include <string>
 #include <atomic>
+#include <cmath>
 #include <csignal>
 #include <memory>
 #include <vector>
@@ -18,13 +24,64 @@ void signal_handler(int signal)
     {
         spdlog::info("SIGINT received. Requesting graceful shutdown.");
         g_shutdownRequested = true;
+        // Ends a supervised-mode prompt that is waiting for input.
+        InputReactor::interrupt();
     }
 }
 
 void printUsage(const char *progName)
 {
     std::cout << "Usage: " << progName
-              << " --name <print_name> --dest <destination_folder> --mode <supervised|automatic>\n";
+              << " --name <print_name> --dest <destination_folder> --mode <supervised|automatic|replay>"
+              << " [--parse-threads <n>]"
+              << " [--downloads <n>] [--downloads-per-host <n>]"
+              << " [--download-attempts <n>] [--download-segments <n>] [--stall-timeout <seconds>]"
+              << " [--validate-workers <n>] [--write-workers <n>] [--queue-capacity <n>]"
+              << " [--cache-dir <dir>] [--cache-size <MiB>]"
+              << " [--output <files|pack|pack-images>] [--pack-sync <never|close|batch>] [--sync-files]"
+              << " [--summary <streaming|table>] [--speed <factor>] [--input-script <file>] [--lookahead <n>]"
+              << " [--input <csv|-|url>] [--follow <idle seconds>]"
+              << " [--from-layer <n>] [--to-layer <n>] [--every <n>]"
+              << " [--checkpoint-every <layers>] [--resume] [--trace <file>]\n"
+              << "       " << progName << " --farm <manifest> [--farm-jobs <n>] [--farm-threads <n>] [options]\n"
+              << "       " << progName << " --compile-dataset [--parse-threads <n>] [--trace <file>]\n"
+              << "       " << progName << " --dump-pack <pack> [--from-layer <n>] [--to-layer <n>]\n";
+}
+
+// Parses a non-negative integer option value.
+bool parseCount(const std::string &text, unsigned &value)
+{
+    try
+    {
+        size_t used = 0;
+        unsigned long parsed = std::stoul(text, &used);
+        if (used != text.size() || text[0] == '-')
+            return false;
+        value = static_cast<unsigned>(parsed);
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+// Parses a positive, finite factor such as 1, 10 or 0.5.
+bool parseFactor(const std::string &text, double &value)
+{
+    try
+    {
+        size_t used = 0;
+        double parsed = std::stod(text, &used);
+        if (used != text.size() || !(parsed > 0.0) || !std::isfinite(parsed))
+            return false;
+        value = parsed;
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
 }
 
 int main(int argc, char *argv[])
@@ -59,16 +116,36 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    if (argc != 7)
-    {
-        printUsage(argv[0]);
-        return 1;
-    }
-
-    std::string printName, destFolder, modeStr;
+    std::string printName, destFolder, modeStr, farmManifest, tracePath, dumpPackPath;
+    bool compileOnly = false;
+    PrintOptions options;
+    FarmConfig farmConfig;
     for (int i = 1; i < argc; i += 2)
     {
         std::string argKey = argv[i];
+        if (argKey == "--resume")
+        {
+            options.resume = true;
+            i--; // Takes no value.
+            continue;
+        }
+        if (argKey == "--sync-files")
+        {
+            options.syncFiles = true;
+            i--; // Takes no value.
+            continue;
+        }
+        if (argKey == "--compile-dataset")
+        {
+            compileOnly = true;
+            i--; // Takes no value.
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
         std::string argVal = argv[i + 1];
         if (argKey == "--name")
         {
@@ -82,6 +159,200 @@ int main(int argc, char *argv[])
         {
             modeStr = argVal;
         }
+        else if (argKey == "--parse-threads")
+        {
+            if (!parseCount(argVal, options.parseThreads))
+            {
+                spdlog::error("Invalid thread count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--downloads")
+        {
+            if (!parseCount(argVal, options.maxDownloads) || options.maxDownloads == 0)
+            {
+                spdlog::error("Invalid download count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--downloads-per-host")
+        {
+            if (!parseCount(argVal, options.maxDownloadsPerHost) || options.maxDownloadsPerHost == 0)
+            {
+                spdlog::error("Invalid download count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--download-attempts")
+        {
+            if (!parseCount(argVal, options.downloadPolicy.maxAttempts) || options.downloadPolicy.maxAttempts == 0)
+            {
+                spdlog::error("Invalid attempt count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--download-segments")
+        {
+            if (!parseCount(argVal, options.downloadSegments) || options.downloadSegments == 0)
+            {
+                spdlog::error("Invalid segment count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--stall-timeout")
+        {
+            unsigned seconds = 0;
+            if (!parseCount(argVal, seconds) || seconds == 0)
+            {
+                spdlog::error("Invalid stall timeout: {}", argVal);
+                return 1;
+            }
+            options.downloadPolicy.lowSpeedSeconds = static_cast<long>(seconds);
+        }
+        else if (argKey == "--validate-workers" || argKey == "--write-workers")
+        {
+            unsigned &workers = argKey == "--validate-workers" ? options.validateWorkers : options.writeWorkers;
+            if (!parseCount(argVal, workers) || workers == 0)
+            {
+                spdlog::error("Invalid worker count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--queue-capacity")
+        {
+            if (!parseCount(argVal, options.queueCapacity) || options.queueCapacity == 0)
+            {
+                spdlog::error("Invalid queue capacity: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--cache-dir")
+        {
+            options.imageCacheDir = argVal;
+        }
+        else if (argKey == "--cache-size")
+        {
+            unsigned megabytes = 0;
+            if (!parseCount(argVal, megabytes))
+            {
+                spdlog::error("Invalid cache size: {}", argVal);
+                return 1;
+            }
+            options.imageCacheBytes = static_cast<uint64_t>(megabytes) << 20;
+        }
+        else if (argKey == "--output")
+        {
+            if (argVal == "files")
+                options.output = PrintOptions::FILES;
+            else if (argVal == "pack")
+                options.output = PrintOptions::PACK;
+            else if (argVal == "pack-images")
+                options.output = PrintOptions::PACK_WITH_IMAGES;
+            else
+            {
+                spdlog::error("Invalid output: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--pack-sync")
+        {
+            if (argVal == "never")
+                options.packSync = PackSync::NEVER;
+            else if (argVal == "close")
+                options.packSync = PackSync::ON_CLOSE;
+            else if (argVal == "batch")
+                options.packSync = PackSync::EVERY_BATCH;
+            else
+            {
+                spdlog::error("Invalid pack sync policy: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--dump-pack")
+        {
+            dumpPackPath = argVal;
+        }
+        else if (argKey == "--farm")
+        {
+            farmManifest = argVal;
+        }
+        else if (argKey == "--farm-jobs" || argKey == "--farm-threads")
+        {
+            unsigned &count = argKey == "--farm-jobs" ? farmConfig.maxActiveJobs : farmConfig.threads;
+            if (!parseCount(argVal, count) || (count == 0 && argKey == "--farm-jobs"))
+            {
+                spdlog::error("Invalid count: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--speed")
+        {
+            if (!parseFactor(argVal, options.replaySpeed))
+            {
+                spdlog::error("Invalid replay speed: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--checkpoint-every")
+        {
+            if (!parseCount(argVal, options.checkpointEvery) || options.checkpointEvery == 0)
+            {
+                spdlog::error("Invalid checkpoint interval: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--summary")
+        {
+            if (argVal == "streaming")
+                options.keepLayers = false;
+            else if (argVal == "table")
+                options.keepLayers = true;
+            else
+            {
+                spdlog::error("Invalid summary mode: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--input-script")
+        {
+            options.inputScript = argVal;
+        }
+        else if (argKey == "--lookahead")
+        {
+            if (!parseCount(argVal, options.lookahead))
+            {
+                spdlog::error("Invalid lookahead: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--input")
+        {
+            options.input = argVal;
+        }
+        else if (argKey == "--from-layer" || argKey == "--to-layer" || argKey == "--every")
+        {
+            unsigned &value = argKey == "--from-layer" ? options.fromLayer
+                              : argKey == "--to-layer" ? options.toLayer
+                                                       : options.everyLayer;
+            if (!parseCount(argVal, value) || value == 0)
+            {
+                spdlog::error("Invalid layer number: {}", argVal);
+                return 1;
+            }
+        }
+        else if (argKey == "--trace")
+        {
+            tracePath = argVal;
+        }
+        else if (argKey == "--follow")
+        {
+            if (!parseCount(argVal, options.followIdleSeconds))
+            {
+                spdlog::error("Invalid follow idle time: {}", argVal);
+                return 1;
+            }
+            options.followInput = true;
+        }
         else
         {
             printUsage(argv[0]);
@@ -89,11 +360,130 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (!options.inputScript.empty() && (!farmManifest.empty() || modeStr != "supervised"))
+    {
+        spdlog::error("--input-script needs supervised mode.");
+        return 1;
+    }
+
+    // Supervised mode reads its commands from stdin unless given a script.
+    if (options.input == "-" && modeStr == "supervised" && options.inputScript.empty())
+    {
+        spdlog::error("--input - needs --input-script in supervised mode; stdin carries the commands.");
+        return 1;
+    }
+    if (options.followInput && (options.input.empty() || isStreamLocation(options.input)))
+    {
+        spdlog::error("--follow needs an --input file or FIFO.");
+        return 1;
+    }
+
+    if (options.layerRange())
+    {
+        if (options.toLayer > 0 && options.toLayer < options.fromLayer)
+        {
+            spdlog::error("--to-layer {} comes before --from-layer {}.", options.toLayer, options.fromLayer);
+            return 1;
+        }
+        // A checkpoint covers the whole CSV, and farm jobs share one dataset.
+        if (!farmManifest.empty() || options.checkpointEvery > 0 || options.resume)
+        {
+            spdlog::error("--from-layer, --to-layer and --every need a single job without checkpoints.");
+            return 1;
+        }
+    }
+
+    // Layers between checkpoints when only --resume is given.
+    constexpr unsigned kDefaultCheckpointEvery = 500;
+    if (options.resume && options.checkpointEvery == 0)
+        options.checkpointEvery = kDefaultCheckpointEvery;
+    if (options.checkpointEvery > 0)
+    {
+        // A checkpoint records per-layer files and streaming statistics; a
+        // pack or a layer table would have to be rebuilt on resume.
+        if (!farmManifest.empty() || modeStr == "supervised" || options.output != PrintOptions::FILES ||
+            options.keepLayers)
+        {
+            spdlog::error("Checkpoints need automatic or replay mode with --output files and --summary streaming.");
+            return 1;
+        }
+        // Resuming seeks back into the CSV, which a stream cannot do, and
+        // compares it with the checkpoint, which a growing file would fail.
+        if (isStreamLocation(options.input) || options.followInput)
+        {
+            spdlog::error("Checkpoints need the CSV as a plain file, without --follow.");
+            return 1;
+        }
+    }
+
+    if (!dumpPackPath.empty())
+    {
+        if (options.everyLayer > 1)
+        {
+            spdlog::error("--dump-pack takes --from-layer and --to-layer only.");
+            return 1;
+        }
+        return FakePrinter::dumpPack(dumpPackPath, options.fromLayer, options.toLayer) ? 0 : 1;
+    }
+
+    // Tracing covers the work below; the trace is written once every thread is done.
+    if (!tracePath.empty())
+    {
+        Trace::start();
+        Trace::nameThread("main");
+    }
+    auto finishTrace = [&tracePath](bool ok)
+    {
+        if (!tracePath.empty() && !Trace::finish(tracePath))
+            return false;
+        return ok;
+    };
+
+    if (compileOnly)
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        bool ok = FakePrinter::fetchDataFile(kPrintDataFile) &&
+                  FakePrinter::compileDataset(kPrintDataFile, kCompiledDataFile, options.parseThreads);
+        curl_global_cleanup();
+        return finishTrace(ok) ? 0 : 1;
+    }
+
+    if (!farmManifest.empty())
+    {
+        std::vector<FarmJob> jobs;
+        if (!PrintFarm::loadManifest(farmManifest, jobs))
+            return 1;
+
+        // One set of sinks for every job; each job logs under its own name.
+        std::vector<spdlog::sink_ptr> &sinks = spdlog::default_logger()->sinks();
+        sinks[0]->set_pattern("[%n] %v");                           // Console
+        sinks[1]->set_pattern("[%Y-%m-%d %H:%M:%S] [%n] [%l] %v"); // FakePrinter.log
+        auto farmLogger = spdlog::default_logger()->clone("farm");
+        spdlog::set_default_logger(farmLogger);
+
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        bool ok;
+        {
+            PrintFarm farm(farmConfig, options);
+            ok = farm.run(jobs);
+        }
+        curl_global_cleanup();
+        return finishTrace(ok) ? 0 : 1;
+    }
+
+    if (printName.empty() || destFolder.empty() || modeStr.empty())
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
     FakePrinter::Mode mode;
     if (modeStr == "supervised")
         mode = FakePrinter::SUPERVISED;
     else if (modeStr == "automatic")
         mode = FakePrinter::AUTOMATIC;
+    else if (modeStr == "replay")
+        mode = FakePrinter::REPLAY;
     else
     {
         spdlog::error("Invalid mode: {}", modeStr);
@@ -101,8 +491,13 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    FakePrinter printer(printName, destFolder, mode);
-    printer.run();
+    // libcurl's global state must be set up before any worker threads use it.
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    {
+        FakePrinter printer(printName, destFolder, mode, options);
+        printer.run();
+    }
+    curl_global_cleanup();
 
-    return 0;
+    return finishTrace(true) ? 0 : 1;
 }
@@ -0,0 +1,212 @@
+#include "parallel_csv_reader.h"
+#include "csv_reader.h"
+#include "csv_scanner.h"
+#include "trace.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+// Rows parsed from one chunk. Fields point into the mapping, or into 'owned'
+// for fields that had to be unescaped.
+struct ParsedChunk
+{
+    std::vector<std::string_view> fields;
+    std::vector<size_t> rowEnds;
+    // File offset just past each row.
+    std::vector<uint64_t> rowOffsets;
+    std::deque<std::string> owned;
+};
+
+static ParsedChunk parseChunk(const char *fileBegin, const char *fileEnd, const char *begin, const char *end)
+{
+    TraceSpan span("csv.chunk");
+    span.setBytes(static_cast<uint64_t>(end - begin));
+    ParsedChunk chunk;
+    CSVReader reader(begin, end);
+    std::vector<std::string_view> row;
+    std::less<const char *> before;
+    while (reader.readNextRow(row))
+    {
+        for (std::string_view field : row)
+        {
+            // Views into the reader's own buffers die with the reader; keep a copy.
+            if (!before(field.data(), fileBegin) && !before(fileEnd, field.data() + field.size()))
+            {
+                chunk.fields.push_back(field);
+            }
+            else
+            {
+                chunk.owned.emplace_back(field);
+                chunk.fields.push_back(chunk.owned.back());
+            }
+        }
+        chunk.rowEnds.push_back(chunk.fields.size());
+        chunk.rowOffsets.push_back(static_cast<uint64_t>(begin - fileBegin) + reader.offset());
+    }
+    return chunk;
+}
+
+// Shared by the worker threads of one forEachRow() call. They count the
+// quotes of every nominal piece, wait for the calling thread to place the
+// chunk boundaries, then parse chunks, each worker taking the next one in turn.
+struct ParseWork
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    std::atomic<size_t> nextPiece{0};
+    std::vector<size_t> quotes;
+    size_t piecesCounted = 0;
+
+    // Set once every piece is counted.
+    std::vector<size_t> boundaries;
+    bool boundariesReady = false;
+
+    std::atomic<size_t> nextChunk{0};
+    // Parsed chunks waiting for the calling thread, by chunk number modulo
+    // the window size. A chunk is only parsed once its slot is free, which
+    // keeps memory use independent of the file size.
+    std::vector<std::optional<ParsedChunk>> window;
+    size_t consumed = 0;
+    bool stopped = false;
+};
+
+ParallelCSVReader::ParallelCSVReader(const std::string &filename, unsigned threads, size_t chunkSize)
+    : mapped(filename), threads(std::max(1u, threads)), chunkSize(std::max<size_t>(1, chunkSize))
+{
+}
+
+std::vector<size_t> ParallelCSVReader::findChunkBoundaries(size_t start, const std::vector<size_t> &quotes)
+{
+    // Cut [start, size) only; a record start is outside quotes.
+    const char *data = mapped.data() + start;
+    const size_t size = mapped.size() - start;
+    std::vector<size_t> boundaries{0};
+    const size_t pieces = quotes.size();
+    size_t quotesBefore = 0;
+    for (size_t i = 1; i < pieces; ++i)
+    {
+        quotesBefore += quotes[i - 1];
+        size_t cut = i * chunkSize;
+        if (cut < boundaries.back())
+            continue; // A long quoted field already carried the previous chunk past this cut.
+        bool inQuotes = quotesBefore % 2 != 0;
+        const char *newline = CSVScanner::findRecordEnd(data + cut, data + size, inQuotes);
+        if (newline == data + size)
+            break;
+        size_t boundary = static_cast<size_t>(newline - data) + 1;
+        if (boundary > boundaries.back() && boundary < size)
+            boundaries.push_back(boundary);
+    }
+    boundaries.push_back(size);
+    for (size_t &boundary : boundaries)
+        boundary += start;
+    return boundaries;
+}
+
+void ParallelCSVReader::forEachRow(const std::function<bool(const std::vector<std::string_view> &row, uint64_t endOffset)> &onRow,
+                                   uint64_t startOffset)
+{
+    if (!isMapped() || startOffset >= mapped.size())
+    {
+        return;
+    }
+    const char *data = mapped.data();
+    const char *fileEnd = data + mapped.size();
+    const size_t start = static_cast<size_t>(startOffset);
+    const size_t pieces = (mapped.size() - start + chunkSize - 1) / chunkSize;
+
+    ParseWork work;
+    work.quotes.resize(pieces);
+    work.window.resize(threads + 1);
+    auto worker = [&]()
+    {
+        Trace::nameThread("csv parse");
+        // Quote counts per nominal piece give the quote state at every cut.
+        for (size_t i; (i = work.nextPiece.fetch_add(1, std::memory_order_relaxed)) < pieces;)
+        {
+            size_t begin = start + i * chunkSize;
+            size_t end = std::min(mapped.size(), begin + chunkSize);
+            work.quotes[i] = CSVScanner::countQuotes(data + begin, data + end);
+            std::lock_guard<std::mutex> lock(work.mutex);
+            if (++work.piecesCounted == pieces)
+                work.changed.notify_all();
+        }
+        {
+            std::unique_lock<std::mutex> lock(work.mutex);
+            work.changed.wait(lock, [&]() { return work.boundariesReady; });
+        }
+
+        const size_t chunks = work.boundaries.size() - 1;
+        const size_t windowSize = work.window.size();
+        for (size_t i; (i = work.nextChunk.fetch_add(1, std::memory_order_relaxed)) < chunks;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(work.mutex);
+                work.changed.wait(lock, [&]() { return work.stopped || i < work.consumed + windowSize; });
+                if (work.stopped)
+                    return;
+            }
+            ParsedChunk chunk = parseChunk(data, fileEnd, data + work.boundaries[i], data + work.boundaries[i + 1]);
+            std::lock_guard<std::mutex> lock(work.mutex);
+            work.window[i % windowSize] = std::move(chunk);
+            work.changed.notify_all();
+        }
+    };
+
+    // Started once per call and fed chunk after chunk, however large the file.
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < std::min<size_t>(threads, pieces); ++t)
+        workers.emplace_back(worker);
+
+    {
+        std::unique_lock<std::mutex> lock(work.mutex);
+        work.changed.wait(lock, [&]() { return work.piecesCounted == pieces; });
+    }
+    work.boundaries = findChunkBoundaries(start, work.quotes);
+    {
+        std::lock_guard<std::mutex> lock(work.mutex);
+        work.boundariesReady = true;
+    }
+    work.changed.notify_all();
+
+    // Results are consumed strictly in chunk order.
+    const size_t chunks = work.boundaries.size() - 1;
+    const size_t windowSize = work.window.size();
+    std::vector<std::string_view> row;
+    for (size_t c = 0; c < chunks; ++c)
+    {
+        ParsedChunk chunk;
+        {
+            std::unique_lock<std::mutex> lock(work.mutex);
+            std::optional<ParsedChunk> &slot = work.window[c % windowSize];
+            work.changed.wait(lock, [&]() { return slot.has_value(); });
+            chunk = std::move(*slot);
+            slot.reset();
+            work.consumed = c + 1;
+        }
+        work.changed.notify_all();
+
+        bool more = true;
+        size_t rowStart = 0;
+        for (size_t i = 0; i < chunk.rowEnds.size() && more; ++i)
+        {
+            row.assign(chunk.fields.begin() + rowStart, chunk.fields.begin() + chunk.rowEnds[i]);
+            rowStart = chunk.rowEnds[i];
+            more = onRow(row, chunk.rowOffsets[i]);
+        }
+        if (!more)
+        {
+            std::lock_guard<std::mutex> lock(work.mutex);
+            work.stopped = true;
+            break;
+        }
+    }
+    work.changed.notify_all();
+    for (std::thread &thread : workers)
+        thread.join();
+}
@@ -0,0 +1,153 @@
+#include "print_checkpoint.h"
+#include "binary_io.h"
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <fcntl.h>
+#include <unistd.h>
+#include "spdlog/spdlog.h"
+
+namespace fs = std::filesystem;
+
+//   magic "FPCKPT1\0"  u32 version
+//   u64 csvSize  u64 csvModified  u64 offset  u32 nextRow
+//   u32 count  u32 row * count
+//   u32 layersPrinted  u32 errors  statistics (PrintStatistics::encode)
+//   u64 FNV-1a of everything before it
+static constexpr char kMagic[8] = {'F', 'P', 'C', 'K', 'P', 'T', '1', '\0'};
+static constexpr uint32_t kVersion = 1;
+
+void RowWatermark::reset(int nextRow, uint64_t offset)
+{
+    next = nextRow;
+    nextOffset = offset;
+    ahead.clear();
+}
+
+void RowWatermark::markDone(int rowNumber, uint64_t endOffset)
+{
+    if (rowNumber < next)
+        return;
+    if (rowNumber > next)
+    {
+        ahead.emplace(rowNumber, endOffset);
+        return;
+    }
+    next++;
+    nextOffset = endOffset;
+    for (auto it = ahead.begin(); it != ahead.end() && it->first == next; it = ahead.erase(it))
+    {
+        next++;
+        nextOffset = it->second;
+    }
+}
+
+std::vector<int> RowWatermark::rowsAhead() const
+{
+    std::vector<int> rows;
+    rows.reserve(ahead.size());
+    for (const auto &entry : ahead)
+        rows.push_back(entry.first);
+    return rows;
+}
+
+bool PrintCheckpoint::sameCsv(const std::string &csvFileName) const
+{
+    DatasetSource current;
+    return current.describe(csvFileName, false) && current.size == csv.size && current.modified == csv.modified;
+}
+
+bool PrintCheckpoint::save(const std::string &path) const
+{
+    std::string data(kMagic, sizeof(kMagic));
+    putU32(data, kVersion);
+    putU64(data, csv.size);
+    putU64(data, static_cast<uint64_t>(csv.modified));
+    putU64(data, offset);
+    putU32(data, static_cast<uint32_t>(nextRow));
+    putU32(data, static_cast<uint32_t>(rowsDone.size()));
+    for (int row : rowsDone)
+        putU32(data, static_cast<uint32_t>(row));
+    putU32(data, static_cast<uint32_t>(layersPrinted));
+    putU32(data, static_cast<uint32_t>(errors));
+    statistics.encode(data);
+    putU64(data, fnv1a(data));
+
+    std::string tempPath = path + ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        spdlog::error("Failed to write checkpoint {}: {}", tempPath, std::strerror(errno));
+        return false;
+    }
+    const char *next = data.data();
+    size_t left = data.size();
+    bool ok = true;
+    while (left > 0 && ok)
+    {
+        ssize_t n = ::write(fd, next, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        if (ok)
+        {
+            next += n;
+            left -= static_cast<size_t>(n);
+        }
+    }
+    // Synced before the rename, so the name never points at missing data.
+    ok = ok && ::fdatasync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        spdlog::error("Failed to write checkpoint {}: {}", path, std::strerror(errno));
+        ::unlink(tempPath.c_str());
+        return false;
+    }
+
+    // Make the rename itself durable.
+    std::string directory = fs::path(path).parent_path().string();
+    int dirFd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0)
+    {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+    return true;
+}
+
+bool PrintCheckpoint::load(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(kMagic) + 8 || std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0)
+        return false;
+    std::string_view body(data.data(), data.size() - 8);
+    if (getU64(data.data() + body.size()) != fnv1a(body))
+        return false;
+
+    ByteReader reader(body.substr(sizeof(kMagic)));
+    uint32_t version, row, count, printed, errorCount;
+    uint64_t modified;
+    if (!reader.u32(version) || version != kVersion || !reader.u64(csv.size) || !reader.u64(modified) ||
+        !reader.u64(offset) || !reader.u32(row) || !reader.u32(count))
+        return false;
+    csv.modified = static_cast<int64_t>(modified);
+    nextRow = static_cast<int>(row);
+    rowsDone.clear();
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (!reader.u32(row))
+            return false;
+        rowsDone.push_back(static_cast<int>(row));
+    }
+    if (!reader.u32(printed) || !reader.u32(errorCount) || !statistics.decode(reader))
+        return false;
+    layersPrinted = static_cast<int>(printed);
+    errors = static_cast<int>(errorCount);
+    return reader.remaining() == 0;
+}
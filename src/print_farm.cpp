@@ -0,0 +1,292 @@
+#include "print_farm.h"
+#include "work_stealing_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include "spdlog/spdlog.h"
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// Declare external shutdown flag.
+extern std::atomic<bool> g_shutdownRequested;
+
+static double secondsBetween(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double>(to - from).count();
+}
+
+static double perSecond(double count, double seconds)
+{
+    return seconds > 0.0 ? count / seconds : 0.0;
+}
+
+PrintFarm::PrintFarm(const FarmConfig &config, const PrintOptions &options)
+    : config(config), options(options)
+{
+    this->config.maxActiveJobs = std::max(1u, config.maxActiveJobs);
+    this->config.sliceLayers = std::max(1u, config.sliceLayers);
+}
+
+bool PrintFarm::loadManifest(const std::string &path, std::vector<FarmJob> &jobs)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        spdlog::error("Failed to open farm manifest {}.", path);
+        return false;
+    }
+
+    std::set<std::string> outputs;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line))
+    {
+        lineNumber++;
+        std::istringstream words(line);
+        std::string key;
+        if (!(words >> key) || key[0] == '#')
+            continue;
+
+        FarmJob job;
+        std::string modeStr = "automatic";
+        do
+        {
+            std::string value;
+            if (!(words >> value))
+            {
+                spdlog::error("{}:{}: {} needs a value.", path, lineNumber, key);
+                return false;
+            }
+            if (key == "--name")
+                job.printName = value;
+            else if (key == "--dest")
+                job.destFolder = value;
+            else if (key == "--mode")
+                modeStr = value;
+            else
+            {
+                spdlog::error("{}:{}: unknown option {}.", path, lineNumber, key);
+                return false;
+            }
+        } while (words >> key);
+
+        if (job.printName.empty() || job.destFolder.empty())
+        {
+            spdlog::error("{}:{}: a job needs --name and --dest.", path, lineNumber);
+            return false;
+        }
+        // Supervised jobs would fight over stdin, and replay pacing needs a
+        // thread per job; farm jobs run in automatic mode.
+        if (modeStr != "automatic")
+        {
+            spdlog::error("{}:{}: farm jobs must use automatic mode, not {}.", path, lineNumber, modeStr);
+            return false;
+        }
+        if (!outputs.insert((fs::path(job.destFolder) / job.printName).lexically_normal().string()).second)
+        {
+            spdlog::error("{}:{}: another job already prints to {}/{}.", path, lineNumber, job.destFolder, job.printName);
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    if (jobs.empty())
+    {
+        spdlog::error("Farm manifest {} has no jobs.", path);
+        return false;
+    }
+    return true;
+}
+
+bool PrintFarm::run(const std::vector<FarmJob> &jobs)
+{
+    // Jobs share the dataset, so a streamed --input is read to its end first.
+    std::string csvFileName = options.input.empty() ? kPrintDataFile : options.input;
+    if (options.input.empty() && !FakePrinter::fetchDataFile(csvFileName))
+        return false;
+
+    Clock::time_point loadStart = Clock::now();
+    LayerDataset dataset;
+    FakePrinter::loadDataset(csvFileName, options.parseThreads, FakePrinter::sourceOptions(options), dataset);
+    spdlog::info("Farm: decoded {} rows once for {} jobs in {:.2f} s.", dataset.size(), jobs.size(),
+                 secondsBetween(loadStart, Clock::now()));
+
+    // As in FakePrinter, the engine is declared after the writer and the cache
+    // so it is torn down first, while the writer and cache its callbacks use
+    // still exist; the writer goes next, before the cache its callbacks use.
+    DownloadService downloader(options.downloadPolicy);
+    std::unique_ptr<ImageCache> imageCache;
+    AsyncFileWriterConfig writerConfig;
+    writerConfig.sync = options.syncFiles;
+    auto writer = std::make_unique<AsyncFileWriter>(writerConfig);
+    DownloadEngineConfig engineConfig;
+    engineConfig.maxInFlight = std::max(1u, options.maxDownloads);
+    engineConfig.maxPerHost = std::max(1u, options.maxDownloadsPerHost);
+    engineConfig.maxSegments = std::max(1u, options.downloadSegments);
+    auto engine = std::make_unique<DownloadEngine>(engineConfig, &downloader);
+    if (options.imageCacheBytes > 0)
+    {
+        ImageCacheConfig cacheConfig;
+        cacheConfig.directory = options.imageCacheDir.empty()
+                                    ? (fs::path(jobs.front().destFolder) / ".image-cache").string()
+                                    : options.imageCacheDir;
+        cacheConfig.maxBytes = options.imageCacheBytes;
+        imageCache = std::make_unique<ImageCache>(cacheConfig, *engine, writer.get());
+        if (!imageCache->open())
+        {
+            spdlog::warn("Image cache unavailable; downloading every image.");
+            imageCache.reset();
+        }
+    }
+
+    struct JobRun
+    {
+        std::unique_ptr<FakePrinter> printer;
+        Clock::time_point start;
+        Clock::time_point end;
+        size_t slices = 0;
+    };
+    std::vector<JobRun> runs(jobs.size());
+
+    std::mutex mutex;
+    std::condition_variable allDone;
+    size_t nextJob = 0;
+    size_t active = 0;
+    size_t finished = 0;
+    size_t poolThreads = 0;
+    size_t steals = 0;
+    Clock::time_point farmStart = Clock::now();
+    {
+        // Declared before the pool, whose destructor joins workers that may
+        // still be returning from them.
+        std::function<void(size_t)> runSlice;
+        std::function<void()> launchJobs;
+        // Destroyed before 'runs', whose printers its tasks use.
+        WorkStealingPool pool(config.threads);
+
+        runSlice = [&](size_t index)
+        {
+            JobRun &job = runs[index];
+            job.slices++;
+            auto resume = [&, index]
+            {
+                pool.submit([&runSlice, index]
+                            { runSlice(index); });
+            };
+            if (job.printer->runSlice(config.sliceLayers, resume))
+                return;
+            job.printer->finishSlices();
+            job.end = Clock::now();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            active--;
+            finished++;
+            launchJobs();
+            allDone.notify_all();
+        };
+
+        // Starts waiting jobs while there is room; called with 'mutex' held.
+        launchJobs = [&]
+        {
+            while (active < config.maxActiveJobs && nextJob < jobs.size())
+            {
+                if (g_shutdownRequested)
+                {
+                    finished += jobs.size() - nextJob;
+                    nextJob = jobs.size();
+                    break;
+                }
+                size_t index = nextJob++;
+                const FarmJob &job = jobs[index];
+                SharedJobResources resources;
+                resources.dataset = &dataset;
+                resources.engine = engine.get();
+                resources.cache = imageCache.get();
+                resources.writer = writer.get();
+                resources.logger = spdlog::default_logger()->clone(job.printName);
+
+                runs[index].printer = std::make_unique<FakePrinter>(job.printName, job.destFolder, job.mode, options);
+                runs[index].start = Clock::now();
+                if (!runs[index].printer->startSlices(resources))
+                {
+                    runs[index].end = runs[index].start;
+                    finished++;
+                    continue;
+                }
+                active++;
+                pool.submit([&runSlice, index]
+                            { runSlice(index); });
+            }
+        };
+
+        std::unique_lock<std::mutex> lock(mutex);
+        launchJobs();
+        bool cancelled = false;
+        while (finished < jobs.size())
+        {
+            allDone.wait_for(lock, std::chrono::milliseconds(100));
+            if (g_shutdownRequested && !cancelled)
+            {
+                // The engine is shared, but so is the shutdown: every job stops.
+                cancelled = true;
+                lock.unlock();
+                engine->cancelAll();
+                lock.lock();
+                launchJobs();
+            }
+        }
+        lock.unlock();
+        poolThreads = pool.threadCount();
+        steals = pool.steals();
+    }
+    double farmSeconds = secondsBetween(farmStart, Clock::now());
+
+    engine.reset();
+    writer.reset();
+    ImageCacheStats cacheStats;
+    if (imageCache)
+    {
+        cacheStats = imageCache->stats();
+        imageCache.reset();
+    }
+
+    spdlog::info("=== Print Farm Report ===");
+    PrintStatistics combined;
+    long long totalPrinted = 0;
+    long long totalErrors = 0;
+    size_t totalSlices = 0;
+    size_t jobsRun = 0;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        const JobRun &job = runs[i];
+        if (!job.printer)
+        {
+            spdlog::info("  - {}: not started", jobs[i].printName);
+            continue;
+        }
+        jobsRun++;
+        double seconds = secondsBetween(job.start, job.end);
+        spdlog::info("  - {}: {} layers printed, {} errors in {:.2f} s ({:.1f} layers/s, {} slices)", jobs[i].printName,
+                     job.printer->layersPrinted(), job.printer->errorCount(), seconds,
+                     perSecond(job.printer->layersPrinted(), seconds), job.slices);
+        totalPrinted += job.printer->layersPrinted();
+        totalErrors += job.printer->errorCount();
+        totalSlices += job.slices;
+        combined.merge(job.printer->summaryStatistics());
+    }
+    spdlog::info("Jobs: {} run of {}, at most {} at once.", jobsRun, jobs.size(), config.maxActiveJobs);
+    spdlog::info("Total: {} layers printed, {} errors in {:.2f} s ({:.1f} layers/s).", totalPrinted, totalErrors,
+                 farmSeconds, perSecond(static_cast<double>(totalPrinted), farmSeconds));
+    spdlog::info("Simulated print time: {:.2f} minutes; avg speed {:.2f} mm/s.", combined.layerTime().sum() / 60.0,
+                 combined.printSpeed().mean());
+    spdlog::info("Pool: {} threads, {} slices, {} steals.", poolThreads, totalSlices, steals);
+    spdlog::info("Image cache: {} hits, {} revalidated, {} downloaded ({} bytes).", cacheStats.hits,
+                 cacheStats.revalidated, cacheStats.fetched + cacheStats.deduplicated, cacheStats.bytesDownloaded);
+    spdlog::info("=== End of Print Farm Report ===");
+    return true;
+}
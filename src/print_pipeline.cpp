@@ -0,0 +1,358 @@
+#include "print_pipeline.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include "spdlog/spdlog.h"
+
+// A task whose record is being written. The write and the rest of the task's
+// trip each arrive once; whichever is last sends the task to the sink.
+struct PendingWrite
+{
+    std::atomic<int> remaining{2};
+    std::atomic<bool> failed{false};
+    // Parked here by the task's side when it finishes first.
+    LayerTask task;
+};
+
+// How often the sink logs queue depths while the pipeline runs.
+static constexpr std::chrono::seconds kDepthLogInterval(1);
+
+// Longest the sink sleeps without a task, so it notices a stop request
+// (set by a signal handler, which cannot wake it).
+static constexpr std::chrono::milliseconds kStopPollInterval(50);
+
+// Waiting strategy for the lock-free queues: yield a few times, in case the
+// other side is about to act, then sleep on the queue's WaitSignal.
+class Backoff
+{
+public:
+    // Yields and returns true while spinning still pays, false once the
+    // caller should block instead.
+    bool spin()
+    {
+        if (step >= kSpins)
+            return false;
+        step++;
+        std::this_thread::yield();
+        return true;
+    }
+
+    void reset() { step = 0; }
+
+private:
+    static constexpr unsigned kSpins = 16;
+    unsigned step = 0;
+};
+
+PrintPipeline::PrintPipeline(const PipelineConfig &config,
+                             DownloadEngine &engine,
+                             const std::atomic<bool> &stopRequested)
+    : config(config),
+      engine(engine),
+      stopRequested(stopRequested),
+      toValidate("validate", config.queueCapacity),
+      toWrite("write", config.queueCapacity),
+      toDownload("download", config.queueCapacity),
+      toSink("sink", config.queueCapacity + config.downloadsInFlight)
+{
+    this->config.validateWorkers = std::max(1u, config.validateWorkers);
+    this->config.writeWorkers = std::max(1u, config.writeWorkers);
+    this->config.downloadsInFlight = std::max(1u, config.downloadsInFlight);
+}
+
+void PrintPipeline::push(Channel &channel, LayerTask &&task)
+{
+    // Never gives up: every channel has a consumer that drains it until it
+    // closes, even after cancellation, so tasks are not lost.
+    Backoff backoff;
+    while (!channel.queue.tryPush(std::move(task)))
+    {
+        if (!backoff.spin())
+            channel.writable.wait([&channel]()
+                                  { return channel.queue.size() < channel.queue.capacity(); });
+    }
+    channel.readable.notify();
+    size_t depth = channel.queue.size();
+    size_t peak = channel.peak.load(std::memory_order_relaxed);
+    while (depth > peak && !channel.peak.compare_exchange_weak(peak, depth, std::memory_order_relaxed))
+    {
+    }
+}
+
+bool PrintPipeline::pop(Channel &channel, LayerTask &task)
+{
+    Backoff backoff;
+    while (true)
+    {
+        if (channel.queue.tryPop(task))
+        {
+            channel.writable.notify();
+            return true;
+        }
+        if (channel.producers.load(std::memory_order_acquire) == 0)
+        {
+            // The last producer may have pushed just before closing.
+            return channel.queue.tryPop(task);
+        }
+        if (!backoff.spin())
+            channel.readable.wait([&channel]()
+                                  { return channel.queue.size() > 0 ||
+                                           channel.producers.load(std::memory_order_acquire) == 0; });
+    }
+}
+
+void PrintPipeline::sink(LayerTask &&task)
+{
+    if (!task.pendingWrite)
+    {
+        push(toSink, std::move(task));
+        return;
+    }
+    std::shared_ptr<PendingWrite> write = std::move(task.pendingWrite);
+    write->task = std::move(task);
+    arrive(*write);
+}
+
+void PrintPipeline::arrive(PendingWrite &write)
+{
+    if (write.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    LayerTask &task = write.task;
+    if (write.failed.load(std::memory_order_relaxed) && task.status != LayerTask::CANCELLED)
+        task.status = LayerTask::WRITE_FAILED;
+    push(toSink, std::move(task));
+}
+
+void PrintPipeline::finishWorker(Channel *out)
+{
+    if (out)
+    {
+        out->producers.fetch_sub(1, std::memory_order_acq_rel);
+        out->readable.notify();
+    }
+    activeWorkers.fetch_sub(1, std::memory_order_acq_rel);
+    // The sink watches for the last worker.
+    toSink.readable.notify();
+}
+
+void PrintPipeline::cancel()
+{
+    cancelRequested.store(true, std::memory_order_release);
+    downloadSlots.notify();
+    sinkRoom.notify();
+    engine.cancelAll();
+}
+
+void PrintPipeline::runStage(Channel &in, Channel &out, const std::function<void(LayerTask &task)> &work)
+{
+    LayerTask task;
+    while (pop(in, task))
+    {
+        if (task.status == LayerTask::PENDING && cancelled())
+            task.status = LayerTask::CANCELLED;
+        if (task.status == LayerTask::PENDING)
+            work(task);
+        if (task.status == LayerTask::PENDING)
+            push(out, std::move(task));
+        else
+            sink(std::move(task));
+    }
+    finishWorker(&out);
+}
+
+void PrintPipeline::runDownloads(const PipelineStages &stages)
+{
+    Trace::nameThread("download");
+    LayerTask task;
+    while (pop(toDownload, task))
+    {
+        // Backpressure: the engine only ever holds what is in flight.
+        if (task.status == LayerTask::PENDING)
+            downloadSlots.wait([this]()
+                               { return cancelled() ||
+                                        downloadsPending.load(std::memory_order_acquire) < config.downloadsInFlight; });
+        if (task.status == LayerTask::PENDING && cancelled())
+            task.status = LayerTask::CANCELLED;
+        if (task.status != LayerTask::PENDING)
+        {
+            sink(std::move(task));
+            continue;
+        }
+
+        downloadsPending.fetch_add(1, std::memory_order_acq_rel);
+        // Shared so the task stays put while the download stage uses it.
+        auto pending = std::make_shared<LayerTask>(std::move(task));
+        stages.download(*pending, [this, pending](const DownloadResult &result)
+                        {
+                            LayerTask &finished = *pending;
+                            if (result.success)
+                            {
+                                finished.status = LayerTask::PRINTED;
+                            }
+                            else if (result.cancelled)
+                            {
+                                finished.status = LayerTask::CANCELLED;
+                            }
+                            else
+                            {
+                                finished.status = LayerTask::DOWNLOAD_FAILED;
+                                finished.error = result.error;
+                            }
+                            sink(std::move(finished));
+                            downloadsPending.fetch_sub(1, std::memory_order_acq_rel);
+                            downloadSlots.notify();
+                            toSink.readable.notify();
+                        });
+    }
+    finishWorker(nullptr);
+}
+
+void PrintPipeline::run(const PipelineStages &stages)
+{
+    toValidate.producers = 1;
+    toWrite.producers = config.validateWorkers;
+    toDownload.producers = config.writeWorkers;
+    activeWorkers = 1 + config.validateWorkers + config.writeWorkers + 1;
+
+    std::vector<std::thread> workers;
+    // The caller's thread runs the sink loop until the pipeline returns.
+    TraceThreadName threadName("sink");
+    workers.emplace_back([this, &stages]()
+                         {
+                             Trace::nameThread("parse");
+                             auto emit = [this](LayerTask &&task)
+                             {
+                                 // With every admitted task able to fit in the
+                                 // sink's queue, pushing there never has to wait.
+                                 sinkRoom.wait([this]()
+                                               { return cancelled() || tasksAdmitted.load(std::memory_order_acquire) <
+                                                                           toSink.queue.capacity(); });
+                                 if (cancelled())
+                                     return false;
+                                 tasksAdmitted.fetch_add(1, std::memory_order_acq_rel);
+                                 push(task.status == LayerTask::PENDING ? toValidate : toSink, std::move(task));
+                                 return true;
+                             };
+                             stages.parse(emit);
+                             finishWorker(&toValidate);
+                         });
+    for (unsigned i = 0; i < config.validateWorkers; ++i)
+    {
+        workers.emplace_back([this, &stages]()
+                             {
+                                 Trace::nameThread("validate");
+                                 runStage(toValidate, toWrite, [&stages](LayerTask &task)
+                                          {
+                                              if (stages.validate(task.layer, task.validationError))
+                                                  task.validationError.clear();
+                                          });
+                             });
+    }
+    for (unsigned i = 0; i < config.writeWorkers; ++i)
+    {
+        workers.emplace_back([this, &stages]()
+                             {
+                                 Trace::nameThread("write");
+                                 runStage(toWrite, toDownload, [this, &stages](LayerTask &task)
+                                          {
+                                              auto write = std::make_shared<PendingWrite>();
+                                              task.pendingWrite = write;
+                                              writesPending.fetch_add(1, std::memory_order_acq_rel);
+                                              stages.write(task.layer, [this, write](bool written)
+                                                           {
+                                                               if (!written)
+                                                                   write->failed.store(true, std::memory_order_relaxed);
+                                                               arrive(*write);
+                                                               writesPending.fetch_sub(1, std::memory_order_acq_rel);
+                                                               toSink.readable.notify();
+                                                           });
+                                          });
+                             });
+    }
+    workers.emplace_back(&PrintPipeline::runDownloads, this, std::cref(stages));
+
+    // The calling thread is the sink: it owns all accounting and watches for shutdown.
+    auto lastDepthLog = std::chrono::steady_clock::now();
+    auto finished = [this]()
+    {
+        return activeWorkers.load(std::memory_order_acquire) == 0 &&
+               downloadsPending.load(std::memory_order_acquire) == 0 &&
+               writesPending.load(std::memory_order_acquire) == 0;
+    };
+    Backoff backoff;
+    while (true)
+    {
+        if (stopRequested && !cancelled())
+        {
+            spdlog::warn("Shutdown requested. Cancelling the print pipeline ({} image downloads in flight).",
+                         downloadsPending.load());
+            cancel();
+        }
+
+        LayerTask task;
+        if (toSink.queue.tryPop(task))
+        {
+            tasksAdmitted.fetch_sub(1, std::memory_order_acq_rel);
+            toSink.writable.notify();
+            sinkRoom.notify();
+            stages.sink(task);
+            backoff.reset();
+            continue;
+        }
+        // Workers publish their last task before leaving, and downloads and
+        // writes before they stop counting as pending, so an empty queue now
+        // means done.
+        if (finished())
+        {
+            if (toSink.queue.tryPop(task))
+            {
+                tasksAdmitted.fetch_sub(1, std::memory_order_acq_rel);
+                stages.sink(task);
+                continue;
+            }
+            break;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastDepthLog >= kDepthLogInterval)
+        {
+            logQueueDepths(false);
+            lastDepthLog = now;
+        }
+        if (!backoff.spin())
+            toSink.readable.waitFor([this, &finished]()
+                                    { return toSink.queue.size() > 0 || finished(); },
+                                    kStopPollInterval);
+    }
+
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    logQueueDepths(true);
+}
+
+std::vector<PipelineQueueStats> PrintPipeline::queueStats() const
+{
+    std::vector<PipelineQueueStats> stats;
+    for (const Channel *channel : {&toValidate, &toWrite, &toDownload, &toSink})
+    {
+        stats.push_back(PipelineQueueStats{channel->stage, channel->queue.size(),
+                                           channel->peak.load(std::memory_order_relaxed),
+                                           channel->queue.capacity()});
+    }
+    return stats;
+}
+
+void PrintPipeline::logQueueDepths(bool peaks) const
+{
+    std::string line;
+    for (const PipelineQueueStats &stats : queueStats())
+    {
+        line += fmt::format(" {} {}/{}", stats.stage, peaks ? stats.peak : stats.depth, stats.capacity);
+    }
+    spdlog::debug("Pipeline queue {}:{}, downloads in flight {}/{}", peaks ? "peaks" : "depths", line,
+                  downloadsPending.load(std::memory_order_relaxed), config.downloadsInFlight);
+}
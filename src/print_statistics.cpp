@@ -0,0 +1,266 @@
+#include "print_statistics.h"
+#include "binary_io.h"
+#include <algorithm>
+#include <cmath>
+
+void RunningStat::add(double value)
+{
+    n++;
+    total += value;
+    double delta = value - average;
+    average += delta / static_cast<double>(n);
+    m2 += delta * (value - average);
+    if (n == 1)
+    {
+        lowest = highest = value;
+    }
+    else
+    {
+        lowest = std::min(lowest, value);
+        highest = std::max(highest, value);
+    }
+}
+
+void RunningStat::merge(const RunningStat &other)
+{
+    if (other.n == 0)
+        return;
+    if (n == 0)
+    {
+        *this = other;
+        return;
+    }
+    uint64_t combined = n + other.n;
+    double delta = other.average - average;
+    average += delta * static_cast<double>(other.n) / static_cast<double>(combined);
+    m2 += other.m2 + delta * delta * static_cast<double>(n) * static_cast<double>(other.n) /
+                         static_cast<double>(combined);
+    total += other.total;
+    lowest = std::min(lowest, other.lowest);
+    highest = std::max(highest, other.highest);
+    n = combined;
+}
+
+RunningStat RunningStat::fromMoments(uint64_t count, double sum, double sumOfSquares, double min, double max)
+{
+    RunningStat stat;
+    if (count == 0)
+        return stat;
+    stat.n = count;
+    stat.total = sum;
+    stat.average = sum / static_cast<double>(count);
+    stat.m2 = std::max(0.0, sumOfSquares - sum * stat.average);
+    stat.lowest = min;
+    stat.highest = max;
+    return stat;
+}
+
+void RunningStat::encode(std::string &out) const
+{
+    putU64(out, n);
+    putF64(out, total);
+    putF64(out, average);
+    putF64(out, m2);
+    putF64(out, lowest);
+    putF64(out, highest);
+}
+
+bool RunningStat::decode(ByteReader &in)
+{
+    return in.u64(n) && in.f64(total) && in.f64(average) && in.f64(m2) && in.f64(lowest) && in.f64(highest);
+}
+
+double RunningStat::variance() const
+{
+    return n > 1 ? m2 / static_cast<double>(n) : 0.0;
+}
+
+double RunningStat::stddev() const
+{
+    return std::sqrt(variance());
+}
+
+FixedHistogram::FixedHistogram(int lower, int upper, int width)
+    : lower(lower), width(std::max(1, width)),
+      buckets(static_cast<size_t>(std::max(0, (upper - lower + this->width - 1) / this->width)))
+{
+}
+
+void FixedHistogram::add(int value, uint64_t times)
+{
+    if (value < lower)
+    {
+        below += times;
+        return;
+    }
+    size_t bucket = static_cast<size_t>((static_cast<int64_t>(value) - lower) / width);
+    if (bucket >= buckets.size())
+        above += times;
+    else
+        buckets[bucket] += times;
+}
+
+void FixedHistogram::merge(const FixedHistogram &other)
+{
+    for (size_t i = 0; i < buckets.size() && i < other.buckets.size(); ++i)
+        buckets[i] += other.buckets[i];
+    below += other.below;
+    above += other.above;
+}
+
+void FixedHistogram::encode(std::string &out) const
+{
+    putU64(out, below);
+    putU64(out, above);
+    // Only the non-empty buckets, as (bucket, count) pairs.
+    size_t used = std::count_if(buckets.begin(), buckets.end(), [](uint64_t count)
+                                { return count > 0; });
+    putU32(out, static_cast<uint32_t>(used));
+    for (size_t i = 0; i < buckets.size(); ++i)
+    {
+        if (buckets[i] == 0)
+            continue;
+        putU32(out, static_cast<uint32_t>(i));
+        putU64(out, buckets[i]);
+    }
+}
+
+bool FixedHistogram::decode(ByteReader &in)
+{
+    uint32_t used;
+    if (!in.u64(below) || !in.u64(above) || !in.u32(used))
+        return false;
+    std::fill(buckets.begin(), buckets.end(), 0);
+    for (uint32_t i = 0; i < used; ++i)
+    {
+        uint32_t bucket;
+        uint64_t count;
+        if (!in.u32(bucket) || !in.u64(count) || bucket >= buckets.size())
+            return false;
+        buckets[bucket] = count;
+    }
+    return true;
+}
+
+PrintStatistics::PrintStatistics()
+    : speedHistogram(0, 1000, 1),
+      temperatureHistogram(0, 500, 5),
+      timeHistogram(0, 3600, 60)
+{
+}
+
+void PrintStatistics::addLayer(const Layer &layer)
+{
+    layerCount++;
+    if (!layer.layerError.empty() && layer.layerError != "SUCCESS")
+        errors[layer.layerError]++;
+    materials[layer.materialType]++;
+
+    speed.add(layer.printSpeed);
+    speedHistogram.add(layer.printSpeed);
+    temperature.add(layer.extrusionTemperature);
+    temperatureHistogram.add(layer.extrusionTemperature);
+    time.add(layer.layerTimeSeconds);
+    timeHistogram.add(layer.layerTimeSeconds);
+}
+
+void PrintStatistics::merge(const PrintStatistics &other)
+{
+    layerCount += other.layerCount;
+    speed.merge(other.speed);
+    temperature.merge(other.temperature);
+    time.merge(other.time);
+    speedHistogram.merge(other.speedHistogram);
+    temperatureHistogram.merge(other.temperatureHistogram);
+    timeHistogram.merge(other.timeHistogram);
+    for (const auto &[material, count] : other.materials)
+        materials[material] += count;
+    for (const auto &[error, count] : other.errors)
+        errors[error] += count;
+}
+
+static void encodeCounts(std::string &out, const std::map<std::string, uint64_t> &counts)
+{
+    putU32(out, static_cast<uint32_t>(counts.size()));
+    for (const auto &[name, count] : counts)
+    {
+        putString(out, name);
+        putU64(out, count);
+    }
+}
+
+static bool decodeCounts(ByteReader &in, std::map<std::string, uint64_t> &counts)
+{
+    uint32_t size;
+    if (!in.u32(size))
+        return false;
+    counts.clear();
+    for (uint32_t i = 0; i < size; ++i)
+    {
+        std::string name;
+        uint64_t count;
+        if (!in.string(name) || !in.u64(count))
+            return false;
+        counts[name] = count;
+    }
+    return true;
+}
+
+void PrintStatistics::encode(std::string &out) const
+{
+    putU64(out, layerCount);
+    speed.encode(out);
+    temperature.encode(out);
+    time.encode(out);
+    speedHistogram.encode(out);
+    temperatureHistogram.encode(out);
+    timeHistogram.encode(out);
+    encodeCounts(out, materials);
+    encodeCounts(out, errors);
+}
+
+bool PrintStatistics::decode(ByteReader &in)
+{
+    return in.u64(layerCount) && speed.decode(in) && temperature.decode(in) && time.decode(in) &&
+           speedHistogram.decode(in) && temperatureHistogram.decode(in) && timeHistogram.decode(in) &&
+           decodeCounts(in, materials) && decodeCounts(in, errors);
+}
+
+static RunningStat columnStat(const LayerTable &table, LayerTable::IntColumn column)
+{
+    ColumnAggregate aggregate = table.aggregate(column);
+    return RunningStat::fromMoments(aggregate.count, static_cast<double>(aggregate.sum),
+                                    static_cast<double>(aggregate.sumOfSquares), aggregate.min, aggregate.max);
+}
+
+void PrintStatistics::addTable(const LayerTable &table)
+{
+    layerCount += table.size();
+
+    const StringDictionary &materialNames = table.dictionary(LayerTable::MATERIAL_TYPE);
+    std::vector<uint64_t> perMaterial = table.countBy(LayerTable::MATERIAL_TYPE);
+    for (uint32_t code = 0; code < perMaterial.size(); ++code)
+    {
+        if (perMaterial[code] > 0)
+            materials[std::string(materialNames.value(code))] += perMaterial[code];
+    }
+
+    const StringDictionary &errorNames = table.dictionary(LayerTable::LAYER_ERROR);
+    std::vector<uint64_t> perError = table.countBy(LayerTable::LAYER_ERROR);
+    for (uint32_t code = 0; code < perError.size(); ++code)
+    {
+        std::string_view error = errorNames.value(code);
+        if (perError[code] > 0 && !error.empty() && error != "SUCCESS")
+            errors[std::string(error)] += perError[code];
+    }
+
+    speed.merge(columnStat(table, LayerTable::PRINT_SPEED));
+    temperature.merge(columnStat(table, LayerTable::EXTRUSION_TEMPERATURE));
+    time.merge(columnStat(table, LayerTable::LAYER_TIME_SECONDS));
+    for (int32_t value : table.column(LayerTable::PRINT_SPEED))
+        speedHistogram.add(value);
+    for (int32_t value : table.column(LayerTable::EXTRUSION_TEMPERATURE))
+        temperatureHistogram.add(value);
+    for (int32_t value : table.column(LayerTable::LAYER_TIME_SECONDS))
+        timeHistogram.add(value);
+}
@@ -0,0 +1,53 @@
+#include "replay_clock.h"
+#include <algorithm>
+#include <thread>
+
+// How long before a deadline waitUntil stops sleeping and starts spinning.
+static constexpr auto kSpinWindow = std::chrono::microseconds(200);
+// Longest single sleep, so a stop request is noticed promptly.
+static constexpr auto kMaxSleep = std::chrono::milliseconds(50);
+
+ReplayClock::ReplayClock(double speed)
+    : speed(speed > 0.0 ? speed : 1.0)
+{
+}
+
+void ReplayClock::start()
+{
+    origin = Clock::now();
+    totalSeconds = 0;
+    lagMs = RunningStat();
+}
+
+ReplayClock::Clock::time_point ReplayClock::advance(int seconds)
+{
+    totalSeconds += static_cast<uint64_t>(std::max(0, seconds));
+    std::chrono::duration<double> offset(static_cast<double>(totalSeconds) / speed);
+    return origin + std::chrono::duration_cast<Clock::duration>(offset);
+}
+
+bool ReplayClock::waitUntil(Clock::time_point deadline, const std::atomic<bool> &stop) const
+{
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        Clock::time_point now = Clock::now();
+        if (now >= deadline)
+            return true;
+        Clock::duration remaining = deadline - now;
+        if (remaining > kSpinWindow)
+            std::this_thread::sleep_for(std::min<Clock::duration>(remaining - kSpinWindow, kMaxSleep));
+        else
+            std::this_thread::yield();
+    }
+    return false;
+}
+
+void ReplayClock::recordLag(Clock::time_point deadline, Clock::time_point published)
+{
+    lagMs.add(std::chrono::duration<double, std::milli>(published - deadline).count());
+}
+
+double ReplayClock::elapsedSeconds() const
+{
+    return std::chrono::duration<double>(Clock::now() - origin).count();
+}
@@ -0,0 +1,154 @@
+#include "trace.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "spdlog/spdlog.h"
+
+std::atomic<bool> Trace::active{false};
+
+struct TraceEvent
+{
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+    int layer;
+    uint64_t bytes;
+    const char *outcome;
+};
+
+// Written only by its thread; read by finish() once the thread is done.
+// 'events' grows to kEventsPerThread, so short-lived threads stay small,
+// then wraps around.
+struct TraceRing
+{
+    int tid = 0;
+    const char *name = nullptr;
+    std::vector<TraceEvent> events;
+    std::atomic<uint64_t> written{0};
+};
+
+// Rings outlive their threads, so finish() can read them afterwards.
+static std::mutex ringsMutex;
+static std::vector<std::unique_ptr<TraceRing>> rings;
+static thread_local TraceRing *threadRing = nullptr;
+static uint64_t origin = 0;
+
+static TraceRing *ringForThread()
+{
+    if (threadRing)
+        return threadRing;
+    auto ring = std::make_unique<TraceRing>();
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    ring->tid = static_cast<int>(rings.size()) + 1;
+    threadRing = ring.get();
+    rings.push_back(std::move(ring));
+    return threadRing;
+}
+
+uint64_t Trace::now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+void Trace::start()
+{
+    origin = now();
+    active.store(true, std::memory_order_relaxed);
+}
+
+void Trace::record(const char *name, uint64_t start, int layer, uint64_t bytes, const char *outcome)
+{
+    if (!enabled())
+        return;
+    uint64_t end = now();
+    TraceRing *ring = ringForThread();
+    uint64_t slot = ring->written.load(std::memory_order_relaxed);
+    TraceEvent event{name, start, end - start, layer, bytes, outcome};
+    if (slot < kEventsPerThread)
+        ring->events.push_back(event);
+    else
+        ring->events[slot % kEventsPerThread] = event;
+    ring->written.store(slot + 1, std::memory_order_release);
+}
+
+void Trace::nameThread(const char *name)
+{
+    if (enabled())
+        ringForThread()->name = name;
+}
+
+const char *Trace::threadName()
+{
+    return enabled() ? ringForThread()->name : nullptr;
+}
+
+bool Trace::finish(const std::string &path)
+{
+    active.store(false, std::memory_order_relaxed);
+    std::FILE *out = std::fopen(path.c_str(), "w");
+    if (!out)
+    {
+        spdlog::error("Cannot write trace {}.", path);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(ringsMutex);
+    uint64_t spans = 0;
+    uint64_t overwritten = 0;
+    const char *separator = "";
+    std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", out);
+    for (const auto &ring : rings)
+    {
+        if (ring->name)
+        {
+            std::fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                         separator, ring->tid, ring->name);
+            separator = ",\n";
+        }
+        uint64_t written = ring->written.load(std::memory_order_acquire);
+        uint64_t first = written > kEventsPerThread ? written - kEventsPerThread : 0;
+        overwritten += first;
+        for (uint64_t i = first; i < written; ++i)
+        {
+            const TraceEvent &event = ring->events[i % kEventsPerThread];
+            // Spans started before start() (an async one in flight) begin at 0.
+            uint64_t start = event.start > origin ? event.start - origin : 0;
+            // Timestamps are in microseconds.
+            std::fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"fakeprinter\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                              "\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                         separator, event.name, ring->tid, start / 1000.0, event.duration / 1000.0);
+            const char *argSeparator = "";
+            if (event.layer >= 0)
+            {
+                std::fprintf(out, "\"layer\":%d", event.layer);
+                argSeparator = ",";
+            }
+            if (event.bytes > 0)
+            {
+                std::fprintf(out, "%s\"bytes\":%llu", argSeparator, static_cast<unsigned long long>(event.bytes));
+                argSeparator = ",";
+            }
+            if (event.outcome)
+                std::fprintf(out, "%s\"outcome\":\"%s\"", argSeparator, event.outcome);
+            std::fputs("}}", out);
+            separator = ",\n";
+            spans++;
+        }
+    }
+    std::fputs("\n]}\n", out);
+    bool ok = std::fclose(out) == 0;
+    if (!ok)
+    {
+        spdlog::error("Cannot write trace {}.", path);
+        return false;
+    }
+    spdlog::info("Trace: {} spans on {} threads written to {}.", spans, rings.size(), path);
+    if (overwritten > 0)
+        spdlog::warn("Trace: {} older spans were overwritten; each thread keeps its last {}.", overwritten,
+                     kEventsPerThread);
+    return true;
+}
@@ -0,0 +1,100 @@
+#include "work_stealing_pool.h"
+#include <algorithm>
+
+// The pool and worker index of the calling thread, if it is a pool worker.
+static thread_local const WorkStealingPool *currentPool = nullptr;
+static thread_local unsigned currentWorker = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i)
+        workers.push_back(std::make_unique<Worker>());
+    for (unsigned i = 0; i < threads; ++i)
+        this->threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+void WorkStealingPool::submit(std::function<void()> task)
+{
+    unsigned target = currentPool == this
+                          ? currentWorker
+                          : nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    {
+        // Counted before it is pushed, so 'queued' never drops below the
+        // number of tasks in the deques, and under the sleep mutex, so a
+        // worker about to sleep cannot miss it.
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        queued.fetch_add(1, std::memory_order_relaxed);
+    }
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+bool WorkStealingPool::take(unsigned self, std::function<void()> &task)
+{
+    {
+        Worker &own = *workers[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); ++i)
+    {
+        Worker &victim = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            stolen.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(unsigned self)
+{
+    currentPool = this;
+    currentWorker = self;
+    std::function<void()> task;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this]
+                      { return stopping || queued.load(std::memory_order_relaxed) > 0; });
+            if (stopping && queued.load(std::memory_order_relaxed) == 0)
+                return;
+        }
+        // The task counted in 'queued' may already have been taken by
+        // another worker; then this one just goes back to waiting.
+        if (!take(self, task))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        task();
+        task = nullptr;
+    }
+}